@@ -21,9 +21,223 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#ifdef CANFIX_USE_HISTORY
+#include <math.h>
+#endif
 
 #include "canfix.h"
 
+#if defined(CANFIX_USE_HISTORY) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef CANFIX_USE_STATS
+static void _stats_count(canfix_stats *s, uint16_t id, uint8_t node, uint8_t length, uint8_t *data);
+#endif
+
+/* Each callback can be given in the form that takes the object's context as
+   its first argument.  That one is called if it is set. */
+#define _HAS_CALLBACK(h, f) ((h)->cb->f##_callback || (h)->cb->f##_ctx_callback)
+#define _CALLBACK(h, f, ...) ((h)->cb->f##_ctx_callback ? \
+    (h)->cb->f##_ctx_callback((h)->context, __VA_ARGS__) : (h)->cb->f##_callback(__VA_ARGS__))
+#define _CALLBACK0(h, f) ((h)->cb->f##_ctx_callback ? \
+    (h)->cb->f##_ctx_callback((h)->context) : (h)->cb->f##_callback())
+
+#ifdef CANFIX_USE_FD
+#define _RX_FD(h) ((h)->rx_fd)                      // The frame being handled was FD
+#define _TX_FD(h) _HAS_CALLBACK(h, fd_write)        // We are able to send FD
+#else
+#define _RX_FD(h) 0
+#define _TX_FD(h) 0
+#endif
+
+/* The node number, bitrate, description and enable bits can be changed by
+   the receive thread while other threads are sending.  With
+   CANFIX_USE_ATOMIC they are stored with release and loaded with acquire
+   semantics so a sender sees either the old value or the new one.  The
+   packing buffer and the statistics counters are plain memory, so with
+   packing turned on or statistics attached the senders need a lock. */
+#ifdef CANFIX_USE_ATOMIC
+#define _LOAD(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define _STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else
+#define _LOAD(x)     (x)
+#define _STORE(x, v) ((x) = (v))
+#endif
+
+/* Every frame that the library sends goes through here.  Frames longer than
+   eight bytes, and any that fd is set for, are sent with the FD write
+   callback.  Without one they are sent as classic frames if they fit. */
+static int
+_write_as(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data, uint8_t fd) {
+#ifdef CANFIX_USE_FD
+    if(! _HAS_CALLBACK(h, fd_write)) fd = 0;
+#else
+    fd = 0;
+#endif
+    if(length > 8 && ! fd) return -1;
+#ifdef CANFIX_USE_STATS
+    if(h->stats) _stats_count(h->stats, id, _LOAD(h->node), length, data);
+#endif
+#ifdef CANFIX_USE_FD
+    if(fd) return _CALLBACK(h, fd_write, id, length, data, CANFIX_FD | h->fd_flags);
+#endif
+    return _CALLBACK(h, write, id, length, data);
+}
+
+static int
+_write(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
+    return _write_as(h, id, length, data, length > 8);
+}
+
+#ifdef CANFIX_USE_FD
+/* The data lengths that an FD frame can have */
+static const uint8_t _fd_lengths[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+/* Returns the length that a frame of this many bytes is padded to */
+uint8_t
+canfix_fd_length(uint8_t length) {
+    for(uint8_t n = 0; n < sizeof(_fd_lengths); n++) {
+        if(_fd_lengths[n] >= length) return _fd_lengths[n];
+    }
+    return 64;
+}
+#endif
+
+static const canfix_callbacks _no_callbacks;
+
+#ifdef CANFIX_USE_ID_CACHE
+/* Returns the copy of the cache that answers are sent from.  Under
+   CANFIX_USE_ATOMIC the copy is counted as being read until _id_release(),
+   and the count is taken before checking that it is still the current one,
+   so _id_build() never writes to a copy that an answer is reading. */
+static canfix_id_cache *
+_id_acquire(canfix_object *h) {
+#ifdef CANFIX_USE_ATOMIC
+    uint8_t n;
+
+    for(;;) {
+        n = __atomic_load_n(&h->id_current, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&h->id_readers[n], 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&h->id_current, __ATOMIC_SEQ_CST) == n) return &h->id_cache[n];
+        __atomic_sub_fetch(&h->id_readers[n], 1, __ATOMIC_SEQ_CST);
+    }
+#else
+    return &h->id_cache[0];
+#endif
+}
+
+static void
+_id_release(canfix_object *h, canfix_id_cache *c) {
+#ifdef CANFIX_USE_ATOMIC
+    __atomic_sub_fetch(&h->id_readers[c - h->id_cache], 1, __ATOMIC_SEQ_CST);
+#else
+    (void)h;
+    (void)c;
+#endif
+}
+
+/* Builds the identification answer and the description frames for the
+   current node number and description.  It is called by whatever changes
+   them, canfix_init(), canfix_set_description() and canfix_set_node(), so
+   answering a request only reads the frames.  Under CANFIX_USE_ATOMIC they
+   are built into the copy that isn't current, after any answer still
+   reading it from two builds ago is done, and published with one store.
+   Only one thread may build, the one that runs canfix_exec(). */
+static void
+_id_build(canfix_object *h) {
+    canfix_id_cache *c;
+    canfix_frame *f;
+    const char *description = _LOAD(h->description);
+    int length = description ? strlen(description) : 0;
+    int packets = description ? length / 4 + 1 : 0;
+#ifdef CANFIX_USE_ATOMIC
+    uint8_t next = ! __atomic_load_n(&h->id_current, __ATOMIC_RELAXED);
+
+    while(__atomic_load_n(&h->id_readers[next], __ATOMIC_SEQ_CST)) ;
+    c = &h->id_cache[next];
+#else
+    c = &h->id_cache[0];
+#endif
+
+    c->node = _LOAD(h->node);
+    c->desc = description;
+    c->count = 0;
+    if(1 + packets <= CANFIX_ID_FRAMES) {
+        c->count = 1 + packets;
+    } else {
+        packets = -1;
+    }
+    for(int n = 0; n <= packets; n++) {
+        f = &c->frames[n];
+        f->id = NSM_START + c->node;
+        f->length = 8;
+#ifdef CANFIX_USE_FD
+        f->flags = 0;
+#endif
+        if(n == 0) {
+            f->data[0] = NSM_ID;
+            f->data[2] = 1;
+            f->data[3] = h->device;
+            f->data[4] = h->revision;
+            memcpy(&f->data[5], &h->model, 3);
+        } else {
+            f->data[0] = NSM_DESC;
+            f->data[2] = n - 1;
+            f->data[3] = (n - 1) >> 8;
+            for(int i = 0; i < 4; i++) {
+                f->data[4 + i] = (n - 1) * 4 + i < length ? description[(n - 1) * 4 + i] : '\0';
+            }
+        }
+    }
+#ifdef CANFIX_USE_ATOMIC
+    __atomic_store_n(&h->id_current, next, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Sends the whole answer from the cache, with one call to the batch write
+   callback if there is one.  The destination is filled in on a copy of the
+   frames, so answers never write to the cache.  Returns zero if the cache
+   can't be used. */
+static int
+_id_send(canfix_object *h, uint8_t dest) {
+    canfix_id_cache *c = _id_acquire(h);
+    uint8_t count = c->count;
+    uint8_t data[8];
+
+    if(count == 0) {
+        _id_release(h, c);
+        return 0;
+    }
+    if(_HAS_CALLBACK(h, batch_write)) {
+        canfix_frame frames[CANFIX_ID_FRAMES];
+
+        memcpy(frames, c->frames, count * sizeof(canfix_frame));
+        _id_release(h, c);
+        for(uint8_t n = 0; n < count; n++) frames[n].data[1] = dest;
+#ifdef CANFIX_USE_STATS
+        for(uint8_t n = 0; h->stats && n < count; n++) {
+            _stats_count(h->stats, frames[n].id, frames[0].id - NSM_START, 8, frames[n].data);
+        }
+#endif
+        _CALLBACK(h, batch_write, frames, count);
+    } else {
+        for(uint8_t n = 0; n < count; n++) {
+            memcpy(data, c->frames[n].data, 8);
+            data[1] = dest;
+            _write_as(h, c->frames[n].id, 8, data, 0);
+        }
+        _id_release(h, c);
+    }
+    return 1;
+}
+#endif
+
+#ifdef CANFIX_SIZE_REPORT
+/* Only built for make size_report so that bss shows the size of an object */
+canfix_object canfix_size_report;
+#endif
+
 void
 canfix_init(canfix_object *h, uint8_t node, uint8_t device, uint8_t revision, uint32_t model) {
     h->node = node;
@@ -31,77 +245,2884 @@ canfix_init(canfix_object *h, uint8_t node, uint8_t device, uint8_t revision, ui
     h->revision = revision;
     h->model = model;
 
-    h->write_callback = NULL;
-    h->alarm_callback = NULL;
-    h->node_set_callback = NULL;
-    h->bitrate_callback = NULL;
-    h->report_callback = NULL;
-    h->twoway_callback = NULL;
-    h->config_callback = NULL;
-    h->query_callback = NULL;
-    h->parameter_callback = NULL;
-    h->alarm_callback = NULL;
-    h->firmware_callback = NULL;
+    h->cb = &_no_callbacks;
+    h->context = NULL;
+    h->description = NULL;
+    h->bitrate = 0;
+#ifdef CANFIX_USE_ID_CACHE
+#ifdef CANFIX_USE_ATOMIC
+    h->id_current = 0;
+    h->id_readers[0] = h->id_readers[1] = 0;
+#endif
+    _id_build(h);
+#endif
+    h->now = 0;
+#ifdef CANFIX_USE_PACKED
+    h->packing = 0;
+    h->pack_delay = CANFIX_PACK_DELAY;
+    h->pack_len = 0;
+#endif
+#ifdef CANFIX_USE_FD
+    h->fd_flags = CANFIX_FD_BRS;
+    h->rx_fd = 0;
+#endif
+#ifdef CANFIX_USE_FIRMWARE
+    h->firmware.state = 0;
+#endif
+#ifdef CANFIX_USE_QUEUE
+    h->head = 0;
+    h->tail = 0;
+    h->count = 0;
+#ifdef CANFIX_USE_PACKED
+    h->poll_skip = 0;
+#endif
+#ifdef CANFIX_USE_QUEUE_CLASSES
+    h->phead = 0;
+    h->ptail = 0;
+    h->pcount = 0;
+    h->pushed = 0;
+    h->removed = 0;
+#endif
+    h->queue_policy = CANFIX_QUEUE_OVERWRITE;
+    memset(&h->queue_stats, 0, sizeof(canfix_queue_stats));
+#endif
+#ifdef CANFIX_USE_CONFIG_TABLE
+    h->config_table = NULL;
+    h->config_count = 0;
+#endif
+#ifdef CANFIX_USE_STORE
+    h->store = NULL;
+#endif
+#ifdef CANFIX_USE_PARAM_ENABLE
+    memset(h->disabled, 0, sizeof(h->disabled));
+#endif
+#ifdef CANFIX_USE_DEFERRED
+    for(int n = 0; n < CANFIX_DEFER_LEN; n++) h->deferred[n].code = 0xFF;
+    h->jitter = CANFIX_JITTER_OFF;
+    h->seed = model ^ ((uint32_t)node << 24) ^ 0x9E3779B9;
+#endif
+#ifdef CANFIX_USE_UPLOADER
+    h->uploader = NULL;
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+    h->directory = NULL;
+#endif
+#ifdef CANFIX_USE_CFGCLIENT
+    h->cfgclient = NULL;
+#endif
+#ifdef CANFIX_USE_SESSIONS
+    h->sessions = NULL;
+#endif
+#ifdef CANFIX_USE_ALARMS
+    h->alarms = NULL;
+#endif
+#ifdef CANFIX_USE_CACHE
+    h->cache = NULL;
+#endif
+#ifdef CANFIX_USE_STATS
+    h->stats = NULL;
+#endif
+#ifdef CANFIX_USE_GATEWAY
+    h->gateway = NULL;
+#endif
+}
+
+/* Set's the node description string.  If this is set it will be sent after
+   the Node Identification message is sent. */
+void canfix_set_description(canfix_object *h, char *description) {
+    _STORE(h->description, description);
+#ifdef CANFIX_USE_ID_CACHE
+    _id_build(h);
+#endif
+}
+
+/* Changes the node number, as a Node Set message does but without telling
+   anyone.  This is what to use rather than writing h->node. */
+void
+canfix_set_node(canfix_object *h, uint8_t node) {
+    _STORE(h->node, node);
+#ifdef CANFIX_USE_ID_CACHE
+    _id_build(h);
+#endif
+}
+
+/* The node number and the NSM_BITRATE code last set from the network.  The
+   bitrate is zero if it hasn't been set. */
+uint8_t
+canfix_get_node(canfix_object *h) {
+    return _LOAD(h->node);
+}
+
+uint8_t
+canfix_get_bitrate(canfix_object *h) {
+    return _LOAD(h->bitrate);
+}
+
+/* Gives the library all of its callbacks at once.  The table isn't copied
+ * so it can be const and live in flash.  Setting one callback on its own
+ * afterwards copies the table into the object first.  With
+ * CANFIX_CONST_CALLBACKS that copy isn't kept and this is the only way to
+ * set the callbacks. */
+void
+canfix_set_callbacks(canfix_object *h, const canfix_callbacks *cb) {
+    h->cb = cb ? cb : &_no_callbacks;
+}
+
+/* Sets what the callbacks that take a context are given */
+void
+canfix_set_context(canfix_object *h, void *context) {
+    h->context = context;
+}
+
+void *
+canfix_get_context(canfix_object *h) {
+    return h->context;
+}
+
+#ifdef CANFIX_USE_FD
+/* Turns the bitrate switch on or off for the FD frames we send */
+void
+canfix_set_fd_brs(canfix_object *h, uint8_t brs) {
+    h->fd_flags = brs ? CANFIX_FD_BRS : 0;
+}
+#endif
+
+#ifndef CANFIX_CONST_CALLBACKS
+/* The callbacks that the setters below change */
+static canfix_callbacks *
+_callbacks(canfix_object *h) {
+    if(h->cb != &h->callbacks) {
+        h->callbacks = *h->cb;
+        h->cb = &h->callbacks;
+    }
+    return &h->callbacks;
+}
+
+void
+canfix_set_write_callback(canfix_object *h, int (*f)(uint16_t, uint8_t, uint8_t *)) {
+	_callbacks(h)->write_callback = f;
+}
+
+#ifdef CANFIX_USE_FD
+/* Sets the function that sends FD frames.  It is given the frame flags as
+ * well as the data and the length is always one that FD allows.  Frames are
+ * only sent as FD when they don't fit in a classic frame or when we are
+ * answering an FD frame, so a node on a mixed network still answers classic
+ * requests the classic way. */
+void
+canfix_set_fd_write_callback(canfix_object *h, int (*f)(uint16_t, uint8_t, uint8_t *, uint8_t)) {
+    _callbacks(h)->fd_write_callback = f;
+}
+#endif
+
+void
+canfix_set_alarm_callback(canfix_object *h, void (*f)(uint8_t, uint16_t, uint8_t*, uint8_t)) {
+    _callbacks(h)->alarm_callback = f;
+}
+
+void
+canfix_set_parameter_callback(canfix_object *h, void (*f)(canfix_parameter)) {
+    _callbacks(h)->parameter_callback = f;
+}
+
+void
+canfix_set_node_set_callback(canfix_object *h, void (*f)(uint8_t)) {
+    _callbacks(h)->node_set_callback = f;
+}
+
+void
+canfix_set_report_callback(canfix_object *h, void (*f)(void)) {
+    _callbacks(h)->report_callback = f;
+}
+
+#ifdef CANFIX_USE_CHANNELS
+void
+canfix_set_twoway_callback(canfix_object *h, uint8_t (*f)(uint8_t, uint16_t)) {
+    _callbacks(h)->twoway_callback = f;
+}
+#endif
+
+#ifdef CANFIX_USE_CONFIG
+void
+canfix_set_config_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t *, uint8_t)) {
+    _callbacks(h)->config_callback = f;
+}
+
+void
+canfix_set_query_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t *, uint8_t *)) {
+    _callbacks(h)->query_callback = f;
+}
+#endif
+
+void
+canfix_set_firmware_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t)) {
+    _callbacks(h)->firmware_callback = f;
+}
+
+#ifdef CANFIX_USE_ID_CACHE
+/* If this is set the identification answer and the description are given
+   to it as one array of frames instead of going to the write callback one
+   at a time */
+void
+canfix_set_batch_write_callback(canfix_object *h, int (*f)(const canfix_frame *, uint16_t)) {
+    _callbacks(h)->batch_write_callback = f;
+}
+#endif
+
+#ifdef CANFIX_USE_FIRMWARE
+/* The firmware write callback is the sink for a firmware download.  If it is
+   set the library handles the block transfer on the channel that the firmware
+   callback accepted.  It is called with the subsystem, the address and the
+   data for each frame in order.  A call with a length of zero marks the end of
+   a block so that a page buffer can be committed.  A non zero return aborts
+   the download. */
+void
+canfix_set_firmware_write_callback(canfix_object *h, uint8_t (*f)(uint8_t, uint32_t, uint8_t *, uint8_t)) {
+    _callbacks(h)->firmware_write_callback = f;
+}
+
+/* Called with one of the FW_STATUS_* codes when a download is finished */
+void
+canfix_set_firmware_done_callback(canfix_object *h, void (*f)(uint8_t)) {
+    _callbacks(h)->firmware_done_callback = f;
+}
+#endif
+#endif
+
+//void canfix_set_stream_callback(void (*f)(uint8_t, uint8_t *, uint8_t));
+
+#ifdef CANFIX_USE_CONFIG_TABLE
+static const uint8_t _type_size[] = {0, 1, 2, 1, 1, 2, 2, 4, 4, 4};
+
+/* Gives the library a table of configuration keys to serve.  Configuration
+ * set and query messages for keys in the table are handled here without
+ * calling the config or query callbacks, which are still called for keys
+ * that aren't in the table.  The table isn't copied so it can be const and
+ * live in flash.  Returns -1 if the table isn't sorted by key or has a bad
+ * type. */
+int
+canfix_set_config_table(canfix_object *h, const canfix_config_key *table, uint16_t count) {
+    for(uint16_t n = 0; n < count; n++) {
+        if(table[n].type == 0 || table[n].type >= sizeof(_type_size)) return -1;
+        if(n > 0 && table[n].key <= table[n-1].key) return -1;
+    }
+    h->config_table = table;
+    h->config_count = count;
+    return 0;
+}
+
+/* Binary search of the configuration table.  Returns NULL if the key isn't
+   there. */
+const canfix_config_key *
+canfix_config_lookup(canfix_object *h, uint16_t key) {
+    int lo = 0, hi = h->config_count - 1, mid;
+
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(h->config_table[mid].key == key) return &h->config_table[mid];
+        if(h->config_table[mid].key < key) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+static int
+_config_in_range(const canfix_config_key *k, uint8_t *value) {
+    int64_t v;
+    float f;
+
+    if(k->min == k->max) return 1;
+    switch(k->type) {
+        case CANFIX_TYPE_SHORT: v = *(int8_t *)value; break;
+        case CANFIX_TYPE_BYTE:
+        case CANFIX_TYPE_USHORT: v = *value; break;
+        case CANFIX_TYPE_INT: v = (int16_t)(value[0] | value[1] << 8); break;
+        case CANFIX_TYPE_WORD:
+        case CANFIX_TYPE_UINT: v = (uint16_t)(value[0] | value[1] << 8); break;
+        case CANFIX_TYPE_DINT: v = (int32_t)(value[0] | value[1] << 8 | (uint32_t)value[2] << 16 | (uint32_t)value[3] << 24); break;
+        case CANFIX_TYPE_UDINT: v = (uint32_t)(value[0] | value[1] << 8 | (uint32_t)value[2] << 16 | (uint32_t)value[3] << 24); break;
+        case CANFIX_TYPE_FLOAT:
+            memcpy(&f, value, 4);
+            return f >= k->min && f <= k->max;
+        default:
+            return 0;
+    }
+    return v >= k->min && v <= k->max;
+}
+
+/* Sets a key from a configuration set message.  Returns zero or one of the
+   CFG_ERR_* codes. */
+static uint8_t
+_config_set(const canfix_config_key *k, uint8_t *value, uint8_t length) {
+    uint8_t result;
+
+    if(k->flags & CFG_READONLY) return CFG_ERR_READONLY;
+    if(k->type >= sizeof(_type_size) || length != _type_size[k->type]) return CFG_ERR_WRNGTYPE;
+    if(! _config_in_range(k, value)) return CFG_ERR_OUTOFRNG;
+    if(k->validate) {
+        result = k->validate(k->key, value);
+        if(result) return result;
+    }
+    memcpy(k->storage, value, length);
+    return 0;
+}
+#endif
+
+#ifdef CANFIX_USE_STORE
+/* The configuration store is a journal of records in one sector of the
+ * block device.  Each sector starts with a header of [magic(2), sequence(4),
+ * state(1), spare(1)] and each record is [key(2), length(1), crc(2), data].
+ * Setting a key appends a record so the flash is never rewritten in place.
+ * When the sector is three quarters full the current value of every key is
+ * copied into the next sector a few keys per tick, and when that is done its
+ * state byte is cleared to mark it complete.  The sectors are used in turn so
+ * the wear is spread over all of them.  At start up the complete sector with
+ * the highest sequence number is read once from front to back and the last
+ * record for each key wins.  Keys from STORE_DISABLED up are reserved for
+ * the parameter enable bits, four bytes of the bitset to a key. */
+#define STORE_MAGIC    0xCF5A
+#define STORE_HEADER   8
+#define STORE_RECORD   5
+#define STORE_DISABLED 0xFF00
+#ifdef CANFIX_USE_PARAM_ENABLE
+#define STORE_CHUNKS   ((sizeof(((canfix_object *)0)->disabled) + 3) / 4)
+#else
+#define STORE_CHUNKS   0
+#endif
+
+#define STORE_IDLE  0
+#define STORE_ERASE 1
+#define STORE_COPY  2
+
+static uint16_t
+_crc16(uint16_t crc, const uint8_t *data, uint16_t length) {
+    while(length--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for(int n = 0; n < 8; n++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+/* Writes one record at *pos in the sector.  Returns -1 if it doesn't fit. */
+static int
+_store_record(canfix_store *s, uint8_t sector, uint32_t *pos, uint16_t key, uint8_t *data, uint8_t length) {
+    uint8_t buff[STORE_RECORD + 4];
+    uint16_t crc;
+
+    if(*pos + STORE_RECORD + length > s->dev->sector_size) return -1;
+    buff[0] = key;
+    buff[1] = key >> 8;
+    buff[2] = length;
+    memcpy(&buff[STORE_RECORD], data, length);
+    crc = _crc16(0xFFFF, buff, 3);
+    crc = _crc16(crc, data, length);
+    buff[3] = crc;
+    buff[4] = crc >> 8;
+    if(s->dev->write(sector * s->dev->sector_size + *pos, buff, STORE_RECORD + length)) return -1;
+    *pos += STORE_RECORD + length;
+    return 0;
+}
+
+/* Writes entry n of the things that are kept, the table keys first and then
+   the parameter enable chunks.  When compacting, chunks with nothing disabled
+   are left out since that is where they start anyway. */
+static int
+_store_entry(canfix_store *s, uint8_t sector, uint32_t *pos, uint16_t n, uint8_t compact) {
+    const canfix_config_key *k;
+#ifdef CANFIX_USE_PARAM_ENABLE
+    uint8_t length, i;
+#endif
+
+    if(n < s->h->config_count) {
+        k = &s->h->config_table[n];
+        if(k->flags & (CFG_READONLY | CFG_NOSAVE)) return 0;
+        return _store_record(s, sector, pos, k->key, k->storage, _type_size[k->type]);
+    }
+#ifdef CANFIX_USE_PARAM_ENABLE
+    n -= s->h->config_count;
+    length = sizeof(s->h->disabled) - n * 4 > 4 ? 4 : sizeof(s->h->disabled) - n * 4;
+    for(i = 0; compact && i < length && s->h->disabled[n * 4 + i] == 0; i++);
+    if(i == length) return 0;
+    return _store_record(s, sector, pos, STORE_DISABLED + n, &s->h->disabled[n * 4], length);
+#else
+    (void)compact;
+#endif
+    return 0;
+}
+
+/* Does one step of compacting into the next sector.  Returns non zero when
+   the compaction is finished.  If anything can't be written the copy is
+   started again from the erase, since the sector isn't used until it is
+   marked complete. */
+static int
+_store_compact_step(canfix_store *s) {
+    canfix_object *h = s->h;
+    uint8_t header[STORE_HEADER];
+    uint32_t seq = s->seq + 1;
+    int n;
+
+    if(s->state == STORE_ERASE) {
+        if(s->dev->erase(s->target)) return 0;
+        header[0] = STORE_MAGIC & 0xFF;
+        header[1] = STORE_MAGIC >> 8;
+        header[2] = seq;
+        header[3] = seq >> 8;
+        header[4] = seq >> 16;
+        header[5] = seq >> 24;
+        header[6] = 0xFF; /* Cleared once the copy is complete */
+        header[7] = 0xFF;
+        if(s->dev->write(s->target * s->dev->sector_size, header, STORE_HEADER)) return 0;
+        s->tpos = STORE_HEADER;
+        s->copied = 0;
+        s->state = STORE_COPY;
+        return 0;
+    }
+    for(n = 0; n < CANFIX_STORE_STEP && s->copied < h->config_count + STORE_CHUNKS; n++) {
+        if(_store_entry(s, s->target, &s->tpos, s->copied, 1)) {
+            s->state = STORE_ERASE;
+            return 0;
+        }
+        s->copied++;
+    }
+    if(s->copied < h->config_count + STORE_CHUNKS) return 0;
+    header[0] = 0x00;
+    if(s->dev->write(s->target * s->dev->sector_size + 6, header, 1)) {
+        s->state = STORE_ERASE;
+        return 0;
+    }
+    s->active = s->target;
+    s->pos = s->tpos;
+    s->seq = seq;
+    s->state = STORE_IDLE;
+    return 1;
+}
+
+static void
+_store_start_compact(canfix_store *s) {
+    s->target = (s->active + 1) % s->dev->sectors;
+    s->state = STORE_ERASE;
+}
+
+/* Reads the journal in a sector and puts the values into the table.  Returns
+   the position after the last good record. */
+static uint32_t
+_store_replay(canfix_store *s, uint8_t sector) {
+    uint8_t buff[STORE_RECORD + 4];
+    uint32_t pos = STORE_HEADER;
+    const canfix_config_key *k;
+    uint16_t key, crc;
+
+    while(pos + STORE_RECORD <= s->dev->sector_size) {
+        if(s->dev->read(sector * s->dev->sector_size + pos, buff, STORE_RECORD)) break;
+        key = buff[0] | buff[1] << 8;
+        if(key == 0xFFFF || buff[2] > 4 || pos + STORE_RECORD + buff[2] > s->dev->sector_size) break;
+        if(s->dev->read(sector * s->dev->sector_size + pos + STORE_RECORD, &buff[STORE_RECORD], buff[2])) break;
+        crc = _crc16(0xFFFF, buff, 3);
+        crc = _crc16(crc, &buff[STORE_RECORD], buff[2]);
+        if(crc != (buff[3] | buff[4] << 8)) break; /* Torn write */
+        k = canfix_config_lookup(s->h, key);
+        if(k && buff[2] == _type_size[k->type] && ! (k->flags & CFG_READONLY)) {
+            memcpy(k->storage, &buff[STORE_RECORD], buff[2]);
+        }
+#ifdef CANFIX_USE_PARAM_ENABLE
+        if(key >= STORE_DISABLED && key < STORE_DISABLED + STORE_CHUNKS &&
+           (uint32_t)(key - STORE_DISABLED) * 4 + buff[2] <= sizeof(s->h->disabled)) {
+            memcpy(&s->h->disabled[(key - STORE_DISABLED) * 4], &buff[STORE_RECORD], buff[2]);
+        }
+#endif
+        pos += STORE_RECORD + buff[2];
+    }
+    return pos;
+}
+
+/* Attaches a configuration store to the object and restores the values of
+ * the keys in the configuration table from it, so the table has to be set
+ * first.  Keys without a record keep whatever value they had.  From then on
+ * every key that is set through a configuration set message is saved.
+ * Returns -1 if the device can't be used. */
+int
+canfix_store_init(canfix_store *s, canfix_object *h, const canfix_store_device *dev) {
+    uint8_t header[STORE_HEADER];
+    uint32_t seq, pos;
+    int found = 0;
+
+    if(dev->sectors < 2 || dev->sector_size <= STORE_HEADER) return -1;
+    memset(s, 0, sizeof(canfix_store));
+    s->h = h;
+    s->dev = dev;
+    for(uint8_t n = 0; n < dev->sectors; n++) {
+        if(dev->read(n * dev->sector_size, header, STORE_HEADER)) continue;
+        if((header[0] | header[1] << 8) != STORE_MAGIC || header[6] != 0x00) continue;
+        seq = header[2] | header[3] << 8 | (uint32_t)header[4] << 16 | (uint32_t)header[5] << 24;
+        if(! found || (int32_t)(seq - s->seq) > 0) {
+            s->seq = seq;
+            s->active = n;
+            found = 1;
+        }
+    }
+    h->store = s;
+    if(! found) { /* Blank device, start it with what's in memory */
+        s->active = dev->sectors - 1;
+        _store_start_compact(s);
+        while(! _store_compact_step(s)) {
+            if(s->state == STORE_ERASE) return -1;
+        }
+        return 0;
+    }
+    pos = _store_replay(s, s->active);
+    s->pos = pos;
+    if(pos + STORE_RECORD <= dev->sector_size) {
+        if(dev->read(s->active * dev->sector_size + pos, header, 1) == 0 && header[0] != 0xFF) {
+            /* Something was half written here so start a clean sector and
+               don't write anything more to this one */
+            s->pos = dev->sector_size;
+            _store_start_compact(s);
+        }
+    }
+    return 0;
+}
+
+/* Appends entry n to the journal.  While a compaction is running the record
+   goes to both sectors so it is kept whichever one ends up good. */
+static int
+_store_save(canfix_store *s, uint16_t n) {
+    int result = 0;
+
+    if(s->state == STORE_IDLE && s->pos > s->dev->sector_size / 4 * 3) {
+        _store_start_compact(s);
+    }
+    if(s->state == STORE_COPY && _store_entry(s, s->target, &s->tpos, n, 0)) {
+        /* The copy may already be past this key so it has to start over */
+        s->state = STORE_ERASE;
+        result = -1;
+    }
+    if(_store_entry(s, s->active, &s->pos, n, 0)) {
+        if(s->state == STORE_IDLE) _store_start_compact(s);
+        /* No room left in the old sector so we finish the copy now.  The copy
+           reads the new value out of the table. */
+        while(! _store_compact_step(s)) {
+            if(s->state == STORE_ERASE) return -1;
+        }
+        return 0;
+    }
+    return result;
+}
+
+/* Saves the current value of the key.  This only needs to be called when
+ * the application changes a value itself.  Returns -1 if the key isn't in
+ * the table or couldn't be written. */
+int
+canfix_store_write(canfix_store *s, uint16_t key) {
+    const canfix_config_key *k = canfix_config_lookup(s->h, key);
+
+    if(k == NULL) return -1;
+    return _store_save(s, k - s->h->config_table);
+}
+#endif
+
+#ifdef CANFIX_USE_PARAM_ENABLE
+/* Returns non zero if the parameter type is allowed to be sent.  Anything
+   that isn't a parameter is always enabled. */
+int
+canfix_parameter_enabled(canfix_object *h, uint16_t type) {
+    type -= CANFIX_PARAM_START;
+    if(type >= CANFIX_PARAM_COUNT) return 1;
+    return ! (_LOAD(h->disabled[type >> 3]) & (1 << (type & 0x07)));
+}
+
+/* Enables or disables sending a parameter type, the same as the Enable and
+ * Disable Parameter messages do.  If a store is attached the change is saved
+ * so it lasts through a reset.  Returns -1 if the type isn't a parameter. */
+int
+canfix_set_parameter_enable(canfix_object *h, uint16_t type, uint8_t enable) {
+#ifdef CANFIX_USE_STORE
+    uint8_t old;
+#endif
+
+    type -= CANFIX_PARAM_START;
+    if(type >= CANFIX_PARAM_COUNT) return -1;
+#ifdef CANFIX_USE_STORE
+    old = _LOAD(h->disabled[type >> 3]);
+#endif
+#ifdef CANFIX_USE_ATOMIC
+    if(enable) {
+        __atomic_fetch_and(&h->disabled[type >> 3], ~(1 << (type & 0x07)), __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_or(&h->disabled[type >> 3], 1 << (type & 0x07), __ATOMIC_RELEASE);
+    }
+#else
+    if(enable) {
+        h->disabled[type >> 3] &= ~(1 << (type & 0x07));
+    } else {
+        h->disabled[type >> 3] |= 1 << (type & 0x07);
+    }
+#endif
+#ifdef CANFIX_USE_STORE
+    if(h->store && _LOAD(h->disabled[type >> 3]) != old) {
+        return _store_save(h->store, h->config_count + (type >> 5));
+    }
+#endif
+    return 0;
+}
+#endif
+
+#ifdef CANFIX_USE_DEFERRED
+/* With jitter turned on the answers to broadcast Node Identification and
+ * Report requests are put off for up to window milliseconds.  In SLOT mode
+ * each node gets its own slot of CANFIX_DEFER_SLOT milliseconds based on its
+ * node number so a bus of well numbered nodes never collides.  In RANDOM mode
+ * the delay is picked at random each time.  The description that follows an
+ * identification is sent a few frames per tick instead of all at once.
+ * Requests sent directly to this node are still answered right away. */
+void
+canfix_set_response_jitter(canfix_object *h, uint8_t mode, uint16_t window) {
+    h->jitter = mode;
+    h->jitter_window = window;
+}
+
+static void
+_defer_response(canfix_object *h, uint8_t code, uint8_t dest) {
+    canfix_deferred *d = NULL;
+    uint32_t delay;
+
+    for(int n = 0; n < CANFIX_DEFER_LEN; n++) {
+        if(h->deferred[n].code == code) return; /* Already waiting */
+        if(h->deferred[n].code == 0xFF && d == NULL) d = &h->deferred[n];
+    }
+    if(d == NULL) return;
+    if(h->jitter_window == 0) {
+        delay = 0;
+    } else if(h->jitter == CANFIX_JITTER_SLOT) {
+        delay = ((uint32_t)_LOAD(h->node) * CANFIX_DEFER_SLOT) % h->jitter_window;
+    } else {
+        h->seed ^= h->seed << 13;
+        h->seed ^= h->seed >> 17;
+        h->seed ^= h->seed << 5;
+        delay = h->seed % h->jitter_window;
+    }
+    d->code = code;
+    d->dest = dest;
+    d->packet = 0xFFFF;
+#ifdef CANFIX_USE_FD
+    d->fd = h->rx_fd;
+#endif
+    d->due = h->now + delay;
+}
+
+static uint16_t _send_description_packet(canfix_object *h, uint8_t node, const char *description,
+                                         uint8_t dest, uint16_t packet, uint8_t fd);
+
+static void
+_service_deferred(canfix_object *h) {
+    canfix_deferred *d;
+    uint8_t data[8];
+    uint8_t fd = 0;
+    int count;
+
+    for(int n = 0; n < CANFIX_DEFER_LEN; n++) {
+        d = &h->deferred[n];
+        if(d->code == 0xFF || (int32_t)(h->now - d->due) < 0) continue;
+        if(d->code == NSM_REPORT) {
+            if(_HAS_CALLBACK(h, report)) _CALLBACK0(h, report);
+            d->code = 0xFF;
+            continue;
+        }
+        count = 0;
+#ifdef CANFIX_USE_FD
+        fd = d->fd;
+#endif
+        if(d->packet == 0xFFFF) {
+            d->node = _LOAD(h->node);
+            d->description = _LOAD(h->description);
+            data[0] = NSM_ID;
+            data[1] = d->dest;
+            data[2] = 1;
+            data[3] = h->device;
+            data[4] = h->revision;
+            memcpy(&data[5], &h->model, 3);
+            _write_as(h, d->node + 0x6E0, 8, data, fd);
+            d->packet = 0;
+            count++;
+            if(! d->description) {
+                d->code = 0xFF;
+                continue;
+            }
+        }
+        while(count < CANFIX_DEFER_BURST) {
+            d->packet = _send_description_packet(h, d->node, d->description, d->dest, d->packet, fd);
+            if(d->packet == 0) {
+                d->code = 0xFF;
+                break;
+            }
+            count++;
+        }
+    }
+}
+#endif
+
+#ifdef CANFIX_USE_FIRMWARE
+#define FW_IDLE    0
+#define FW_WAITING 1
+#define FW_BLOCK   2
+#define FW_CLOSED  3 // Finished but still answering repeats of the last frame
+
+static void
+_firmware_finish(canfix_object *h, uint8_t status) {
+    h->firmware.state = status == FW_STATUS_TIMEOUT ? FW_IDLE : FW_CLOSED;
+    if(_HAS_CALLBACK(h, firmware_done)) {
+        _CALLBACK(h, firmware_done, status);
+    }
+}
+
+/* Acknowledge everything that we have received in the current block. */
+static void
+_firmware_ack(canfix_object *h, uint8_t flag) {
+    canfix_firmware *fw = &h->firmware;
+    uint8_t rdata[8];
+
+    rdata[0] = fw->offset;
+    rdata[1] = fw->offset >> 8;
+    rdata[2] = fw->offset >> 16;
+    rdata[3] = fw->offset >> 24;
+    rdata[4] = flag;
+    fw->unacked = 0;
+    fw->acktime = h->now;
+    _write(h, CH_START + fw->channel * 2 + 1, 5, rdata);
+}
+
+static void
+_firmware_error(canfix_object *h) {
+    uint8_t rdata[8];
+
+    rdata[0] = FW_ABORT;
+    _write(h, CH_START + h->firmware.channel * 2 + 1, 1, rdata);
+    _firmware_finish(h, FW_STATUS_ERROR);
+}
+
+/* Handles a frame on the firmware channel.  A block starts with a seven byte
+ * start of block frame [type, subsystem, size, address(4)] that we echo back.
+ * In the original protocol each data frame is acknowledged with the four byte
+ * offset of the frame.  If the start of block frame has an eighth byte it is
+ * the window size that the host would like to use.  We echo the window that
+ * we will accept and then each data frame carries a sequence number, starting
+ * at one, in the first byte followed by up to seven bytes of data.  All but the last frame
+ * of a block must be full.  We acknowledge with [offset(4), flag] every half
+ * window, and ask for a resend from our offset as soon as a sequence number
+ * is skipped.  An empty frame ends the block.  It carries no sequence number
+ * so we also ask for a resend if we have less than the size given in 16 byte
+ * units in the start of block frame.  0xFD / 0xFE end or abort the whole
+ * transfer.  Repeats of the start, end of block and end frames are
+ * answered again in case our answer was the frame that was lost. */
+static void
+_handle_firmware(canfix_object *h, uint8_t length, uint8_t *data) {
+    canfix_firmware *fw = &h->firmware;
+    uint16_t rid = CH_START + fw->channel * 2 + 1;
+    uint8_t rdata[8];
+    uint8_t diff;
+
+    fw->last = h->now;
+    if(fw->state == FW_CLOSED) {
+        if(length == 1) {
+            _write(h, rid, length, data);
+        }
+        return;
+    }
+    if(fw->state == FW_WAITING) {
+        if(length == 7 || length == 8) { /* Start of block */
+            memcpy(rdata, data, length);
+            fw->subsystem = data[1];
+            fw->address = data[3] | data[4] << 8 | (uint32_t)data[5] << 16 | (uint32_t)data[6] << 24;
+            fw->size = data[2] * 16;
+            fw->offset = 0;
+            fw->seq = 1;
+            fw->unacked = 0;
+            fw->resend = 0;
+            fw->window = 0;
+            if(length == 8) {
+                if(rdata[7] > CANFIX_FW_WINDOW) rdata[7] = CANFIX_FW_WINDOW;
+                if(rdata[7] == 0) rdata[7] = 1;
+                fw->window = rdata[7];
+            }
+            fw->acktime = h->now;
+            fw->state = FW_BLOCK;
+            _write(h, rid, length, rdata);
+        } else if(length == 1 && (data[0] == FW_END_TRANSMISSION || data[0] == FW_ABORT)) {
+            _write(h, rid, length, data);
+            _firmware_finish(h, data[0] == FW_ABORT ? FW_STATUS_ABORTED : FW_STATUS_COMPLETE);
+        } else if(length == 0) {
+            _write(h, rid, 0, data);
+        }
+        return;
+    }
+    if(fw->window && fw->offset == 0 && (length == 7 || length == 8) && data[0] != fw->seq &&
+       data[1] == fw->subsystem &&
+       (data[3] | data[4] << 8 | (uint32_t)data[5] << 16 | (uint32_t)data[6] << 24) == fw->address) {
+        /* The host didn't see our start of block echo */
+        memcpy(rdata, data, length);
+        if(length == 8) rdata[7] = fw->window;
+        _write(h, rid, length, rdata);
+        return;
+    }
+
+    if(length == 0) { /* End of block */
+        /* The size is rounded up to 16 bytes so the block is short if we
+           are a whole unit or more below it */
+        if(fw->resend || (fw->window && fw->offset + 16 <= fw->size)) { /* Still missing some data */
+            _firmware_ack(h, FW_RESEND);
+            return;
+        }
+        if(_CALLBACK(h, firmware_write, fw->subsystem, fw->address + fw->offset, NULL, 0)) {
+            _firmware_error(h);
+            return;
+        }
+        fw->state = FW_WAITING;
+        _write(h, rid, 0, data);
+    } else if(fw->window == 0) {
+        if(_CALLBACK(h, firmware_write, fw->subsystem, fw->address + fw->offset, data, length)) {
+            _firmware_error(h);
+            return;
+        }
+        /* The original protocol acks each frame with its offset */
+        rdata[0] = fw->offset;
+        rdata[1] = fw->offset >> 8;
+        rdata[2] = fw->offset >> 16;
+        rdata[3] = fw->offset >> 24;
+        _write(h, rid, 4, rdata);
+        fw->offset += length;
+    } else {
+        diff = data[0] - fw->seq;
+        if(diff == 0 && length > 1) {
+            if(_CALLBACK(h, firmware_write, fw->subsystem, fw->address + fw->offset, &data[1], length - 1)) {
+                _firmware_error(h);
+                return;
+            }
+            fw->offset += length - 1;
+            fw->seq++;
+            fw->resend = 0;
+            if(++fw->unacked >= (fw->window + 1) / 2) {
+                _firmware_ack(h, FW_ACK);
+            }
+        } else if(diff < 0x80) { /* We skipped a frame */
+            if(! fw->resend) {
+                fw->resend = 1;
+                _firmware_ack(h, FW_RESEND);
+            }
+        } else { /* Duplicate of a frame that we already have */
+            if(h->now - fw->acktime >= CANFIX_FW_RETRY) {
+                _firmware_ack(h, FW_ACK);
+            }
+        }
+    }
+}
+#endif
+
+
+#ifdef CANFIX_USE_UPLOADER
+#define UP_IDLE    0
+#define UP_REQUEST 1 // Waiting for the NSM_FIRMWARE response
+#define UP_START   2 // Waiting for the start of block echo
+#define UP_DATA    3
+#define UP_END     4 // Waiting for the end of block echo
+#define UP_FINISH  5 // Waiting for the end of transmission echo
+#define UP_DONE    6
+
+static void
+_upload_done(canfix_uploader *u, canfix_upload *t, uint8_t status) {
+    t->state = UP_DONE;
+    t->status = status;
+    t->finish = u->h->now;
+    if(u->done_ctx_callback) {
+        u->done_ctx_callback(u->context, t);
+    } else if(u->done_callback) {
+        u->done_callback(t);
+    }
+}
+
+/* Sends the frame that starts the current step of an upload */
+static void
+_upload_send_step(canfix_uploader *u, canfix_upload *t) {
+    canfix_object *h = u->h;
+    uint16_t id = CH_START + t->channel * 2;
+    uint32_t addr, units;
+    uint8_t data[8];
+
+    t->last = h->now;
+    switch(t->state) {
+        case UP_REQUEST:
+            data[0] = NSM_FIRMWARE;
+            data[1] = t->node;
+            data[2] = t->vcode;
+            data[3] = t->vcode >> 8;
+            data[4] = t->channel;
+            /* Asked in FD if we can so that an FD node answers in FD */
+            _write_as(h, NSM_START + _LOAD(h->node), 5, data, _TX_FD(h));
+            break;
+        case UP_START:
+            /* The size is in 16 byte units */
+            addr = t->address + t->block;
+            units = (t->blocklen + 15) / 16;
+            data[0] = 0;
+            data[1] = t->subsystem;
+            data[2] = units > 0xFF ? 0xFF : units;
+            data[3] = addr;
+            data[4] = addr >> 8;
+            data[5] = addr >> 16;
+            data[6] = addr >> 24;
+            data[7] = CANFIX_UPLOAD_WINDOW;
+            _write(h, id, 8, data);
+            break;
+        case UP_END:
+            _write(h, id, 0, data);
+            break;
+        case UP_FINISH:
+            data[0] = FW_END_TRANSMISSION;
+            _write(h, id, 1, data);
+            break;
+    }
+}
+
+static void
+_upload_next_block(canfix_uploader *u, canfix_upload *t) {
+    if(t->block >= t->length) {
+        t->state = UP_FINISH;
+    } else {
+        t->blocklen = t->length - t->block;
+        if(t->blocklen > CANFIX_UPLOAD_BLOCK) t->blocklen = CANFIX_UPLOAD_BLOCK;
+        t->sent = 0;
+        t->acked = 0;
+        t->state = UP_START;
+    }
+    t->tries = 0;
+    _upload_send_step(u, t);
+}
+
+#ifdef CANFIX_USE_FD
+/* Returns the longest frame that needs no padding and fits in length */
+static uint8_t
+_fd_floor(uint8_t length) {
+    uint8_t n = sizeof(_fd_lengths) - 1;
+
+    while(_fd_lengths[n] > length) n--;
+    return _fd_lengths[n];
+}
+#endif
+
+/* Bytes of the block that go in the windowed data frame sent at this
+   offset.  FD frames are full up to the tail of the block, which is cut
+   into frames that won't be padded. */
+static uint32_t
+_upload_chunk(canfix_upload *t, uint32_t sent) {
+    uint32_t len = t->blocklen - sent;
+
+#ifdef CANFIX_USE_FD
+    if(t->fd) {
+        return len >= 63 ? 63 : _fd_floor(len + 1) - 1;
+    }
+#endif
+    return len > 7 ? 7 : len;
+}
+
+/* Number of windowed data frames that carry the first offset bytes of the
+   block.  Offsets always fall on a frame boundary. */
+static uint32_t
+_upload_frames(canfix_upload *t, uint32_t offset) {
+    uint32_t size = 7, full, n;
+
+#ifdef CANFIX_USE_FD
+    if(t->fd) size = 63;
+#endif
+    full = t->blocklen / size * size;
+    if(offset <= full) return (offset + size - 1) / size;
+    for(n = full / size; full < offset; n++) full += _upload_chunk(t, full);
+    return n;
+}
+
+/* Sends one data frame for the upload if the window has room.  Returns 1 if
+   a frame was sent. */
+static int
+_upload_send_frame(canfix_uploader *u, canfix_upload *t) {
+    canfix_object *h = u->h;
+    uint8_t data[CANFIX_DATA_LEN];
+    uint32_t len;
+
+    if(t->state != UP_DATA || t->sent >= t->blocklen) return 0;
+    len = t->blocklen - t->sent;
+    if(t->window) {
+        if(_upload_frames(t, t->sent) - _upload_frames(t, t->acked) >= t->window) return 0;
+        len = _upload_chunk(t, t->sent);
+        data[0] = _upload_frames(t, t->sent) + 1;
+        memcpy(&data[1], &t->image[t->block + t->sent], len);
+        if(_write(h, CH_START + t->channel * 2, len + 1, data)) return 0;
+    } else {
+        if(t->sent != t->acked) return 0;
+        if(len > 8) len = 8;
+        memcpy(data, &t->image[t->block + t->sent], len);
+        if(_write(h, CH_START + t->channel * 2, len, data)) return 0;
+    }
+    if(t->sent == t->acked) t->last = h->now;
+    t->sent += len;
+    t->frames++;
+    return 1;
+}
+
+static void
+_upload_check_block(canfix_uploader *u, canfix_upload *t) {
+    if(t->acked >= t->blocklen) {
+        t->state = UP_END;
+        t->tries = 0;
+        _upload_send_step(u, t);
+    }
+}
+
+/* Handles the response to our NSM_FIRMWARE request.  Returns 1 if the
+   message belonged to one of our uploads. */
+static int
+_uploader_response(canfix_uploader *u, uint8_t node, uint8_t *data) {
+    canfix_upload *t;
+
+    for(int n = 0; n < CANFIX_UPLOAD_TARGETS; n++) {
+        t = &u->target[n];
+        if(t->state == UP_REQUEST && t->node == node) {
+#ifdef CANFIX_USE_FD
+            t->fd = u->h->rx_fd;
+#endif
+            if(data[2] == 0) {
+                _upload_next_block(u, t);
+            } else {
+                _upload_done(u, t, FW_STATUS_ERROR);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Handles frames that the nodes send back on the response channel */
+static void
+_uploader_channel(canfix_uploader *u, uint16_t id, uint8_t length, uint8_t *data) {
+    canfix_upload *t = NULL;
+    uint8_t channel = (id - CH_START) / 2;
+    uint32_t offset;
+
+    for(int n = 0; n < CANFIX_UPLOAD_TARGETS; n++) {
+        if(u->target[n].state > UP_REQUEST && u->target[n].state < UP_DONE &&
+           u->target[n].channel == channel) {
+            t = &u->target[n];
+            break;
+        }
+    }
+    if(t == NULL) return;
+
+    if(length == 1 && data[0] == FW_ABORT && t->state != UP_FINISH) {
+        _upload_done(u, t, FW_STATUS_ABORTED);
+        return;
+    }
+    switch(t->state) {
+        case UP_START:
+            if(length == 7 || length == 8) {
+                t->window = length == 8 ? data[7] : 0;
+                t->state = UP_DATA;
+                t->tries = 0;
+                t->last = u->h->now;
+            }
+            break;
+        case UP_DATA:
+            if(t->window && length == 5) {
+                offset = data[0] | data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+                if(offset > t->sent) break;
+                if(offset > t->acked) {
+                    t->acked = offset;
+                    t->tries = 0;
+                    t->last = u->h->now;
+                }
+                if(data[4] == FW_RESEND && t->sent > offset) {
+                    t->sent = offset;
+                    t->retries++;
+                }
+                _upload_check_block(u, t);
+            } else if(! t->window && length == 4) {
+                t->acked = t->sent;
+                t->tries = 0;
+                t->last = u->h->now;
+                _upload_check_block(u, t);
+            }
+            break;
+        case UP_END:
+            if(length == 0) {
+                t->block += t->blocklen;
+                _upload_next_block(u, t);
+            } else if(t->window && length == 5 && data[4] == FW_RESEND) {
+                /* The node is missing the end of the block */
+                offset = data[0] | data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+                if(offset >= t->blocklen) break;
+                t->acked = offset;
+                t->sent = offset;
+                t->retries++;
+                t->tries = 0;
+                t->state = UP_DATA;
+                t->last = u->h->now;
+            }
+            break;
+        case UP_FINISH:
+            if(length == 1 && data[0] == FW_END_TRANSMISSION) {
+                _upload_done(u, t, FW_STATUS_COMPLETE);
+            }
+            break;
+    }
+    canfix_uploader_service(u);
+}
+
+/* Tells the node to give up and finishes the upload */
+static void
+_upload_cancel(canfix_uploader *u, canfix_upload *t, uint8_t status) {
+    uint8_t data[8];
+
+    if(t->state > UP_REQUEST && t->state < UP_DONE) {
+        data[0] = FW_ABORT;
+        _write(u->h, CH_START + t->channel * 2, 1, data);
+    }
+    if(t->state != UP_IDLE && t->state != UP_DONE) {
+        _upload_done(u, t, status);
+    }
+}
+
+static void
+_uploader_tick(canfix_uploader *u) {
+    canfix_upload *t;
+
+    for(int n = 0; n < CANFIX_UPLOAD_TARGETS; n++) {
+        t = &u->target[n];
+        if(t->state == UP_IDLE || t->state == UP_DONE) continue;
+        if(u->h->now - t->last < CANFIX_UPLOAD_TIMEOUT) continue;
+        if(++t->tries > CANFIX_UPLOAD_RETRIES) {
+            _upload_cancel(u, t, FW_STATUS_TIMEOUT);
+            continue;
+        }
+        t->retries++;
+        if(t->state == UP_DATA) { /* Go back to the last thing that was acked */
+            t->sent = t->acked;
+            t->last = u->h->now;
+        } else {
+            _upload_send_step(u, t);
+        }
+    }
+    canfix_uploader_service(u);
+}
+
+/* Attaches an uploader to a canfix object.  Responses from the nodes are
+ * picked up by canfix_exec() and the timers run from canfix_tick(). */
+void
+canfix_uploader_init(canfix_uploader *u, canfix_object *h) {
+    memset(u, 0, sizeof(canfix_uploader));
+    u->h = h;
+    h->uploader = u;
+}
+
+void
+canfix_uploader_set_done_callback(canfix_uploader *u, void (*f)(canfix_upload *)) {
+    u->done_callback = f;
+}
+
+/* Same as canfix_uploader_set_done_callback() but context is passed along
+   as the first argument.  It is called instead of the plain one. */
+void
+canfix_uploader_set_done_ctx_callback(canfix_uploader *u, void (*f)(void *, canfix_upload *), void *context) {
+    u->done_ctx_callback = f;
+    u->context = context;
+}
+
+/* Starts loading the image into the given node on the given channel.  The
+ * image is not copied so it has to stay around until the upload is done.
+ * Returns NULL if there are no free upload slots or the channel is already
+ * in use. */
+canfix_upload *
+canfix_upload_start(canfix_uploader *u, uint8_t node, uint16_t vcode, uint8_t channel,
+                    uint8_t subsystem, uint32_t address, const uint8_t *image, uint32_t length) {
+    canfix_upload *t = NULL;
+
+    if(channel > 15) return NULL;
+    for(int n = 0; n < CANFIX_UPLOAD_TARGETS; n++) {
+        if(u->target[n].state == UP_IDLE || u->target[n].state == UP_DONE) {
+            if(t == NULL) t = &u->target[n];
+        } else if(u->target[n].channel == channel || u->target[n].node == node) {
+            return NULL;
+        }
+    }
+    if(t == NULL) return NULL;
+    memset(t, 0, sizeof(canfix_upload));
+    t->node = node;
+    t->vcode = vcode;
+    t->channel = channel;
+    t->subsystem = subsystem;
+    t->address = address;
+    t->image = image;
+    t->length = length;
+    t->start = u->h->now;
+    t->state = UP_REQUEST;
+    _upload_send_step(u, t);
+    return t;
+}
+
+void
+canfix_upload_abort(canfix_uploader *u, canfix_upload *t) {
+    _upload_cancel(u, t, FW_STATUS_ABORTED);
+}
+
+/* Sends data frames for all of the uploads that have room in their windows.
+ * One frame is sent per node in turn so that all of the transfers share the
+ * bus evenly.  This is called whenever an acknowledgement arrives and from
+ * canfix_tick() but it can also be called whenever the transmitter has room.
+ * Returns the number of frames sent. */
+int
+canfix_uploader_service(canfix_uploader *u) {
+    int sent, total = 0;
+    uint8_t n;
+
+    do {
+        sent = 0;
+        for(int i = 0; i < CANFIX_UPLOAD_TARGETS; i++) {
+            n = (u->next + i) % CANFIX_UPLOAD_TARGETS;
+            sent += _upload_send_frame(u, &u->target[n]);
+        }
+        u->next = (u->next + 1) % CANFIX_UPLOAD_TARGETS;
+        total += sent;
+    } while(sent);
+    return total;
+}
+
+/* Returns the average data rate of the upload in bytes per second */
+uint32_t
+canfix_upload_rate(canfix_uploader *u, canfix_upload *t) {
+    uint32_t end = t->state == UP_DONE ? t->finish : u->h->now;
+    uint32_t bytes = t->block + (t->state == UP_DATA ? t->acked : 0);
+
+    if(end == t->start) return 0;
+    return (uint64_t)bytes * 1000 / (end - t->start);
+}
+#endif
+
+#ifdef CANFIX_USE_DIRECTORY
+static void
+_directory_event(canfix_directory *d, canfix_node_info *n, uint8_t event) {
+    if(d->node_ctx_callback) {
+        d->node_ctx_callback(d->context, n, event);
+    } else if(d->node_callback) {
+        d->node_callback(n, event);
+    }
+}
+
+/* Returns the directory entry for the node, adding it if it is new.  If the
+   directory is full the entry of the node that has been lost the longest is
+   reused. */
+static canfix_node_info *
+_directory_entry(canfix_directory *d, uint8_t node) {
+    canfix_node_info *n = NULL;
+
+    if(d->index[node]) {
+        return &d->nodes[d->index[node] - 1];
+    }
+    if(d->count < CANFIX_DIRECTORY_SIZE) {
+        n = &d->nodes[d->count++];
+    } else {
+        for(int i = 0; i < CANFIX_DIRECTORY_SIZE; i++) {
+            if((d->nodes[i].flags & NODE_LOST) &&
+               (n == NULL || d->h->now - d->nodes[i].last_seen > d->h->now - n->last_seen)) {
+                n = &d->nodes[i];
+            }
+        }
+        if(n == NULL) return NULL;
+        d->index[n->node] = 0;
+    }
+    memset(n, 0, sizeof(canfix_node_info));
+    n->node = node;
+    n->last_seen = d->h->now;
+    d->index[node] = n - d->nodes + 1;
+    _directory_event(d, n, NODE_EVENT_FOUND);
+    return n;
+}
+
+/* Called for every frame that we can tie to a sending node */
+static canfix_node_info *
+_directory_seen(canfix_directory *d, uint8_t node) {
+    canfix_node_info *n;
+
+    if(node == 0) return NULL;
+    n = _directory_entry(d, node);
+    if(n == NULL) return NULL;
+    n->last_seen = d->h->now;
+    if(n->flags & NODE_LOST) {
+        n->flags &= ~NODE_LOST;
+        _directory_event(d, n, NODE_EVENT_FOUND);
+    }
+    return n;
+}
+
+/* Node identification response.  A description, if there is one, follows
+   so we start collecting it over again. */
+static void
+_directory_identify(canfix_directory *d, uint8_t node, uint8_t *data) {
+    canfix_node_info *n = _directory_seen(d, node);
+
+    if(n == NULL) return;
+    n->device = data[3];
+    n->revision = data[4];
+    n->model = data[5] | data[6] << 8 | (uint32_t)data[7] << 16;
+    n->flags = (n->flags | NODE_IDENTIFIED) & ~NODE_DESCRIBED;
+    n->desc_end = 0;
+    memset(n->desc_mask, 0, sizeof(n->desc_mask));
+    _directory_event(d, n, NODE_EVENT_IDENTIFIED);
+}
+
+/* Description packets carry four characters each.  They are put in place
+ * by packet number and the description is complete once we have every
+ * packet up to the one with the terminator.  An FD frame carries several
+ * packets and the number is that of the first.  Anything past
+ * CANFIX_DESC_LEN is dropped. */
+static void
+_directory_describe(canfix_directory *d, uint8_t node, uint8_t length, uint8_t *data) {
+    canfix_node_info *n = _directory_seen(d, node);
+    uint16_t packet, last;
+    uint32_t pos;
+    int i;
+
+    if(n == NULL || length < 5) return;
+    packet = data[2] | data[3] << 8;
+    for(i = 4; i < length; i++) {
+        pos = packet * 4 + i - 4;
+        if(pos < CANFIX_DESC_LEN) {
+            n->description[pos] = data[i];
+        }
+        if(pos / 4 < CANFIX_DESC_LEN / 4) {
+            n->desc_mask[pos / 32] |= 0x01 << pos / 4 % 8;
+        }
+        if(data[i] == '\0') {
+            n->desc_end = pos / 4 + 1;
+            break;
+        }
+    }
+    if(n->desc_end == 0 || (n->flags & NODE_DESCRIBED)) return;
+    last = n->desc_end < CANFIX_DESC_LEN / 4 ? n->desc_end : CANFIX_DESC_LEN / 4;
+    for(i = 0; i < last; i++) {
+        if(! (n->desc_mask[i / 8] & (0x01 << i % 8))) return;
+    }
+    n->description[CANFIX_DESC_LEN] = '\0';
+    n->flags |= NODE_DESCRIBED;
+    _directory_event(d, n, NODE_EVENT_DESCRIBED);
+}
+
+static void
+_directory_tick(canfix_directory *d) {
+    canfix_node_info *n;
+
+    if(d->h->now - d->checked < 1000) return;
+    d->checked = d->h->now;
+    for(int i = 0; i < d->count; i++) {
+        n = &d->nodes[i];
+        if(! (n->flags & NODE_LOST) && d->h->now - n->last_seen >= CANFIX_NODE_TIMEOUT) {
+            n->flags |= NODE_LOST;
+            _directory_event(d, n, NODE_EVENT_LOST);
+        }
+    }
+}
+
+/* Attaches a node directory to the canfix object.  From then on every frame
+ * that goes through canfix_exec() updates the directory. */
+void
+canfix_directory_init(canfix_directory *d, canfix_object *h) {
+    memset(d, 0, sizeof(canfix_directory));
+    d->h = h;
+    d->checked = h->now;
+    h->directory = d;
+}
+
+/* The callback is called with one of the NODE_EVENT_* codes whenever a node
+   is found, identifies itself, finishes its description or goes quiet. */
+void
+canfix_directory_set_callback(canfix_directory *d, void (*f)(canfix_node_info *, uint8_t)) {
+    d->node_callback = f;
+}
+
+/* Same as canfix_directory_set_callback() but context is passed along as
+   the first argument.  It is called instead of the plain one. */
+void
+canfix_directory_set_ctx_callback(canfix_directory *d, void (*f)(void *, canfix_node_info *, uint8_t),
+                                  void *context) {
+    d->node_ctx_callback = f;
+    d->context = context;
+}
+
+/* Sends a Node Identification request.  If node is zero the request is
+ * broadcast and every node on the network answers.  The answers are
+ * collected as they arrive so one request inventories the whole bus. */
+int
+canfix_directory_discover(canfix_directory *d, uint8_t node) {
+    uint8_t data[8];
+
+    data[0] = NSM_ID;
+    data[1] = node;
+    return _write_as(d->h, NSM_START + _LOAD(d->h->node), 2, data, _TX_FD(d->h));
+}
+
+/* Returns the directory entry for the node or NULL if we have never heard
+   from it. */
+canfix_node_info *
+canfix_directory_lookup(canfix_directory *d, uint8_t node) {
+    if(d->index[node] == 0) return NULL;
+    return &d->nodes[d->index[node] - 1];
+}
+#endif
+
+#ifdef CANFIX_USE_ALARMS
+/* The alarm table keeps one entry for each node and alarm code that is
+ * being raised.  Repeats of an alarm only update its time and count.  The
+ * callback is called when an alarm is first raised, when its data changes,
+ * but not more often than the window, and when it is cleared.  An alarm is
+ * cleared when it hasn't been repeated for the timeout or when the node
+ * sends alarm code zero.  Entries are kept packed at the front of the table
+ * so clearing one moves the last entry into its place. */
+static void
+_alarm_event(canfix_alarms *a, canfix_alarm *e, uint8_t event) {
+    e->reported = a->h->now;
+    e->changed = 0;
+    if(a->callback) a->callback(e, event);
+}
+
+static void
+_alarm_remove(canfix_alarms *a, uint8_t n) {
+    _alarm_event(a, &a->alarms[n], ALARM_CLEARED);
+    a->count--;
+    if(n != a->count) a->alarms[n] = a->alarms[a->count];
+}
+
+static void
+_alarm_seen(canfix_alarms *a, uint8_t node, uint8_t length, uint8_t *data) {
+    canfix_alarm *e;
+    uint16_t code;
+    uint8_t n;
+
+    if(length < 2) return;
+    code = data[0] | data[1] << 8;
+    if(code == 0) {
+        canfix_alarms_clear(a, node);
+        return;
+    }
+    length -= 2;
+    if(length > sizeof(e->data)) length = sizeof(e->data);
+    for(n = 0; n < a->count; n++) {
+        e = &a->alarms[n];
+        if(e->node == node && e->code == code) {
+            e->last = a->h->now;
+            e->count++;
+            if(e->length != length || memcmp(e->data, &data[2], length)) {
+                e->length = length;
+                memcpy(e->data, &data[2], length);
+                e->changed = 1;
+                if(a->h->now - e->reported >= a->window) _alarm_event(a, e, ALARM_UPDATED);
+            }
+            return;
+        }
+    }
+    if(a->count == CANFIX_ALARM_SIZE) {
+        a->overflow++;
+        return;
+    }
+    e = &a->alarms[a->count++];
+    e->node = node;
+    e->code = code;
+    e->length = length;
+    memcpy(e->data, &data[2], length);
+    e->first = e->last = a->h->now;
+    e->count = 1;
+    _alarm_event(a, e, ALARM_RAISED);
+}
+
+static void
+_alarm_tick(canfix_alarms *a) {
+    canfix_alarm *e;
+    uint8_t n = 0;
+
+    while(n < a->count) {
+        e = &a->alarms[n];
+        if(a->h->now - e->last >= a->timeout) {
+            _alarm_remove(a, n);
+            continue;
+        }
+        if(e->changed && a->h->now - e->reported >= a->window) {
+            _alarm_event(a, e, ALARM_UPDATED);
+        }
+        n++;
+    }
+}
+
+/* Attaches an alarm table to the canfix object.  The alarm callback is
+   still called for every alarm frame. */
+void
+canfix_alarms_init(canfix_alarms *a, canfix_object *h) {
+    memset(a, 0, sizeof(canfix_alarms));
+    a->h = h;
+    a->window = CANFIX_ALARM_WINDOW;
+    a->timeout = CANFIX_ALARM_TIMEOUT;
+    h->alarms = a;
+}
+
+/* The callback is called with one of the ALARM_* events.  The alarm pointer
+   is only good until the callback returns. */
+void
+canfix_alarms_set_callback(canfix_alarms *a, void (*f)(canfix_alarm *, uint8_t)) {
+    a->callback = f;
+}
+
+void
+canfix_alarms_set_window(canfix_alarms *a, uint16_t window, uint16_t timeout) {
+    a->window = window;
+    a->timeout = timeout;
+}
+
+/* Returns the active alarms and puts the number of them in count.  The
+   list is in no particular order and changes with each canfix_exec() and
+   canfix_tick() call. */
+canfix_alarm *
+canfix_alarms_list(canfix_alarms *a, uint8_t *count) {
+    *count = a->count;
+    return a->alarms;
+}
+
+/* Clears all of the alarms from a node, or every alarm if node is zero */
+void
+canfix_alarms_clear(canfix_alarms *a, uint8_t node) {
+    uint8_t n = 0;
+
+    while(n < a->count) {
+        if(node == 0 || a->alarms[n].node == node) {
+            _alarm_remove(a, n);
+        } else {
+            n++;
+        }
+    }
+}
+#endif
+
+#ifdef CANFIX_USE_CACHE
+/* The cache keeps the latest value of every parameter that comes through
+ * canfix_exec(), found by a hash of the type, node and index.  Entries are
+ * never removed.  A watched entry sits in the timing wheel slot of the time
+ * that it goes stale and is moved to a new slot each time a value arrives,
+ * so canfix_tick() only looks at the slots that it has passed and a healthy
+ * entry is never looked at there.  Periods longer than the wheel just take
+ * more than one turn. */
+#define CACHE_NONE 0xFFFF
+
+static uint16_t
+_cache_hash(uint16_t type, uint8_t node, uint8_t index) {
+    uint32_t key = (uint32_t)type << 16 | node << 8 | index;
+
+    return (key * 2654435761u) >> 16 & (CANFIX_HASH_SIZE - 1);
+}
+
+/* Finds the entry, adding it if add is set.  Returns NULL if it isn't there
+   or the cache is full. */
+static canfix_cache_entry *
+_cache_find(canfix_cache *c, uint16_t type, uint8_t node, uint8_t index, uint8_t add) {
+    uint16_t h = _cache_hash(type, node, index);
+    canfix_cache_entry *e;
+
+    while(c->hash[h] != CACHE_NONE) {
+        e = &c->entries[c->hash[h]];
+        if(e->par.type == type && e->par.node == node && e->par.index == index) return e;
+        h = (h + 1) & (CANFIX_HASH_SIZE - 1);
+    }
+    if(! add || c->count == CANFIX_CACHE_SIZE) return NULL;
+    c->hash[h] = c->count;
+    e = &c->entries[c->count++];
+    memset(e, 0, sizeof(canfix_cache_entry));
+    e->par.type = type;
+    e->par.node = node;
+    e->par.index = index;
+    e->next = e->prev = CACHE_NONE;
+    e->stale = 1; /* Until a value arrives */
+    return e;
+}
+
+static void
+_wheel_unlink(canfix_cache *c, canfix_cache_entry *e) {
+    uint16_t slot = (e->deadline + CANFIX_WHEEL_RES - 1) / CANFIX_WHEEL_RES % CANFIX_WHEEL_SLOTS;
+
+    if(e->prev == CACHE_NONE) {
+        if(c->slots[slot] != e - c->entries) return; /* Not in the wheel */
+        c->slots[slot] = e->next;
+    } else {
+        c->entries[e->prev].next = e->next;
+    }
+    if(e->next != CACHE_NONE) c->entries[e->next].prev = e->prev;
+    e->next = e->prev = CACHE_NONE;
+}
+
+static void
+_wheel_link(canfix_cache *c, canfix_cache_entry *e) {
+    uint32_t t;
+    uint16_t slot, n = e - c->entries;
+
+    e->deadline = c->h->now + e->period;
+    /* The slot that is checked first at or after the deadline */
+    t = (e->deadline + CANFIX_WHEEL_RES - 1) / CANFIX_WHEEL_RES;
+    if((int32_t)(t - c->wheel) <= 0) {
+        t = c->wheel + 1;
+        e->deadline = t * CANFIX_WHEEL_RES;
+    }
+    slot = t % CANFIX_WHEEL_SLOTS;
+    e->prev = CACHE_NONE;
+    e->next = c->slots[slot];
+    if(e->next != CACHE_NONE) c->entries[e->next].prev = n;
+    c->slots[slot] = n;
+}
+
+#ifdef CANFIX_USE_HISTORY
+static void _history_add(canfix_history *hist, uint32_t now, canfix_parameter *par);
+#endif
+
+static void
+_cache_update(canfix_cache *c, canfix_parameter *par) {
+    canfix_cache_entry *e = _cache_find(c, par->type, par->node, par->index, 1);
+
+    if(e == NULL) return;
+    e->par = *par;
+    e->updated = c->h->now;
+    e->stale = 0;
+#ifdef CANFIX_USE_HISTORY
+    if(e->history) _history_add(e->history, c->h->now, par);
+#endif
+    if(e->period) {
+        _wheel_unlink(c, e);
+        _wheel_link(c, e);
+    }
+}
+
+static void
+_cache_tick(canfix_cache *c) {
+    uint32_t now = c->h->now / CANFIX_WHEEL_RES;
+    canfix_cache_entry *e;
+    uint16_t n, next;
+
+    /* After a long gap one turn of the wheel covers every slot */
+    if(now - c->wheel > CANFIX_WHEEL_SLOTS) c->wheel = now - CANFIX_WHEEL_SLOTS;
+    while(c->wheel != now) {
+        c->wheel++;
+        for(n = c->slots[c->wheel % CANFIX_WHEEL_SLOTS]; n != CACHE_NONE; n = next) {
+            e = &c->entries[n];
+            next = e->next;
+            if((int32_t)(c->h->now - e->deadline) < 0) continue; /* Later turn */
+            _wheel_unlink(c, e);
+            e->stale = 1;
+            e->par.flags |= c->flags;
+            if(c->timeout_callback) c->timeout_callback(e);
+        }
+    }
+}
+
+/* Attaches a last value cache to the canfix object.  Every parameter that
+   goes through canfix_exec() is kept until the cache is full. */
+void
+canfix_cache_init(canfix_cache *c, canfix_object *h) {
+    memset(c, 0, sizeof(canfix_cache));
+    memset(c->hash, 0xFF, sizeof(c->hash));
+    memset(c->slots, 0xFF, sizeof(c->slots));
+    c->h = h;
+    c->wheel = h->now / CANFIX_WHEEL_RES;
+    h->cache = c;
+}
+
+/* Called once when a watched value hasn't arrived within its period.  It
+   isn't called again until a new value arrives and goes stale again. */
+void
+canfix_cache_set_timeout_callback(canfix_cache *c, void (*f)(canfix_cache_entry *)) {
+    c->timeout_callback = f;
+}
+
+/* Flags, normally FCB_QUALITY or FCB_FAIL, that are set in the cached value
+   when it goes stale. */
+void
+canfix_cache_set_stale_flags(canfix_cache *c, uint8_t flags) {
+    c->flags = flags;
+}
+
+canfix_cache_entry *
+canfix_cache_lookup(canfix_cache *c, uint16_t type, uint8_t node, uint8_t index) {
+    return _cache_find(c, type, node, index, 0);
+}
+
+/* Watches a parameter for values that stop arriving.  The entry is made if
+ * the value hasn't been seen yet so that a value that never shows up times
+ * out too.  A period of zero stops watching it.  Returns NULL if the cache
+ * is full. */
+canfix_cache_entry *
+canfix_cache_watch(canfix_cache *c, uint16_t type, uint8_t node, uint8_t index, uint16_t period) {
+    canfix_cache_entry *e = _cache_find(c, type, node, index, 1);
+
+    if(e == NULL) return NULL;
+    if(e->period) _wheel_unlink(c, e);
+    e->period = period;
+    if(period) _wheel_link(c, e);
+    return e;
+}
+#endif
+
+#ifdef CANFIX_USE_HISTORY
+/* A history keeps the values of one cached parameter in three rings.  The
+ * raw ring has every value that arrives, and the 1s and 10s tiers have the
+ * smallest, largest and sum of the values over each second and each ten
+ * seconds.  Times and values are kept in separate arrays so a window is at
+ * most two runs of contiguous floats that can be scanned four at a time.
+ * Queries over long windows use a tier so they never look at more than
+ * CANFIX_HISTORY_TIER_LEN samples. */
+static const uint32_t _tier_period[] = {0, 1000, 10000};
+
+static float
+_history_decode(uint8_t datatype, uint8_t *data) {
+    float f;
+
+    switch(datatype) {
+        case CANFIX_TYPE_SHORT: return *(int8_t *)data;
+        case CANFIX_TYPE_BYTE:
+        case CANFIX_TYPE_USHORT: return *data;
+        case CANFIX_TYPE_INT: return (int16_t)(data[0] | data[1] << 8);
+        case CANFIX_TYPE_WORD:
+        case CANFIX_TYPE_UINT: return (uint16_t)(data[0] | data[1] << 8);
+        case CANFIX_TYPE_DINT: return (int32_t)(data[0] | data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        case CANFIX_TYPE_UDINT: return (uint32_t)(data[0] | data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        case CANFIX_TYPE_FLOAT:
+            memcpy(&f, data, 4);
+            return f;
+        default:
+            return 0;
+    }
+}
+
+/* Adds the values of a finished sample of the tier below, or of one raw
+   value, to the sample that tier n is building. */
+static void
+_tier_add(canfix_history *hist, uint8_t n, uint32_t time, float min, float max, float sum, uint32_t count) {
+    canfix_history_tier *t = &hist->tier[n];
+    uint32_t start = time - time % _tier_period[n + 1];
+
+    if(t->acc_count && start != t->start) {
+        t->time[t->head] = t->start;
+        t->min[t->head] = t->acc_min;
+        t->max[t->head] = t->acc_max;
+        t->sum[t->head] = t->acc_sum;
+        t->counts[t->head] = t->acc_count;
+        t->head = (t->head + 1) % CANFIX_HISTORY_TIER_LEN;
+        if(t->count < CANFIX_HISTORY_TIER_LEN) t->count++;
+        if(n == 0) _tier_add(hist, 1, t->start, t->acc_min, t->acc_max, t->acc_sum, t->acc_count);
+        t->acc_count = 0;
+    }
+    if(t->acc_count == 0) {
+        t->start = start;
+        t->acc_min = min;
+        t->acc_max = max;
+        t->acc_sum = 0;
+    }
+    if(min < t->acc_min) t->acc_min = min;
+    if(max > t->acc_max) t->acc_max = max;
+    t->acc_sum += sum;
+    t->acc_count += count;
+}
+
+static void
+_history_add(canfix_history *hist, uint32_t now, canfix_parameter *par) {
+    float v = _history_decode(hist->datatype, par->data) * hist->scale;
+
+    hist->time[hist->head] = now;
+    hist->value[hist->head] = v;
+    hist->head = (hist->head + 1) % CANFIX_HISTORY_LEN;
+    if(hist->count < CANFIX_HISTORY_LEN) hist->count++;
+    _tier_add(hist, 0, now, v, v, v, 1);
+}
+
+/* Folds n samples into the smallest, largest and sum so far */
+static void
+_history_scan(const float *min, const float *max, const float *sum, uint16_t n, float *rmin, float *rmax, float *rsum) {
+    uint16_t i = 0;
+#ifdef __SSE2__
+    float buff[4];
+    __m128 vmin, vmax, vsum;
+
+    if(n >= 4) {
+        vmin = _mm_loadu_ps(min);
+        vmax = _mm_loadu_ps(max);
+        vsum = _mm_setzero_ps();
+        for(; i + 4 <= n; i += 4) {
+            vmin = _mm_min_ps(vmin, _mm_loadu_ps(&min[i]));
+            vmax = _mm_max_ps(vmax, _mm_loadu_ps(&max[i]));
+            vsum = _mm_add_ps(vsum, _mm_loadu_ps(&sum[i]));
+        }
+        _mm_storeu_ps(buff, vmin);
+        for(int j = 0; j < 4; j++) if(buff[j] < *rmin) *rmin = buff[j];
+        _mm_storeu_ps(buff, vmax);
+        for(int j = 0; j < 4; j++) if(buff[j] > *rmax) *rmax = buff[j];
+        _mm_storeu_ps(buff, vsum);
+        *rsum += buff[0] + buff[1] + buff[2] + buff[3];
+    }
+#endif
+    for(; i < n; i++) {
+        if(min[i] < *rmin) *rmin = min[i];
+        if(max[i] > *rmax) *rmax = max[i];
+        *rsum += sum[i];
+    }
+}
+
+/* Finds the first of count samples in a ring of size samples ending at head
+   whose time plus period is after from.  Returns the offset from the oldest
+   sample. */
+static uint16_t
+_history_find(const uint32_t *time, uint16_t head, uint16_t count, uint16_t size, uint32_t period, uint32_t from) {
+    uint16_t lo = 0, hi = count, mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if((int32_t)(time[(head + size - count + mid) % size] + period - from) > 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/* Subscribes a parameter to a history.  The history memory belongs to the
+ * caller and is filled from canfix_exec() from then on.  datatype is one of
+ * the CANFIX_TYPE_* codes for the parameter's value and scale is multiplied
+ * by the value, so a history of a parameter in hundredths can be in whole
+ * units.  Returns the cache entry or NULL if the cache is full. */
+canfix_cache_entry *
+canfix_history_subscribe(canfix_cache *c, canfix_history *hist, uint16_t type, uint8_t node,
+                         uint8_t index, uint8_t datatype, float scale) {
+    canfix_cache_entry *e = _cache_find(c, type, node, index, 1);
+
+    if(e == NULL) return NULL;
+    memset(hist, 0, sizeof(canfix_history));
+    hist->datatype = datatype;
+    hist->scale = scale;
+    e->history = hist;
+    return e;
+}
+
+/* Works out the smallest, largest and average value over the span
+ * milliseconds before now.  The raw values are used when they go back far
+ * enough, otherwise the finest tier that does.  Returns -1 if there are no
+ * values in the window. */
+int
+canfix_history_window(canfix_history *hist, uint32_t now, uint32_t span, canfix_history_summary *out) {
+    uint32_t from = now - span;
+    canfix_history_tier *t;
+    uint16_t first, start, n, size;
+    const uint32_t *time;
+    const float *min, *max, *sum;
+    uint8_t tier;
+    uint32_t count = 0;
+
+    for(tier = HISTORY_RAW; tier < HISTORY_10S; tier++) {
+        if(tier == HISTORY_RAW) {
+            if(hist->count < CANFIX_HISTORY_LEN || (int32_t)(hist->time[hist->head] - from) <= 0) break;
+        } else {
+            t = &hist->tier[tier - 1];
+            if(t->count < CANFIX_HISTORY_TIER_LEN || (int32_t)(t->time[t->head] + _tier_period[tier] - from) <= 0) break;
+        }
+    }
+    out->min = INFINITY;
+    out->max = -INFINITY;
+    out->avg = 0;
+    if(tier == HISTORY_RAW) {
+        time = hist->time;
+        min = max = sum = hist->value;
+        size = CANFIX_HISTORY_LEN;
+        first = _history_find(time, hist->head, hist->count, size, 0, from);
+        n = hist->count - first;
+        count = n;
+        start = (hist->head + size - n) % size;
+    } else {
+        t = &hist->tier[tier - 1];
+        time = t->time;
+        min = t->min;
+        max = t->max;
+        sum = t->sum;
+        size = CANFIX_HISTORY_TIER_LEN;
+        first = _history_find(time, t->head, t->count, size, _tier_period[tier], from);
+        n = t->count - first;
+        start = (t->head + size - n) % size;
+        for(uint16_t i = 0; i < n; i++) count += t->counts[(start + i) % size];
+        /* The samples that are still being built.  The 1s sample only
+         * reaches the 10s accumulator once it is complete, so a window from
+         * the 10s tier takes in both. */
+        for(uint8_t k = 0; k < tier; k++) {
+            t = &hist->tier[k];
+            if(t->acc_count == 0) continue;
+            if(t->acc_min < out->min) out->min = t->acc_min;
+            if(t->acc_max > out->max) out->max = t->acc_max;
+            out->avg += t->acc_sum;
+            count += t->acc_count;
+            out->first = t->start;
+        }
+    }
+    if(count == 0) return -1;
+    if(n) {
+        out->first = time[start];
+        if(start + n <= size) {
+            _history_scan(&min[start], &max[start], &sum[start], n, &out->min, &out->max, &out->avg);
+        } else {
+            _history_scan(&min[start], &max[start], &sum[start], size - start, &out->min, &out->max, &out->avg);
+            _history_scan(min, max, sum, start + n - size, &out->min, &out->max, &out->avg);
+        }
+    }
+    out->avg /= count;
+    out->count = count;
+    return 0;
+}
+
+/* Copies the samples of one tier since the given time into times and
+ * values, oldest first.  For the 1s and 10s tiers the value is the average
+ * over the sample; the tier arrays in the history can be read directly for
+ * the smallest and largest values.  If there are more than max samples the
+ * newest ones are copied.  Returns the number copied. */
+uint16_t
+canfix_history_read(canfix_history *hist, uint8_t tier, uint32_t since, uint32_t *times, float *values, uint16_t max) {
+    canfix_history_tier *t;
+    uint16_t n, start, i, p;
+
+    if(tier == HISTORY_RAW) {
+        n = hist->count - _history_find(hist->time, hist->head, hist->count, CANFIX_HISTORY_LEN, 1, since);
+        if(n > max) n = max;
+        start = (hist->head + CANFIX_HISTORY_LEN - n) % CANFIX_HISTORY_LEN;
+        for(i = 0; i < n; i++) {
+            p = (start + i) % CANFIX_HISTORY_LEN;
+            times[i] = hist->time[p];
+            values[i] = hist->value[p];
+        }
+        return n;
+    }
+    if(tier > HISTORY_10S) return 0;
+    t = &hist->tier[tier - 1];
+    n = t->count - _history_find(t->time, t->head, t->count, CANFIX_HISTORY_TIER_LEN, 1, since);
+    if(n > max) n = max;
+    start = (t->head + CANFIX_HISTORY_TIER_LEN - n) % CANFIX_HISTORY_TIER_LEN;
+    for(i = 0; i < n; i++) {
+        p = (start + i) % CANFIX_HISTORY_TIER_LEN;
+        times[i] = t->time[p];
+        values[i] = t->sum[p] / t->counts[p];
+    }
+    return n;
+}
+#endif
+
+#ifdef CANFIX_USE_GATEWAY
+/* The gateway joins the networks of several canfix objects.  The routing
+ * table is compiled into a bit mask of destination buses for every CAN ID
+ * on every bus so a frame is forwarded with one lookup, untouched unless a
+ * node is remapped.  A hash of the last few frames sent on each bus is kept
+ * and the same frame arriving on that bus shortly after is dropped, which
+ * catches a driver that echoes its own frames.  The hash of each forwarded
+ * frame is also kept for the bus it came from, so when two gateways join
+ * the same buses and a frame comes back around through the other one, it
+ * is dropped there instead of going around again.  The price is that a
+ * node sending exactly the same frame twice within CANFIX_ECHO_TIME only
+ * has the first one forwarded. */
+static uint32_t
+_echo_hash(uint16_t id, uint8_t length, uint8_t *data) {
+    uint32_t hash = 2166136261u ^ id ^ (uint32_t)length << 11;
+
+    for(uint8_t n = 0; n < length; n++) {
+        hash = (hash ^ data[n]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the node number that a frame is from and where it is kept */
+static uint8_t
+_frame_node(uint16_t id, uint8_t length, uint8_t *data) {
+    if(id < 256) return id;
+    if(id < NSM_START) return length > 0 ? data[0] : 0;
+    if(id < CH_START) return id - NSM_START;
+    return 0;
+}
+
+/* Remembers a frame that went out on or was forwarded from a bus */
+static void
+_echo_add(canfix_gateway *g, uint8_t bus, uint32_t hash, uint32_t now) {
+    canfix_echo *e = &g->echo[bus][g->echo_next[bus]];
+
+    e->hash = hash;
+    e->time = now;
+    g->echo_next[bus] = (g->echo_next[bus] + 1) % CANFIX_ECHO_LEN;
+}
+
+static void
+_gateway_send(canfix_gateway *g, uint8_t to, uint16_t id, uint8_t length, uint8_t *data, uint8_t fd) {
+    _echo_add(g, to, _echo_hash(id, length, data), g->bus[to]->now);
+    g->forwarded++;
+    _write_as(g->bus[to], id, length, data, fd);
+}
+
+/* Called for every frame received on a bus.  Returns non zero if the frame
+   is an echo of one we sent and should be ignored. */
+static int
+_gateway_forward(canfix_gateway *g, uint8_t from, uint16_t id, uint8_t length, uint8_t *data) {
+    uint8_t mask, node, to, buff[CANFIX_DATA_LEN], fd = _RX_FD(g->bus[from]);
+    uint32_t now = g->bus[from]->now, hash;
+    const uint8_t *map;
+    uint16_t rid;
+
+    id &= 0x7FF;
+    if(length > CANFIX_DATA_LEN) length = CANFIX_DATA_LEN;
+    mask = g->dest[from][id];
+    hash = _echo_hash(id, length, data);
+    for(uint8_t n = 0; n < CANFIX_ECHO_LEN; n++) {
+        if(g->echo[from][n].hash == hash && now - g->echo[from][n].time < CANFIX_ECHO_TIME) {
+            g->echo[from][n].time = now - CANFIX_ECHO_TIME; /* Only once */
+            g->echoes++;
+            return 1;
+        }
+    }
+    if(mask == 0) return 0;
+    if(g->interval[from][id]) {
+        if(now - g->last[from][id] < g->interval[from][id]) {
+            g->limited++;
+            return 0;
+        }
+        g->last[from][id] = now;
+    }
+    /* In case another gateway sends it back here */
+    _echo_add(g, from, hash, now);
+    for(to = 0; mask; to++, mask >>= 1) {
+        if(! (mask & 0x01)) continue;
+        if(g->remap[from] & 0x01 << to) {
+            map = g->node_map[from][to];
+            memcpy(buff, data, length);
+            rid = id;
+            node = _frame_node(id, length, data);
+            if(node && map[node] != node) {
+                if(id < 256) {
+                    rid = map[node];
+                } else if(id < NSM_START) {
+                    buff[0] = map[node];
+                } else {
+                    rid = NSM_START + map[node];
+                }
+            }
+            /* The node that a node specific message is for, unless it is
+               for all of them */
+            if(id >= NSM_START && id < CH_START && length > 1 && buff[1]) {
+                buff[1] = map[buff[1]];
+            }
+            _gateway_send(g, to, rid, length, buff, fd);
+        } else {
+            _gateway_send(g, to, id, length, data, fd);
+        }
+    }
+    return 0;
+}
+
+void
+canfix_gateway_init(canfix_gateway *g) {
+    memset(g, 0, sizeof(canfix_gateway));
+}
+
+/* Adds a canfix object to the gateway.  Frames that go through its
+ * canfix_exec() are forwarded to the other buses and frames are sent on it
+ * with its write callback.  Returns the bus number for the routing table or
+ * -1 if there is no room. */
+int
+canfix_gateway_attach(canfix_gateway *g, canfix_object *h) {
+    if(g->buses == CANFIX_GATEWAY_BUSES) return -1;
+    g->bus[g->buses] = h;
+    h->gateway = g;
+    h->gateway_bus = g->buses;
+    return g->buses++;
+}
+
+/* Compiles the routes into the lookup tables, replacing any that were there
+ * before.  Where routes overlap, the shortest interval wins.  Returns -1 if
+ * a route names a bus that isn't attached or goes back to its own bus. */
+int
+canfix_gateway_compile(canfix_gateway *g, const canfix_route *routes, uint16_t count) {
+    const canfix_route *r;
+    uint16_t n, id;
+    int b, t;
+
+    for(n = 0; n < count; n++) {
+        r = &routes[n];
+        if(r->from >= g->buses || r->to >= g->buses || r->from == r->to || r->first > r->last || r->last > 0x7FF) {
+            return -1;
+        }
+    }
+    memset(g->dest, 0, sizeof(g->dest));
+    memset(g->interval, 0, sizeof(g->interval));
+    memset(g->remap, 0, sizeof(g->remap));
+    for(b = 0; b < CANFIX_GATEWAY_BUSES; b++) {
+        for(t = 0; t < CANFIX_GATEWAY_BUSES; t++) {
+            for(n = 0; n < 256; n++) g->node_map[b][t][n] = n;
+        }
+    }
+    for(n = 0; n < count; n++) {
+        r = &routes[n];
+        for(id = r->first; id <= r->last; id++) {
+            if(! g->dest[r->from][id] || (r->interval && r->interval < g->interval[r->from][id])) {
+                g->interval[r->from][id] = r->interval;
+            } else if(! r->interval) {
+                g->interval[r->from][id] = 0;
+            }
+            g->dest[r->from][id] |= 0x01 << r->to;
+        }
+        if(r->node_from) {
+            g->node_map[r->from][r->to][r->node_from] = r->node_to;
+            g->remap[r->from] |= 0x01 << r->to;
+        }
+    }
+    return 0;
+}
+#endif
+
+#ifdef CANFIX_USE_STATS
+/* Traffic is counted per CAN ID and per sending node for every frame that
+ * goes through canfix_exec() or is sent by the library.  The counts go into
+ * the current bucket and into running sums over all of the buckets, so the
+ * sums always cover the last CANFIX_STATS_BUCKETS buckets.  When a bucket
+ * is reused in canfix_tick() its counts are taken back out of the sums. */
+static const uint32_t _bitrates[] = {0, 125000, 250000, 500000, 1000000};
+
+/* Number of bits that a standard data frame takes on the wire.  The stuff
+ * bits depend on the contents so the frame is built bit by bit, with its
+ * CRC, from the start of frame to the end of the CRC, which is the part
+ * that is stuffed.  The delimiters, ACK, end of frame and the interframe
+ * space add 13 more.  FD frames longer than eight bytes are only estimated,
+ * with a stuff bit for every four data bits and the whole frame counted at
+ * the nominal bitrate even if the data phase is switched. */
+uint16_t
+canfix_frame_bits(uint16_t id, uint8_t length, uint8_t *data) {
+    uint8_t bits[19 + 64 + 15];
+    uint16_t crc = 0, n = 0, i, stuffed = 0;
+    uint8_t run = 0, last = 2;
+
+    if(length > 8) {
+        if(length > 64) length = 64;
+        return 28 + length * 10 + (length > 16 ? 28 : 23) + 13;
+    }
+    bits[n++] = 0; /* Start of frame */
+    for(i = 0; i < 11; i++) bits[n++] = id >> (10 - i) & 0x01;
+    bits[n++] = 0; /* RTR, IDE and r0 */
+    bits[n++] = 0;
+    bits[n++] = 0;
+    for(i = 0; i < 4; i++) bits[n++] = length >> (3 - i) & 0x01;
+    for(i = 0; i < length * 8; i++) bits[n++] = data[i / 8] >> (7 - i % 8) & 0x01;
+    for(i = 0; i < n; i++) {
+        crc = (crc << 1 ^ ((bits[i] ^ crc >> 14) & 0x01 ? 0x4599 : 0)) & 0x7FFF;
+    }
+    for(i = 0; i < 15; i++) bits[n++] = crc >> (14 - i) & 0x01;
+    for(i = 0; i < n; i++) {
+        if(bits[i] == last) {
+            run++;
+        } else {
+            last = bits[i];
+            run = 1;
+        }
+        if(run == 5) { /* The stuff bit starts the next run */
+            stuffed++;
+            last = ! last;
+            run = 1;
+        }
+    }
+    return n + stuffed + 13;
+}
+
+static void
+_stats_count(canfix_stats *s, uint16_t id, uint8_t node, uint8_t length, uint8_t *data) {
+    uint16_t bits = canfix_frame_bits(id, length, data);
+
+    id &= 0x7FF;
+    s->frames++;
+    s->bits += bits;
+    s->bus_bits += bits;
+    s->bucket_bits[s->bucket] += bits;
+    s->id_frames[id]++;
+    s->id_bits[id] += bits;
+    s->id_bucket_frames[s->bucket][id]++;
+    s->id_bucket_bits[s->bucket][id] += bits;
+    if(node) {
+        s->node_frames[node]++;
+        s->node_bits[node] += bits;
+        s->node_bucket_frames[s->bucket][node]++;
+        s->node_bucket_bits[s->bucket][node] += bits;
+    }
+}
+
+/* Counts a received frame against the node that sent it.  Channel frames
+   don't say who sent them so they are only counted by ID. */
+static void
+_stats_received(canfix_stats *s, uint16_t id, uint8_t length, uint8_t *data) {
+    uint8_t node = 0;
+
+    if(id < 256) {
+        node = id;
+    } else if(id < NSM_START) {
+        if(length > 0) node = data[0];
+    } else if(id < CH_START) {
+        node = id - NSM_START;
+    }
+    _stats_count(s, id, node, length, data);
+}
+
+static void
+_stats_tick(canfix_stats *s) {
+    uint8_t b;
+    int n;
+
+    for(b = 0; s->h->now - s->started >= CANFIX_STATS_BUCKET && b < CANFIX_STATS_BUCKETS; b++) {
+        s->started += CANFIX_STATS_BUCKET;
+        s->bucket = (s->bucket + 1) % CANFIX_STATS_BUCKETS;
+        s->bus_bits -= s->bucket_bits[s->bucket];
+        s->bucket_bits[s->bucket] = 0;
+        for(n = 0; n < 2048; n++) {
+            s->id_frames[n] -= s->id_bucket_frames[s->bucket][n];
+            s->id_bits[n] -= s->id_bucket_bits[s->bucket][n];
+        }
+        for(n = 0; n < 256; n++) {
+            s->node_frames[n] -= s->node_bucket_frames[s->bucket][n];
+            s->node_bits[n] -= s->node_bucket_bits[s->bucket][n];
+        }
+        memset(s->id_bucket_frames[s->bucket], 0, sizeof(s->id_bucket_frames[0]));
+        memset(s->id_bucket_bits[s->bucket], 0, sizeof(s->id_bucket_bits[0]));
+        memset(s->node_bucket_frames[s->bucket], 0, sizeof(s->node_bucket_frames[0]));
+        memset(s->node_bucket_bits[s->bucket], 0, sizeof(s->node_bucket_bits[0]));
+    }
+    /* After a long gap every bucket has been cleared */
+    if(s->h->now - s->started >= CANFIX_STATS_BUCKET) s->started = s->h->now;
+}
+
+/* Attaches traffic counters to the canfix object.  bitrate is the
+   NSM_BITRATE code of the bus, 1 to 4 for 125 to 1000 kbps. */
+void
+canfix_stats_init(canfix_stats *s, canfix_object *h, uint8_t bitrate) {
+    memset(s, 0, sizeof(canfix_stats));
+    s->h = h;
+    s->bitrate = bitrate;
+    s->begun = s->started = h->now;
+    h->stats = s;
+}
+
+/* This is also set when this node accepts a Bitrate Set message */
+void
+canfix_stats_set_bitrate(canfix_stats *s, uint8_t bitrate) {
+    s->bitrate = bitrate;
+}
+
+/* Returns the bus load over the window in hundredths of a percent */
+uint16_t
+canfix_stats_load(canfix_stats *s) {
+    uint32_t span = (CANFIX_STATS_BUCKETS - 1) * CANFIX_STATS_BUCKET + s->h->now - s->started;
+    uint64_t capacity;
+
+    if(span > s->h->now - s->begun) span = s->h->now - s->begun;
+    if(s->bitrate < 1 || s->bitrate > 4 || span == 0) return 0;
+    capacity = (uint64_t)_bitrates[s->bitrate] * span / 1000;
+    return (uint64_t)s->bus_bits * 10000 / capacity;
+}
+
+/* Fills top with up to count CAN IDs, or nodes if by_node is set, that have
+   used the most bits over the window, the busiest first.  Returns the number
+   of entries filled in. */
+uint8_t
+canfix_stats_top(canfix_stats *s, canfix_stats_entry *top, uint8_t count, uint8_t by_node) {
+    uint32_t *frames = by_node ? s->node_frames : s->id_frames;
+    uint32_t *bits = by_node ? s->node_bits : s->id_bits;
+    uint16_t size = by_node ? 256 : 2048;
+    uint8_t found = 0, i;
+
+    if(count == 0) return 0;
+    for(uint16_t n = 0; n < size; n++) {
+        if(bits[n] == 0 || (found == count && bits[n] <= top[count - 1].bits)) continue;
+        i = found < count ? found++ : count - 1;
+        for(; i > 0 && top[i - 1].bits < bits[n]; i--) top[i] = top[i - 1];
+        top[i].id = n;
+        top[i].frames = frames[n];
+        top[i].bits = bits[n];
+    }
+    return found;
+}
+#endif
+
+#ifdef CANFIX_USE_CFGCLIENT
+#define CFG_FREE    0
+#define CFG_WAITING 1
+#define CFG_SENT    2
+
+static int
+_cfgclient_send(canfix_cfgclient *c, canfix_cfg_request *r) {
+    uint8_t data[8];
+
+    data[0] = r->op;
+    data[1] = r->node;
+    data[2] = r->key;
+    data[3] = r->key >> 8;
+    memcpy(&data[4], r->data, r->op == NSM_CONFSET ? r->length : 0);
+    if(_write(c->h, NSM_START + _LOAD(c->h->node), r->op == NSM_CONFSET ? 4 + r->length : 4, data)) {
+        return -1;
+    }
+    r->state = CFG_SENT;
+    r->sent = c->h->now;
+    return 0;
+}
+
+/* Takes the oldest request off of the node's list and reports the result */
+static void
+_cfgclient_finish(canfix_cfgclient *c, uint8_t node, uint8_t status, uint8_t length, uint8_t *data) {
+    uint8_t idx = c->head[node];
+    canfix_cfg_request *r = &c->req[idx];
+
+    c->head[node] = r->next;
+    if(r->next == 0xFF) c->tail[node] = 0xFF;
+    r->status = status;
+    if(r->op == NSM_CONFGET) {
+        r->length = length > 5 ? 5 : length;
+        if(r->length) memcpy(r->data, data, r->length);
+    }
+    if(r->result) {
+        r->result->status = status;
+        r->result->length = r->op == NSM_CONFGET ? r->length : 0;
+        memcpy(r->result->data, r->data, r->result->length);
+        r->result->done = 1;
+    }
+    if(c->ctx_callback) {
+        c->ctx_callback(c->context, r);
+    } else if(c->callback) {
+        c->callback(r);
+    }
+    r->state = CFG_FREE;
+    r->next = c->free;
+    c->free = idx;
+    c->pending--;
+}
+
+/* Nodes answer configuration requests in the order that they get them but
+ * the answer doesn't carry the key, so it belongs to the oldest request that
+ * is in flight to that node.  The node's own requests to us look the same up
+ * to the length, [op, our node, key(2), data], so only frames shaped like an
+ * answer are taken.  A set is answered with [op, node, status] and a query
+ * with the status followed by the value if the status is zero.  A query of a
+ * key whose low byte is zero still can't be told from a good one byte answer.
+ * Returns 1 if the message was one of ours. */
+static int
+_cfgclient_response(canfix_cfgclient *c, uint8_t node, uint8_t length, uint8_t *data) {
+    canfix_cfg_request *r;
+
+    if(c->head[node] == 0xFF || length < 3) return 0;
+    if(data[0] == NSM_CONFSET && length != 3) return 0;
+    if(data[0] == NSM_CONFGET && (data[2] == 0) != (length > 3)) return 0;
+    r = &c->req[c->head[node]];
+    if(r->state != CFG_SENT || r->op != data[0]) return 0;
+    _cfgclient_finish(c, node, data[2], data[2] == 0 ? length - 3 : 0, &data[3]);
+    canfix_cfgclient_service(c);
+    return 1;
+}
+
+/* If the oldest request to a node goes unanswered we can't tell which of the
+ * answers that may still be on the way belong to which request, so every
+ * request in flight to that node is put back and sent again after another
+ * timeout has passed. */
+static void
+_cfgclient_tick(canfix_cfgclient *c) {
+    canfix_cfg_request *r;
+    uint8_t idx;
+
+    for(int n = 0; n < CANFIX_CFG_REQUESTS; n++) {
+        r = &c->req[n];
+        if(r->state != CFG_SENT || c->head[r->node] != n) continue;
+        if(c->h->now - r->sent < CANFIX_CFG_TIMEOUT) continue;
+        if(r->tries >= CANFIX_CFG_RETRIES) {
+            _cfgclient_finish(c, r->node, CFG_ERR_TIMEOUT, 0, NULL);
+            idx = c->head[r->node];
+        } else {
+            idx = n;
+        }
+        while(idx != 0xFF && c->req[idx].state == CFG_SENT) {
+            c->req[idx].state = CFG_WAITING;
+            c->req[idx].tries++;
+            c->req[idx].sent = c->h->now;
+            idx = c->req[idx].next;
+        }
+    }
+    canfix_cfgclient_service(c);
+}
+
+/* Attaches a configuration client to the canfix object.  Answers are picked
+ * up by canfix_exec() and the timeouts run from canfix_tick(). */
+void
+canfix_cfgclient_init(canfix_cfgclient *c, canfix_object *h) {
+    memset(c, 0, sizeof(canfix_cfgclient));
+    memset(c->head, 0xFF, sizeof(c->head));
+    memset(c->tail, 0xFF, sizeof(c->tail));
+    for(int n = 0; n < CANFIX_CFG_REQUESTS; n++) {
+        c->req[n].next = n + 1 < CANFIX_CFG_REQUESTS ? n + 1 : 0xFF;
+    }
+    c->free = 0;
+    c->h = h;
+    h->cfgclient = c;
+}
+
+/* The callback is called once for every request when it is answered or
+   when it times out. */
+void
+canfix_cfgclient_set_callback(canfix_cfgclient *c, void (*f)(canfix_cfg_request *)) {
+    c->callback = f;
+}
+
+/* Same as canfix_cfgclient_set_callback() but context is passed along as
+   the first argument.  It is called instead of the plain one. */
+void
+canfix_cfgclient_set_ctx_callback(canfix_cfgclient *c, void (*f)(void *, canfix_cfg_request *), void *context) {
+    c->ctx_callback = f;
+    c->context = context;
+}
+
+static int
+_cfgclient_add(canfix_cfgclient *c, uint8_t op, uint8_t node, uint16_t key, uint8_t *data, uint8_t length,
+               canfix_cfg_result *result, void *context) {
+    canfix_cfg_request *r;
+    uint8_t idx = c->free;
+
+    if(idx == 0xFF || length > 4) return -1;
+    r = &c->req[idx];
+    c->free = r->next;
+    r->state = CFG_WAITING;
+    r->op = op;
+    r->node = node;
+    r->key = key;
+    r->length = length;
+    if(length) memcpy(r->data, data, length);
+    r->tries = 0;
+    r->result = result;
+    r->context = context;
+    r->next = 0xFF;
+    if(result) result->done = 0;
+    if(c->tail[node] == 0xFF) {
+        c->head[node] = idx;
+    } else {
+        c->req[c->tail[node]].next = idx;
+    }
+    c->tail[node] = idx;
+    c->pending++;
+    canfix_cfgclient_service(c);
+    return 0;
+}
+
+/* Queues a configuration query.  Any number of requests can be queued to any
+ * number of nodes and up to CANFIX_CFG_DEPTH of them are kept in flight to
+ * each node.  When the answer arrives it is written to result, if that isn't
+ * NULL, and the callback is called.  context is just kept with the request
+ * for the caller.  Returns -1 if the request table is full. */
+int
+canfix_config_get(canfix_cfgclient *c, uint8_t node, uint16_t key, canfix_cfg_result *result, void *context) {
+    return _cfgclient_add(c, NSM_CONFGET, node, key, NULL, 0, result, context);
+}
+
+/* Same as canfix_config_get() but sets the key to the given value */
+int
+canfix_config_set(canfix_cfgclient *c, uint8_t node, uint16_t key, uint8_t *data, uint8_t length,
+                  canfix_cfg_result *result, void *context) {
+    return _cfgclient_add(c, NSM_CONFSET, node, key, data, length, result, context);
+}
+
+/* Forgets the result and context of every request that was given this
+ * context, for when they point at memory that is going away.  The requests
+ * stay queued, since the answers that are on the way still have to be
+ * matched up, but nothing is written when they finish and the callback sees
+ * a NULL context. */
+void
+canfix_config_cancel(canfix_cfgclient *c, void *context) {
+    for(int n = 0; n < CANFIX_CFG_REQUESTS; n++) {
+        if(c->req[n].state != CFG_FREE && c->req[n].context == context) {
+            c->req[n].result = NULL;
+            c->req[n].context = NULL;
+        }
+    }
+}
+
+/* Sends whatever requests have room.  This is called as answers come in and
+   from canfix_tick().  Returns the number of requests sent. */
+int
+canfix_cfgclient_service(canfix_cfgclient *c) {
+    canfix_cfg_request *r;
+    uint8_t idx;
+    int depth, count = 0;
+
+    for(int n = 0; n < CANFIX_CFG_REQUESTS; n++) {
+        r = &c->req[n];
+        if(r->state == CFG_FREE || c->head[r->node] != n) continue;
+        /* Requests that were put back wait out a timeout first */
+        if(r->state == CFG_WAITING && r->tries && c->h->now - r->sent < CANFIX_CFG_TIMEOUT) continue;
+        idx = n;
+        for(depth = 0; depth < CANFIX_CFG_DEPTH && idx != 0xFF; depth++) {
+            if(c->req[idx].state == CFG_WAITING) {
+                if(_cfgclient_send(c, &c->req[idx])) return count;
+                count++;
+            }
+            idx = c->req[idx].next;
+        }
+    }
+    return count;
+}
+
+/* Returns the number of requests that haven't been finished yet */
+uint16_t
+canfix_cfgclient_pending(canfix_cfgclient *c) {
+    return c->pending;
+}
+#endif
+
+#ifdef CANFIX_USE_SESSIONS
+/* Sessions are kept by channel since a channel can only carry one
+ * conversation on the network at a time.  A channel is free if we don't
+ * have a session on it, nobody else has used it for CANFIX_SESSION_TIMEOUT
+ * and it isn't being used for a firmware download to or from us.  The
+ * node that opens a session sends on the even ID of the channel and the
+ * other node answers on the odd one. */
+static void
+_session_event(canfix_sessions *s, canfix_session *ss, uint8_t event) {
+    if(s->callback) {
+        s->callback(ss, event);
+    }
+}
+
+static void
+_session_free(canfix_sessions *s, canfix_session *ss) {
+    ss->state = SESSION_FREE;
+    s->used &= ~(1 << ss->channel);
+}
+
+static int
+_session_channel_free(canfix_sessions *s, uint8_t channel) {
+    canfix_object *h = s->h;
+
+    if(s->used & (1 << channel)) return 0;
+    if((s->seen & (1 << channel)) && h->now - s->busy[channel] < CANFIX_SESSION_TIMEOUT) return 0;
+#ifdef CANFIX_USE_FIRMWARE
+    if(h->firmware.state != FW_IDLE && h->firmware.channel == channel) return 0;
+#endif
+#ifdef CANFIX_USE_UPLOADER
+    if(h->uploader) {
+        for(int n = 0; n < CANFIX_UPLOAD_TARGETS; n++) {
+            canfix_upload *t = &h->uploader->target[n];
+            if(t->state != UP_IDLE && t->state != UP_DONE && t->channel == channel) return 0;
+        }
+    }
+#endif
+    return 1;
+}
+
+/* A request from another node to open a session.  Returns the status for
+   the answer, zero if the session was opened. */
+static uint8_t
+_session_accept(canfix_sessions *s, uint8_t node, uint8_t channel, uint16_t type) {
+    canfix_object *h = s->h;
+    canfix_session *ss;
+
+    if(channel > 15) return 0x01;
+    ss = &s->session[channel];
+    /* The other node may be asking again because our answer was lost */
+    if(ss->state == SESSION_OPEN && ss->node == node && ! ss->initiator) {
+        ss->last = h->now;
+        return 0x00;
+    }
+    if(! _session_channel_free(s, channel)) return 0x01;
+    if(_HAS_CALLBACK(h, twoway) && _CALLBACK(h, twoway, channel, type) != 0) return 0x01;
+    memset(ss, 0, sizeof(canfix_session));
+    ss->state = SESSION_OPEN;
+    ss->node = node;
+    ss->channel = channel;
+    ss->type = type;
+    ss->last = h->now;
+    s->used |= 1 << channel;
+    _session_event(s, ss, SESSION_EVENT_OPEN);
+    return 0x00;
+}
+
+/* The answer to one of our requests.  It doesn't say which channel it is
+   for so it goes to the oldest request to that node. */
+static void
+_session_answer(canfix_sessions *s, uint8_t node, uint8_t status) {
+    canfix_session *ss = NULL;
+
+    for(int n = 0; n < 16; n++) {
+        if(s->session[n].state == SESSION_OPENING && s->session[n].node == node &&
+           (ss == NULL || s->h->now - s->session[n].last > s->h->now - ss->last)) {
+            ss = &s->session[n];
+        }
+    }
+    if(ss == NULL) return;
+    ss->last = s->h->now;
+    if(status == 0x00) {
+        ss->state = SESSION_OPEN;
+        _session_event(s, ss, SESSION_EVENT_OPEN);
+    } else {
+        _session_free(s, ss);
+        _session_event(s, ss, SESSION_EVENT_REFUSED);
+    }
+}
+
+/* Channel traffic.  Frames from the other end of one of our sessions are
+   kept for canfix_session_read(), anything else marks the channel busy. */
+static void
+_session_channel(canfix_sessions *s, uint16_t id, uint8_t length, uint8_t *data) {
+    uint8_t channel = (id - CH_START) / 2;
+    uint8_t odd = (id - CH_START) % 2;
+    canfix_session *ss = &s->session[channel];
+    uint16_t pos;
+
+    if(ss->state != SESSION_OPEN) {
+        if(ss->state == SESSION_FREE) {
+            s->seen |= 1 << channel;
+            s->busy[channel] = s->h->now;
+        }
+        return;
+    }
+    if(odd != ss->initiator) return;
+    ss->last = s->h->now;
+    for(uint8_t n = 0; n < length; n++) {
+        if(ss->count == CANFIX_SESSION_BUF) {
+            ss->overruns += length - n;
+            break;
+        }
+        pos = (ss->head + ss->count) % CANFIX_SESSION_BUF;
+        ss->rx[pos] = data[n];
+        ss->count++;
+    }
+    _session_event(s, ss, SESSION_EVENT_DATA);
+}
+
+static void
+_sessions_tick(canfix_sessions *s) {
+    canfix_session *ss;
+
+    for(int n = 0; n < 16; n++) {
+        ss = &s->session[n];
+        if(ss->state == SESSION_OPENING && s->h->now - ss->last >= CANFIX_SESSION_ANSWER) {
+            _session_free(s, ss);
+            _session_event(s, ss, SESSION_EVENT_REFUSED);
+        } else if(ss->state == SESSION_OPEN && s->h->now - ss->last >= CANFIX_SESSION_TIMEOUT) {
+            _session_free(s, ss);
+            _session_event(s, ss, SESSION_EVENT_CLOSED);
+        }
+    }
 }
 
-/* Set's the node description string.  If this is set it will be sent after
-   the Node Identification message is sent. */
-void canfix_set_description(canfix_object *h, char *description) {
-    h->description = description;
+/* Attaches a session manager to the canfix object.  Requests from other
+ * nodes to open a session are accepted if the channel is free and the two
+ * way callback, if there is one, returns zero for it. */
+void
+canfix_sessions_init(canfix_sessions *s, canfix_object *h) {
+    memset(s, 0, sizeof(canfix_sessions));
+    for(int n = 0; n < 16; n++) s->session[n].channel = n;
+    s->h = h;
+    h->sessions = s;
 }
 
+/* The callback is called with one of the SESSION_EVENT_* codes when a
+   session opens, is refused, receives data or is closed for being idle. */
 void
-canfix_set_write_callback(canfix_object *h, int (*f)(uint16_t, uint8_t, uint8_t *)) {
-	h->write_callback = f;
+canfix_sessions_set_callback(canfix_sessions *s, void (*f)(canfix_session *, uint8_t)) {
+    s->callback = f;
 }
 
-void
-canfix_set_alarm_callback(canfix_object *h, void (*f)(uint8_t, uint16_t, uint8_t*, uint8_t)) {
-    h->alarm_callback = f;
+/* Asks the node to open a session of the given type on the lowest free
+ * channel.  The session is usable once the open event arrives.  Returns
+ * NULL if every channel is in use or the request couldn't be sent. */
+canfix_session *
+canfix_session_open(canfix_sessions *s, uint8_t node, uint16_t type) {
+    canfix_session *ss;
+    uint8_t data[5];
+    uint8_t channel;
+
+    for(channel = 0; channel < 16 && ! _session_channel_free(s, channel); channel++);
+    if(channel == 16) return NULL;
+    data[0] = NSM_TWOWAY;
+    data[1] = node;
+    data[2] = channel;
+    data[3] = type;
+    data[4] = type >> 8;
+    if(_write(s->h, NSM_START + _LOAD(s->h->node), 5, data)) return NULL;
+    ss = &s->session[channel];
+    memset(ss, 0, sizeof(canfix_session));
+    ss->state = SESSION_OPENING;
+    ss->node = node;
+    ss->channel = channel;
+    ss->initiator = 1;
+    ss->type = type;
+    ss->last = s->h->now;
+    s->used |= 1 << channel;
+    return ss;
 }
 
-void
-canfix_set_parameter_callback(canfix_object *h, void (*f)(canfix_parameter)) {
-    h->parameter_callback = f;
+/* Returns the session with the node on the channel or NULL if there isn't one */
+canfix_session *
+canfix_session_find(canfix_sessions *s, uint8_t node, uint8_t channel) {
+    if(channel > 15 || s->session[channel].state == SESSION_FREE) return NULL;
+    if(s->session[channel].node != node) return NULL;
+    return &s->session[channel];
 }
 
-void
-canfix_set_node_set_callback(canfix_object *h, void (*f)(uint8_t)) {
-    h->node_set_callback = f;
+/* Sends one frame of data to the other end.  Returns -1 if the session
+   isn't open or the result of the write callback. */
+int
+canfix_session_send(canfix_sessions *s, canfix_session *ss, uint8_t *data, uint8_t length) {
+    if(ss->state != SESSION_OPEN) return -1;
+    ss->last = s->h->now;
+    return _write(s->h, CH_START + ss->channel * 2 + ! ss->initiator, length, data);
 }
 
-void
-canfix_set_report_callback(canfix_object *h, void (*f)(void)) {
-    h->report_callback = f;
+/* Copies up to max of the received bytes into data and returns how many */
+uint16_t
+canfix_session_read(canfix_sessions *s, canfix_session *ss, uint8_t *data, uint16_t max) {
+    uint16_t n;
+
+    (void)s;
+    for(n = 0; n < max && ss->count; n++) {
+        data[n] = ss->rx[ss->head];
+        ss->head = (ss->head + 1) % CANFIX_SESSION_BUF;
+        ss->count--;
+    }
+    return n;
 }
 
+/* Closes the session here.  The protocol has no message for this so the
+   other node closes its end when it times out. */
 void
-canfix_set_twoway_callback(canfix_object *h, uint8_t (*f)(uint8_t, uint16_t)) {
-    h->twoway_callback = f;
+canfix_session_close(canfix_sessions *s, canfix_session *ss) {
+    if(ss->state != SESSION_FREE) _session_free(s, ss);
 }
+#endif
 
-void
-canfix_set_config_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t *, uint8_t)) {
-    h->config_callback = f;
+/* Everything that is done with a parameter that we receive */
+static void
+_receive_parameter(canfix_object *h, canfix_parameter *par) {
+#ifdef CANFIX_USE_CACHE
+    if(h->cache) _cache_update(h->cache, par);
+#endif
+    if(_HAS_CALLBACK(h, parameter)) {
+        _CALLBACK(h, parameter, *par);
+    }
 }
 
-void
-canfix_set_query_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t *, uint8_t *)) {
-    h->query_callback = f;
+#ifdef CANFIX_USE_PACKED
+/* Packed parameters.  A node that is asked for them with a four byte
+ * [NSM_PACKED, node, enable, delay] request answers [NSM_PACKED, asker,
+ * status], with a status of zero if it is now sending packed parameters.
+ * From then on canfix_send_parameter() collects parameters into FD frames
+ * of [NSM_PACKED, 0] followed by records of [type | length << 11 (2),
+ * index, meta << 4 | flags, data(length)].  The frame is sent when the next
+ * record won't fit or the first one has waited delay milliseconds.  A type
+ * of zero, or the end of the frame, ends the records.  A packed frame always
+ * has a record so it is longer than the four bytes of a request, which is
+ * how it is told apart from a request with a node of zero that goes to
+ * every node.  Every node on the network gets the packed frames so they
+ * should only be asked for when all of the listeners understand them.
+ *
+ * Packed frames go out on the node's node specific message ID, so they lose
+ * arbitration to every plain parameter frame and to the messages of lower
+ * numbered nodes.  On a busy bus a packed parameter can wait behind traffic
+ * that it would have beaten on its own ID, on top of the delay spent
+ * collecting it.  Only pack on nodes whose parameters can take that. */
+#define _PACKED(length, data) ((length) > 4 && (data)[0] == NSM_PACKED && (data)[1] == 0)
+
+int
+canfix_set_packing(canfix_object *h, uint8_t enable, uint8_t delay) {
+    if(enable && ! _TX_FD(h)) return -1;
+    if(! enable) canfix_pack_flush(h);
+    h->packing = enable ? 1 : 0;
+    h->pack_delay = delay ? delay : CANFIX_PACK_DELAY;
+    return 0;
+}
+
+/* Asks a node to send its parameters packed, or to stop.  A node of zero
+   asks every node.  The answers set or clear NODE_PACKED in the directory if
+   there is one. */
+int
+canfix_request_packing(canfix_object *h, uint8_t node, uint8_t enable, uint8_t delay) {
+    uint8_t data[4];
+
+    data[0] = NSM_PACKED;
+    data[1] = node;
+    data[2] = enable;
+    data[3] = delay;
+    return _write_as(h, NSM_START + _LOAD(h->node), 4, data, _TX_FD(h));
 }
 
+/* Sends the parameters that have been collected so far */
 void
-canfix_set_firmware_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t)) {
-    h->firmware_callback = f;
+canfix_pack_flush(canfix_object *h) {
+    uint8_t length;
+
+    if(h->pack_len == 0) return;
+    length = canfix_fd_length(h->pack_len);
+    memset(&h->pack[h->pack_len], 0, length - h->pack_len);
+    h->pack_len = 0;
+    _write_as(h, NSM_START + _LOAD(h->node), length, h->pack, 1);
 }
 
-//void canfix_set_stream_callback(void (*f)(uint8_t, uint8_t *, uint8_t));
+static void
+_pack_parameter(canfix_object *h, canfix_parameter *par) {
+    uint8_t *p;
+
+    if(h->pack_len + 4 + par->length > 64) canfix_pack_flush(h);
+    if(h->pack_len == 0) {
+        h->pack[0] = NSM_PACKED;
+        h->pack[1] = 0;
+        h->pack_len = 2;
+        h->pack_time = h->now;
+    }
+    p = &h->pack[h->pack_len];
+    p[0] = par->type;
+    p[1] = (par->type >> 8) | par->length << 3;
+    p[2] = par->index;
+    p[3] = par->flags | (par->meta << 4);
+    memcpy(&p[4], par->data, par->length);
+    h->pack_len += 4 + par->length;
+}
+
+static void
+_unpack_parameters(canfix_object *h, uint8_t node, uint8_t length, uint8_t *data) {
+    canfix_parameter par;
+    uint8_t pos = 2;
+    uint16_t word;
 
+    par.node = node;
+    while(pos + 4 <= length) {
+        word = data[pos] | data[pos + 1] << 8;
+        par.type = word & 0x7FF;
+        par.length = word >> 11;
+        if(par.type < CANFIX_PARAM_START || par.type >= NSM_START) return;
+        if(par.length > 5 || pos + 4 + par.length > length) return;
+        par.index = data[pos + 2];
+        par.meta = data[pos + 3] >> 4;
+        par.flags = data[pos + 3] & 0x0F;
+        memcpy(par.data, &data[pos + 4], par.length);
+        _receive_parameter(h, &par);
+        pos += 4 + par.length;
+    }
+}
+#endif
 
 static void
 _handle_node_specific(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
     uint8_t rlength;
-    uint8_t rdata[8];
+    uint8_t rdata[CANFIX_DATA_LEN];
+#ifdef CANFIX_USE_CONFIG_TABLE
+    const canfix_config_key *key;
+#endif
+
+#ifdef CANFIX_USE_CFGCLIENT
+    if(h->cfgclient && (data[0] == NSM_CONFGET || data[0] == NSM_CONFSET) && data[1] == h->node) {
+        if(_cfgclient_response(h->cfgclient, id - NSM_START, length, data)) return;
+    }
+#endif
 
     // This prepares a generic response
     rdata[0] = data[0];
@@ -109,7 +3130,19 @@ _handle_node_specific(canfix_object *h, uint16_t id, uint8_t length, uint8_t *da
 
     switch(data[0]) {
         case NSM_ID: // Node Identify Message
+            if(length == 8) { /* This is somebody's answer, not a request */
+#ifdef CANFIX_USE_DIRECTORY
+                if(h->directory) _directory_identify(h->directory, id - NSM_START, data);
+#endif
+                return;
+            }
             if(data[1] == h->node || data[1]==0) {
+#ifdef CANFIX_USE_DEFERRED
+                if(data[1] == 0 && h->jitter) {
+                    _defer_response(h, NSM_ID, id - NSM_START);
+                    return;
+                }
+#endif
                 canfix_send_identification(h, id - NSM_START);
                 return;
             } else {
@@ -119,13 +3152,19 @@ _handle_node_specific(canfix_object *h, uint16_t id, uint8_t length, uint8_t *da
         case NSM_BITRATE:
             if(data[1] == h->node || data[0]==0) {
                 if(data[2] >= 1 && data[2] <=4) {
-                    if(h->bitrate_callback) {
-                        h->bitrate_callback(data[2]);
+#ifdef CANFIX_USE_STATS
+                    if(h->stats) canfix_stats_set_bitrate(h->stats, data[2]);
+#endif
+                    _STORE(h->bitrate, data[2]);
+                    if(_HAS_CALLBACK(h, bitrate)) {
+                        _CALLBACK(h, bitrate, data[2]);
                     }
+                    rdata[2] = 0x00;
+                    rlength = 3;
                 } else {
                     rdata[2] = 0x01;
                     rlength = 3;
-                    h->write_callback(NSM_START + h->node, rlength, rdata);
+                    _write_as(h, NSM_START + h->node, rlength, rdata, _RX_FD(h));
                     return;
                 }
 
@@ -136,9 +3175,9 @@ _handle_node_specific(canfix_object *h, uint16_t id, uint8_t length, uint8_t *da
         case NSM_NODE_SET: // Node Set Message
             if(data[1] == h->node || data[0]==0) {
                 if(data[2] != 0x00) { // Doesn't respond to broadcast
-                    h->node = data[2];
-                    if(h->node_set_callback) {
-                        h->node_set_callback(h->node);
+                    canfix_set_node(h, data[2]);
+                    if(_HAS_CALLBACK(h, node_set)) {
+                        _CALLBACK(h, node_set, h->node);
                     }
                     rdata[2] = 0x00;
                 } else {
@@ -149,50 +3188,93 @@ _handle_node_specific(canfix_object *h, uint16_t id, uint8_t length, uint8_t *da
                 return;
             }
             break;
-        /* We use a bitmask in the EEPROM to determine whether or not a
-           parameter is disabled.  A 0 in the bit location means enabled
-           and a 1 means disabled. */
+        /* We use a bitmask to determine whether or not a parameter is
+           disabled.  A 0 in the bit location means enabled and a 1 means
+           disabled.  Only requests sent directly to us are answered. */
+#ifdef CANFIX_USE_PARAM_ENABLE
         case NSM_DISABLE:
-            if(data[1] == h->node || data[1]==0) {
-                ; //parameterEnable(frame);
-            }
-            return;
         case NSM_ENABLE:
-            if(data[1] == h->node) {
-                ; //parameterEnable(frame);
+            if(length < 4 || (data[1] != h->node && (data[1] != 0 || data[0] == NSM_ENABLE))) {
+                return;
             }
-            return;
+            rdata[2] = canfix_set_parameter_enable(h, data[2] | data[3] << 8, data[0] == NSM_ENABLE) ? 0x01 : 0x00;
+            if(data[1] == 0) return;
+            rlength = 3;
+            break;
+#endif
         case NSM_REPORT:
             if(data[1] == h->node || data[1]==0) {
-                if(h->report_callback) h->report_callback();
+#ifdef CANFIX_USE_DEFERRED
+                if(data[1] == 0 && h->jitter) {
+                    _defer_response(h, NSM_REPORT, id - NSM_START);
+                    return;
+                }
+#endif
+                if(_HAS_CALLBACK(h, report)) _CALLBACK0(h, report);
             }
             return;
-        case NSM_FIRMWARE: //Not implemented yet
+        case NSM_FIRMWARE:
+#ifdef CANFIX_USE_UPLOADER
+            /* A three byte message is the response to one of our requests */
+            if(length == 3 && data[1] == h->node && h->uploader) {
+                if(_uploader_response(h->uploader, id - NSM_START, data)) return;
+            }
+#endif
             if(data[1] == h->node) {
-                if(h->firmware_callback) {
+                if(_HAS_CALLBACK(h, firmware)) {
                     /* Pass verification code and channel request */
-                    rdata[2] = h->firmware_callback(*((uint16_t *)(&data[2])), data[4]);
+                    rdata[2] = _CALLBACK(h, firmware, data[2] | data[3] << 8, data[4]);
                     rlength = 3;
+#ifdef CANFIX_USE_FIRMWARE
+                    /* If we have somewhere to put the data we run the download */
+                    if(rdata[2] == 0 && _HAS_CALLBACK(h, firmware_write)) {
+                        h->firmware.state = FW_WAITING;
+                        h->firmware.channel = data[4];
+                        h->firmware.last = h->now;
+                    }
+#endif
                     break;
                 }
             }
             return;
+#ifdef CANFIX_USE_CHANNELS
         case NSM_TWOWAY:
-            if(data[1] == h->node) {
-                if(h->twoway_callback && data[0]!=0x00) {
-                    if(h->twoway_callback(data[2], *((uint16_t *)(&data[3]))) == 0) {
-                        rdata[2]=0x00;
-                        rlength = 3;
-                        break;
-                    }
+            if(data[1] != h->node) return;
+#ifdef CANFIX_USE_SESSIONS
+            if(h->sessions) {
+                if(length == 3) { /* Answer to our request */
+                    _session_answer(h->sessions, id - NSM_START, data[2]);
+                    return;
                 }
-            } else {
-                return;
+                if(length < 5) return;
+                rdata[2] = _session_accept(h->sessions, id - NSM_START, data[2], data[3] | data[4] << 8);
+                rlength = 3;
+                break;
             }
+#endif
+            if(length < 5) return;
+            rdata[2] = 0x01;
+            if(_HAS_CALLBACK(h, twoway) && _CALLBACK(h, twoway, data[2], data[3] | data[4] << 8) == 0) {
+                rdata[2] = 0x00;
+            }
+            rlength = 3;
+            break;
+#endif
+#ifdef CANFIX_USE_CONFIG
         case NSM_CONFSET:
             if(data[1] == h->node) {
-                if(h->config_callback) {
-                    rdata[2] = h->config_callback(*((uint16_t *)(&data[2])), (uint8_t *)&data[4], length-4);
+#ifdef CANFIX_USE_CONFIG_TABLE
+                if(length >= 4 && (key = canfix_config_lookup(h, data[2] | data[3] << 8))) {
+                    rdata[2] = _config_set(key, &data[4], length - 4);
+#ifdef CANFIX_USE_STORE
+                    if(rdata[2] == 0 && h->store) canfix_store_write(h->store, key->key);
+#endif
+                    rlength = 3;
+                    break;
+                }
+#endif
+                if(_HAS_CALLBACK(h, config)) {
+                    rdata[2] = _CALLBACK(h, config, data[2] | data[3] << 8, (uint8_t *)&data[4], length-4);
                 } else {
                     rdata[2] = 1;
                 }
@@ -203,8 +3285,16 @@ _handle_node_specific(canfix_object *h, uint16_t id, uint8_t length, uint8_t *da
             }
         case NSM_CONFGET:
             if(data[1] == h->node) {
-                if(h->query_callback) {
-                    rdata[2] = h->query_callback(*((uint16_t *)(&data[2])), &rdata[3], &length);
+#ifdef CANFIX_USE_CONFIG_TABLE
+                if(length >= 4 && (key = canfix_config_lookup(h, data[2] | data[3] << 8))) {
+                    memcpy(&rdata[3], key->storage, _type_size[key->type]);
+                    rdata[2] = 0;
+                    rlength = 3 + _type_size[key->type];
+                    break;
+                }
+#endif
+                if(_HAS_CALLBACK(h, query)) {
+                    rdata[2] = _CALLBACK(h, query, data[2] | data[3] << 8, &rdata[3], &length);
                 } else {
                     rdata[2] = 1;
                 }
@@ -217,39 +3307,202 @@ _handle_node_specific(canfix_object *h, uint16_t id, uint8_t length, uint8_t *da
             } else {
                 return;
             }
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+        case NSM_DESC:
+            if(h->directory) _directory_describe(h->directory, id - NSM_START, length, data);
+            return;
+#endif
+#ifdef CANFIX_USE_PACKED
+        case NSM_PACKED:
+            if(_PACKED(length, data)) {
+                _unpack_parameters(h, id - NSM_START, length, data);
+                return;
+            }
+            if(length == 3 && data[1] == h->node) { /* Answer to our request */
+#ifdef CANFIX_USE_DIRECTORY
+                canfix_node_info *n;
+                if(h->directory && (n = _directory_seen(h->directory, id - NSM_START))) {
+                    if(data[2] == 0) n->flags |= NODE_PACKED;
+                    else n->flags &= ~NODE_PACKED;
+                }
+#endif
+                return;
+            }
+            if(length < 4 || (data[1] != h->node && data[1] != 0)) return;
+            canfix_set_packing(h, data[2], data[3]);
+            rdata[2] = h->packing ? 0x00 : 0x01;
+            rlength = 3;
+            break;
+#endif
         default:
             return;
     }
-    h->write_callback(NSM_START + h->node, rlength, rdata);
+    /* Answered the same way we were asked so FD is only used with nodes
+       that have shown that they can take it */
+    _write_as(h, NSM_START + h->node, rlength, rdata, _RX_FD(h));
 }
 
-void
-canfix_exec(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
+static void
+_exec(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
     uint8_t n;
     canfix_parameter par;
 
+#ifdef CANFIX_USE_STATS
+    if(h->stats) _stats_received(h->stats, id, length, data);
+#endif
+#ifdef CANFIX_USE_GATEWAY
+    if(h->gateway && _gateway_forward(h->gateway, h->gateway_bus, id, length, data)) return;
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+    if(h->directory) {
+        if(id < 256) {
+            _directory_seen(h->directory, id);
+        } else if(id < 0x6E0) {
+            if(length > 0) _directory_seen(h->directory, data[0]);
+        } else if(id < 0x7E0) {
+            _directory_seen(h->directory, id - NSM_START);
+        }
+    }
+#endif
     if(id == 0x00) { /* Ignore ID 0 */
         ;
     } else if(id < 256) { /* Node Alarms */
-        if(h->alarm_callback) {
-            h->alarm_callback(id, *((uint16_t *)(&data[0])), &data[2], length-2);
+#ifdef CANFIX_USE_ALARMS
+        if(h->alarms) _alarm_seen(h->alarms, id, length, data);
+#endif
+        if(_HAS_CALLBACK(h, alarm) && length >= 2) {
+            _CALLBACK(h, alarm, id, data[0] | data[1] << 8, &data[2], length-2);
         }
     } else if(id < 0x6E0) { /* Parameters */
-        if(h->parameter_callback) {
-            par.type = id;
-            par.node = data[0];
-            par.index = data[1];
-            par.meta = data[2] >> 4;
-            par.flags = data[2] & 0x0F;
-            par.length = length - 3;
-            for(n = 0; n<par.length; n++) par.data[n] = data[3+n];
-            h->parameter_callback(par);
-        }
+        if(length < 3) return;
+        par.type = id;
+        par.node = data[0];
+        par.index = data[1];
+        par.meta = data[2] >> 4;
+        par.flags = data[2] & 0x0F;
+        par.length = length - 3;
+        if(par.length > 5) par.length = 5;
+        for(n = 0; n<par.length; n++) par.data[n] = data[3+n];
+        _receive_parameter(h, &par);
     } else if(id < 0x7E0) { /* Node Specific Message */
         _handle_node_specific(h,id, length, data);
     } else { /* Communication Channel */
-        ; /* Not implemented at the moment */
+#ifdef CANFIX_USE_FIRMWARE
+        if(h->firmware.state != FW_IDLE && id == CH_START + h->firmware.channel * 2) {
+            _handle_firmware(h, length, data);
+        }
+#endif
+#ifdef CANFIX_USE_UPLOADER
+        if(h->uploader && (id - CH_START) % 2 == 1) {
+            _uploader_channel(h->uploader, id, length, data);
+        }
+#endif
+#ifdef CANFIX_USE_SESSIONS
+        if(h->sessions) {
+            _session_channel(h->sessions, id, length, data);
+        }
+#endif
+    }
+}
+
+/* Handles a received frame.  With FD turned on, frames of more than eight
+   bytes are taken as FD frames. */
+void
+canfix_exec(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
+    if(length > CANFIX_DATA_LEN) length = CANFIX_DATA_LEN;
+#ifdef CANFIX_USE_FD
+    h->rx_fd = length > 8;
+    _exec(h, id, length, data);
+    h->rx_fd = 0;
+#else
+    _exec(h, id, length, data);
+#endif
+}
+
+#ifdef CANFIX_USE_FD
+/* Handles a frame that arrived as an FD frame, whatever its length.  Any
+   answer that the library sends to it goes out as FD as well. */
+void
+canfix_exec_fd(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
+    if(length > CANFIX_DATA_LEN) length = CANFIX_DATA_LEN;
+    h->rx_fd = 1;
+    _exec(h, id, length, data);
+    h->rx_fd = 0;
+}
+#endif
+
+/* This should be called periodically from the main loop with a millisecond
+ * time value.  The library uses it for all of its own timeouts so it doesn't
+ * matter where the time comes from as long as it counts up. */
+void
+canfix_tick(canfix_object *h, uint32_t now) {
+    h->now = now;
+#ifdef CANFIX_USE_PACKED
+    if(h->pack_len && now - h->pack_time >= h->pack_delay) {
+        canfix_pack_flush(h);
+    }
+#endif
+#ifdef CANFIX_USE_STORE
+    if(h->store && h->store->state != STORE_IDLE) {
+        _store_compact_step(h->store);
+    }
+#endif
+#ifdef CANFIX_USE_DEFERRED
+    _service_deferred(h);
+#endif
+#ifdef CANFIX_USE_FIRMWARE
+    canfix_firmware *fw = &h->firmware;
+
+    if(fw->state != FW_IDLE) {
+        if(fw->state == FW_CLOSED) {
+            if(now - fw->last >= CANFIX_FW_TIMEOUT) fw->state = FW_IDLE;
+        } else if(now - fw->last >= CANFIX_FW_TIMEOUT) {
+            _firmware_finish(h, FW_STATUS_TIMEOUT);
+        } else if(fw->state == FW_BLOCK && fw->window && (fw->resend || fw->unacked)) {
+            /* Either our resend request or an ack got lost or the host has
+               stopped short of the window. Tell it where we are again. */
+            if(now - fw->acktime >= CANFIX_FW_RETRY) {
+                _firmware_ack(h, fw->resend ? FW_RESEND : FW_ACK);
+            }
+        }
     }
+#endif
+#ifdef CANFIX_USE_UPLOADER
+    if(h->uploader) {
+        _uploader_tick(h->uploader);
+    }
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+    if(h->directory) {
+        _directory_tick(h->directory);
+    }
+#endif
+#ifdef CANFIX_USE_CFGCLIENT
+    if(h->cfgclient) {
+        _cfgclient_tick(h->cfgclient);
+    }
+#endif
+#ifdef CANFIX_USE_SESSIONS
+    if(h->sessions) {
+        _sessions_tick(h->sessions);
+    }
+#endif
+#ifdef CANFIX_USE_ALARMS
+    if(h->alarms) {
+        _alarm_tick(h->alarms);
+    }
+#endif
+#ifdef CANFIX_USE_CACHE
+    if(h->cache) {
+        _cache_tick(h->cache);
+    }
+#endif
+#ifdef CANFIX_USE_STATS
+    if(h->stats) {
+        _stats_tick(h->stats);
+    }
+#endif
 }
 
 int
@@ -257,53 +3510,98 @@ canfix_send_parameter(canfix_object *h, canfix_parameter par) {
     /* TODO: Do some bounds checking */
     uint8_t data[8];
 
-    data[0] = h->node;
+#ifdef CANFIX_USE_PARAM_ENABLE
+    if(! canfix_parameter_enabled(h, par.type)) return CANFIX_PARAM_DISABLED;
+#endif
+#ifdef CANFIX_USE_PACKED
+    if(h->packing) {
+        if(par.length > 5) par.length = 5;
+        _pack_parameter(h, &par);
+        return 0;
+    }
+#endif
+    data[0] = _LOAD(h->node);
     data[1] = par.index;
     data[2] = par.flags | (par.meta << 4);
     for(uint8_t n=0; n<5; n++) data[3+n] = par.data[n];
-    h->write_callback(par.type, par.length+3, data);
+    _write(h, par.type, par.length+3, data);
 	return 0;
 }
 
+/* Sends one four character packet of the description, or fifteen of them
+ * in an FD frame, which is padded with zeros to a length that FD allows.
+ * The last packet is the one that holds the terminating zero.  The node
+ * number and description are loaded once by the caller for the whole
+ * answer, so a change part way through can't mix two of them.  Returns the
+ * next packet to send or zero after the last one. */
+static uint16_t
+_send_description_packet(canfix_object *h, uint8_t node, const char *description,
+                         uint8_t dest, uint16_t packet, uint8_t fd) {
+    uint8_t data[CANFIX_DATA_LEN];
+    int length;
+    int chars = 4;
+#ifdef CANFIX_USE_ID_CACHE
+    canfix_id_cache *c = _id_acquire(h);
+    uint8_t count = c->count;
+
+    /* The cache is only used if it still holds what the answer started with */
+    if(! (fd && _TX_FD(h)) && count && c->node == node && c->desc == description) {
+        if(packet + 1 < count) {
+            memcpy(data, c->frames[packet + 1].data, 8);
+            data[1] = dest;
+            _write_as(h, c->frames[packet + 1].id, 8, data, 0);
+        }
+        _id_release(h, c);
+        return packet + 2 < count ? packet + 1 : 0;
+    }
+    _id_release(h, c);
+#endif
+    length = strlen(description);
+
+#ifdef CANFIX_USE_FD
+    if(fd && _TX_FD(h)) {
+        chars = length - packet * 4 < 60 ? canfix_fd_length(length - packet * 4 + 5) - 4 : 60;
+    }
+#else
+    (void)fd;
+#endif
+    data[0] = NSM_DESC;
+    data[1] = dest;
+    data[2] = packet;
+    data[3] = packet >> 8;
+    for(int i = 0; i < chars; i++) {
+        data[4 + i] = packet * 4 + i < length ? description[packet * 4 + i] : '\0';
+    }
+    _write_as(h, node + 0x6E0, 4 + chars, data, fd);
+    return packet * 4 + chars > length ? 0 : packet + chars / 4;
+}
+
 void
 canfix_send_identification(canfix_object *h, uint8_t dest) {
     uint8_t data[8];
-    char c;
-    int i, length;
-    bool done;
     uint16_t packet;
+    uint8_t node;
+    const char *description;
 
+#ifdef CANFIX_USE_ID_CACHE
+    if(! (_RX_FD(h) && _TX_FD(h)) && _id_send(h, dest)) return;
+#endif
+    node = _LOAD(h->node);
+    description = _LOAD(h->description);
     data[0] = NSM_ID;
     data[1] = dest;
     data[2] = 1;
     data[3] = h->device;
     data[4] = h->revision;
     memcpy(&data[5], &h->model, 3);
-    h->write_callback(h->node + 0x6E0, 8, data);
+    _write_as(h, node + 0x6E0, 8, data, _RX_FD(h));
 
     /* If we have a description string set then we'll send it here */
-    if(h->description) {
-        i = 0; packet = 0;
-        done = false;
-        data[0] = NSM_DESC;
-        length = strlen(h->description);
-
-        while(! done) {
-            if(i<length) {
-                c = h->description[i];
-            } else {
-                c = '\0';
-            }
-            data[i%4 + 4] = c;
-            if(i%4 == 3) {
-                data[2] = packet;
-                data[3] = packet >> 8;
-                packet++;
-                h->write_callback(h->node + 0x6E0, 8, data);
-                if(c == '\0') done = true;
-            }
-            i++;
-        }
+    if(description) {
+        packet = 0;
+        do {
+            packet = _send_description_packet(h, node, description, dest, packet, _RX_FD(h));
+        } while(packet);
     }
 }
 
@@ -321,51 +3619,292 @@ canfix_send_node_status(canfix_object *h, uint16_t ptype, void *data, uint8_t le
 	for(int n=0;n<len;n++) {
 		buff[3+n] = ((uint8_t *)data)[n];
 	}
-	return h->write_callback(h->node + 0x6E0, len+3, buff);
+	return _write(h, _LOAD(h->node) + 0x6E0, len+3, buff);
 }
 
 
 #ifdef CANFIX_USE_QUEUE
+static uint8_t
+_queue_class(uint16_t id, uint8_t length, uint8_t *data) {
+    if(id < 256) return CANFIX_QUEUE_ALARM;
+    if(id < NSM_START) return CANFIX_QUEUE_PARAMETER;
+    if(id >= CH_START) return CANFIX_QUEUE_CHANNEL;
+#ifdef CANFIX_USE_PACKED
+    if(_PACKED(length, data)) return CANFIX_QUEUE_PARAMETER;
+#else
+    (void)length;
+    (void)data;
+#endif
+    return CANFIX_QUEUE_NSM;
+}
+
+/* Counts a frame that the queue had no room for */
+static void
+_queue_lost(canfix_object *h, canfix_frame *f) {
+    h->queue_stats.overflows[_queue_class(f->id, f->length, f->data)]++;
+}
+
+static void
+_queue_copy(canfix_frame *f, uint16_t id, uint8_t length, uint8_t *data) {
+    f->id = id;
+    f->length = length;
+#ifdef CANFIX_USE_FD
+    f->flags = length > 8 ? CANFIX_FD : 0;
+#endif
+    for(int n=0; n < length; n++) {
+        f->data[n] = data[n];
+    }
+}
+
+#ifdef CANFIX_USE_QUEUE_CLASSES
+/* True if the next frame to come off of the queue is in the priority ring.
+   It is once every parameter frame that arrived before it is gone. */
+static int
+_queue_priority_next(canfix_object *h) {
+    if(h->pcount == 0) return 0;
+    return h->count == 0 || (int16_t)(h->removed - h->pmark[h->ptail]) >= 0;
+}
+
+static int
+_queue_push_priority(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
+    int result = 0;
+    canfix_frame f;
+
+    if(h->pcount == CANFIX_QUEUE_PRIORITY_LEN) {
+        if(h->queue_policy == CANFIX_QUEUE_DROP_NEWEST) {
+            _queue_copy(&f, id, length, data);
+            _queue_lost(h, &f);
+            return CANFIX_QUEUE_OVERFLOW;
+        }
+        _queue_lost(h, &h->pqueue[h->ptail]);
+        h->ptail++;
+        if(h->ptail == CANFIX_QUEUE_PRIORITY_LEN) h->ptail = 0;
+        h->pcount--;
+        result = CANFIX_QUEUE_OVERFLOW;
+    }
+    _queue_copy(&h->pqueue[h->phead], id, length, data);
+    h->pmark[h->phead] = h->pushed;
+    h->phead++;
+    if(h->phead == CANFIX_QUEUE_PRIORITY_LEN) h->phead = 0;
+    h->pcount++;
+    if(h->pcount > h->queue_stats.priority_high) h->queue_stats.priority_high = h->pcount;
+    return result;
+}
+#endif
+
+/* The next frame to come off of the queue or NULL if it is empty */
+static canfix_frame *
+_queue_tail(canfix_object *h) {
+#ifdef CANFIX_USE_QUEUE_CLASSES
+    if(_queue_priority_next(h)) return &h->pqueue[h->ptail];
+#endif
+    return h->count ? &h->queue[h->tail] : NULL;
+}
+
+/* Drops the frame at the tail of the queue */
+static void
+_queue_next(canfix_object *h) {
+#ifdef CANFIX_USE_QUEUE_CLASSES
+    if(_queue_priority_next(h)) {
+        h->ptail++;
+        if(h->ptail == CANFIX_QUEUE_PRIORITY_LEN) h->ptail = 0;
+        h->pcount--;
+        return;
+    }
+    h->removed++;
+#endif
+    h->tail++;
+    if(h->tail == CANFIX_QUEUE_LEN) h->tail = 0;
+    h->count--;
+#ifdef CANFIX_USE_PACKED
+    h->poll_skip = 0;
+#endif
+}
+
 /* If the queue feature is enabled then this function is used to push a message onto the queue
- * It will return CANFIX_QUEUE_OVERRUN if the queue is full in which case the oldest message on
- * the queue will be over written and lost.  Otherwise it returns zero.
+ * It will return CANFIX_QUEUE_OVERFLOW if the queue is full, in which case either the oldest
+ * message on the queue or this one is lost, depending on the policy given to
+ * canfix_queue_set_policy().  Otherwise it returns zero.  With CANFIX_USE_QUEUE_CLASSES
+ * everything but parameters goes in the priority ring and only pushes out frames there.
  */
 int
 canfix_queue_push(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
-    h->queue[h->head].id = id;
-    h->queue[h->head].length = length;
-    for(int n=0; n < length; n++) {
-        h->queue[h->head].data[n] = data[n];
+    int result = 0;
+    canfix_frame f;
+
+    if(length > CANFIX_DATA_LEN) length = CANFIX_DATA_LEN;
+#ifdef CANFIX_USE_QUEUE_CLASSES
+    if(_queue_class(id, length, data) != CANFIX_QUEUE_PARAMETER) {
+        return _queue_push_priority(h, id, length, data);
     }
-    h->head++;
-    if(h->head == CANFIX_QUEUE_LEN) h->head = 0;
+#endif
     if(h->count == CANFIX_QUEUE_LEN) {
+        if(h->queue_policy == CANFIX_QUEUE_DROP_NEWEST) {
+            _queue_copy(&f, id, length, data);
+            _queue_lost(h, &f);
+            return CANFIX_QUEUE_OVERFLOW;
+        }
+        _queue_lost(h, &h->queue[h->tail]);
         h->tail++;
         if(h->tail == CANFIX_QUEUE_LEN) h->tail = 0;
-        return CANFIX_QUEUE_OVERFLOW;
+        h->count--;
+#ifdef CANFIX_USE_PACKED
+        h->poll_skip = 0;
+#endif
+#ifdef CANFIX_USE_QUEUE_CLASSES
+        h->removed++;
+#endif
+        result = CANFIX_QUEUE_OVERFLOW;
     }
-    else h->count++;
-    return 0;
+    _queue_copy(&h->queue[h->head], id, length, data);
+    h->head++;
+    if(h->head == CANFIX_QUEUE_LEN) h->head = 0;
+    h->count++;
+#ifdef CANFIX_USE_QUEUE_CLASSES
+    h->pushed++;
+#endif
+    if(h->count > h->queue_stats.high) h->queue_stats.high = h->count;
+    return result;
 }
 
 /* If the queue feature is enabled then this function is used to execute the next message on the
  * queue.  It returns CANFIX_QUEUE_EMPTY if nothing was done because the queue was empty and zero
- * if canfix_exec() was called.
+ * if canfix_exec() was called.  data has to have room for CANFIX_DATA_LEN bytes.
  */
 int
 canfix_queue_pop(canfix_object *h, uint16_t *id, uint8_t *length, uint8_t *data) {
-    if(h->count == 0) return CANFIX_QUEUE_EMPTY;
-    *id = h->queue[h->tail].id;
-    *length = h->queue[h->tail].length;
+    canfix_frame *f = _queue_tail(h);
+
+    if(f == NULL) return CANFIX_QUEUE_EMPTY;
+    *id = f->id;
+    *length = f->length;
     for(int n=0; n < *length; n++) {
-        data[n] = h->queue[h->tail].data[n];
+        data[n] = f->data[n];
     }
-
-    h->tail++;
-    if(h->tail == CANFIX_QUEUE_LEN) h->tail = 0;
-    h->count--;
+    _queue_next(h);
     return 0;
 }
+
+/* Sets what happens to a frame that arrives when the queue is full, either
+   CANFIX_QUEUE_OVERWRITE, the default, or CANFIX_QUEUE_DROP_NEWEST */
+void
+canfix_queue_set_policy(canfix_object *h, uint8_t policy) {
+    h->queue_policy = policy;
+}
+
+/* Copies out the high water marks and the count of frames lost in overflows
+   since the last canfix_queue_clear_stats() */
+void
+canfix_queue_get_stats(canfix_object *h, canfix_queue_stats *stats) {
+    *stats = h->queue_stats;
+}
+
+void
+canfix_queue_clear_stats(canfix_object *h) {
+    memset(&h->queue_stats, 0, sizeof(canfix_queue_stats));
+}
+
+#ifdef CANFIX_USE_PACKED
+/* Number of parameters in a packed frame, counted the way
+   _unpack_parameters() reads them */
+static uint8_t
+_packed_count(canfix_frame *f) {
+    uint8_t pos = 2, count = 0, len;
+    uint16_t type;
+
+    while(pos + 4 <= f->length) {
+        type = (f->data[pos] | f->data[pos + 1] << 8) & 0x7FF;
+        len = f->data[pos + 1] >> 3;
+        if(type < CANFIX_PARAM_START || type >= NSM_START) break;
+        if(len > 5 || pos + 4 + len > f->length) break;
+        pos += 4 + len;
+        count++;
+    }
+    return count;
+}
+
+/* Decodes count parameters from a packed frame, starting after the first
+   skip of them */
+static void
+_poll_packed(canfix_frame *f, canfix_event *e, uint8_t skip, uint8_t count) {
+    uint8_t pos = 2;
+
+    for(uint8_t i = 0; i < skip; i++) pos += 4 + (f->data[pos + 1] >> 3);
+    for(uint8_t i = 0; i < count; i++, e++) {
+        e->type = CANFIX_EVENT_PARAMETER;
+        e->id = (f->data[pos] | f->data[pos + 1] << 8) & 0x7FF;
+        e->node = f->id - NSM_START;
+        e->code = e->id;
+        e->index = f->data[pos + 2];
+        e->meta = f->data[pos + 3] >> 4;
+        e->flags = f->data[pos + 3] & 0x0F;
+        e->length = f->data[pos + 1] >> 3;
+        memcpy(e->data, &f->data[pos + 4], e->length);
+        pos += 4 + e->length;
+    }
+}
+#endif
+
+/* Takes frames off of the queue and decodes them into events for the
+ * caller to handle in its own time.  No callbacks are called and nothing is
+ * answered, NSM and channel events can be given to canfix_exec() for the
+ * library to handle if they need it.  With packing turned on a packed frame
+ * becomes one event for each of its parameters.  If they don't all fit the
+ * rest come from the next call.  Returns the number of events written. */
+int
+canfix_poll(canfix_object *h, canfix_event *events, int max) {
+    canfix_frame *f;
+    canfix_event *e;
+    int n = 0;
+
+    while(n < max && (f = _queue_tail(h)) != NULL) {
+        e = &events[n];
+        e->id = f->id;
+        if(f->id == 0x00) {
+            e->type = 0;
+        } else if(f->id < 256) {
+            /* An alarm without its code is skipped, same as in canfix_exec() */
+            e->type = f->length < 2 ? 0 : CANFIX_EVENT_ALARM;
+            e->node = f->id;
+            e->code = f->length < 2 ? 0 : f->data[0] | f->data[1] << 8;
+            e->length = f->length < 2 ? 0 : f->length - 2;
+            memcpy(e->data, &f->data[2], e->length);
+        } else if(f->id < NSM_START) {
+            e->type = f->length < 3 ? 0 : CANFIX_EVENT_PARAMETER;
+            e->node = f->data[0];
+            e->code = f->id;
+            e->index = f->data[1];
+            e->meta = f->data[2] >> 4;
+            e->flags = f->data[2] & 0x0F;
+            e->length = f->length < 3 ? 0 : f->length - 3 > 5 ? 5 : f->length - 3;
+            memcpy(e->data, &f->data[3], e->length);
+#ifdef CANFIX_USE_PACKED
+        } else if(f->id < CH_START && _PACKED(f->length, f->data)) {
+            uint8_t count = _packed_count(f) - h->poll_skip;
+
+            if(count > max - n) count = max - n;
+            _poll_packed(f, e, h->poll_skip, count);
+            n += count;
+            if(h->poll_skip + count < _packed_count(f)) {
+                h->poll_skip += count;
+                break;
+            }
+            _queue_next(h);
+            continue;
+#endif
+        } else {
+            e->type = f->id < CH_START ? CANFIX_EVENT_NSM : CANFIX_EVENT_CHANNEL;
+            e->node = f->id < CH_START ? f->id - NSM_START : (f->id - CH_START) / 2;
+            e->code = f->id < CH_START ? f->data[0] : (f->id - CH_START) % 2;
+            e->index = f->data[1];
+            e->length = f->length;
+            memcpy(e->data, f->data, f->length);
+        }
+        if(e->type) n++;
+        _queue_next(h);
+    }
+    return n;
+}
 #endif
 
 
@@ -25,8 +25,249 @@
 #include <stdint.h>
 #include <string.h>
 
-#define CANFIX_USE_QUEUE 1
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Node side features.  These are all in unless CANFIX_MINIMAL is defined,
+ * in which case only the ones defined on the command line are built.  The
+ * sizes can be set on the command line as well.  make size_report in the
+ * src directory shows what each feature costs. */
+#ifndef CANFIX_MINIMAL
+#define CANFIX_USE_QUEUE 1        // Queue for frames picked up in an interrupt
+#define CANFIX_USE_CHANNELS 1     // Two way connections and channel traffic
+#define CANFIX_USE_FIRMWARE 1     // Firmware downloads to this node
+#define CANFIX_USE_CONFIG 1       // Configuration Set and Query messages
+#define CANFIX_USE_CONFIG_TABLE 1 // Configuration keys served from a table
+#define CANFIX_USE_PARAM_ENABLE 1 // Disable and Enable Parameter messages
+#define CANFIX_USE_DEFERRED 1     // Broadcast requests answered after a delay
+#endif
+
+#ifndef CANFIX_QUEUE_LEN
 #define CANFIX_QUEUE_LEN 32
+#endif
+
+/* NSM, alarm and channel frames queued in a ring of their own so that a
+   burst of parameters can't push them out of the queue. */
+//#define CANFIX_USE_QUEUE_CLASSES 1
+#ifndef CANFIX_QUEUE_PRIORITY_LEN
+#define CANFIX_QUEUE_PRIORITY_LEN 8
+#endif
+
+/* Node side firmware download.  The timeouts are in milliseconds and are
+   measured against the time given to canfix_tick(). */
+#ifndef CANFIX_FW_WINDOW
+#define CANFIX_FW_WINDOW  32   // Largest window of unacknowledged frames we accept
+#endif
+#ifndef CANFIX_FW_TIMEOUT
+#define CANFIX_FW_TIMEOUT 2000 // Abandon the download after this much silence
+#endif
+#ifndef CANFIX_FW_RETRY
+#define CANFIX_FW_RETRY   50   // Time between repeated acknowledgements
+#endif
+
+/* Persistent storage of the configuration table in a journal.  This needs
+   a block device from the user so it is left out unless it is defined. */
+//#define CANFIX_USE_STORE 1
+#ifndef CANFIX_STORE_STEP
+#define CANFIX_STORE_STEP 4  // Keys copied per tick while compacting
+#endif
+
+/* Answers to broadcast Node Identification and Report requests can be held
+   back for a while so that every node on the bus doesn't answer at once.
+   This is turned on with canfix_set_response_jitter(). */
+#ifndef CANFIX_DEFER_LEN
+#define CANFIX_DEFER_LEN   2  // Deferred answers that can be waiting
+#endif
+#ifndef CANFIX_DEFER_BURST
+#define CANFIX_DEFER_BURST 4  // Description frames sent per tick
+#endif
+#ifndef CANFIX_DEFER_SLOT
+#define CANFIX_DEFER_SLOT  4  // Width of each node's slot in milliseconds
+#endif
+
+/* The Node Identification answer and the description frames built once and
+   kept, so that answering a request only means sending them.  Descriptions
+   that don't fit are sent from the string as before. */
+//#define CANFIX_USE_ID_CACHE 1
+#ifndef CANFIX_ID_FRAMES
+#define CANFIX_ID_FRAMES 33 // Identification and 128 characters of description
+#endif
+
+/* CAN FD frames of up to 64 bytes.  The library still talks classic CAN to
+   anything that talks classic CAN to it, so this only needs the FD write
+   callback and frames passed to canfix_exec_fd(). */
+//#define CANFIX_USE_FD 1
+
+/* Parameters packed several to an FD frame for nodes that ask for them that
+   way.  Turns on CANFIX_USE_FD. */
+//#define CANFIX_USE_PACKED 1
+#ifndef CANFIX_PACK_DELAY
+#define CANFIX_PACK_DELAY 5 // Longest a parameter waits for the frame to fill
+#endif
+
+/* With CANFIX_CONST_CALLBACKS the callbacks can only be given as one const
+   table with canfix_set_callbacks() and the canfix_object doesn't keep a
+   copy of them. */
+//#define CANFIX_CONST_CALLBACKS 1
+
+/* Node number, bitrate, description and enable bits loaded and stored
+   atomically so that other threads can send while the receive thread
+   changes them.  Needs GCC or Clang. */
+//#define CANFIX_USE_ATOMIC 1
+
+/* Host side components.  These are normally only needed by tools and gateways
+   so they are left out unless they are defined here or on the command line. */
+//#define CANFIX_USE_UPLOADER 1
+//#define CANFIX_USE_DIRECTORY 1
+//#define CANFIX_USE_CFGCLIENT 1
+//#define CANFIX_USE_ALARMS 1
+//#define CANFIX_USE_CACHE 1
+//#define CANFIX_USE_STATS 1
+//#define CANFIX_USE_HISTORY 1 // Turns on CANFIX_USE_CACHE
+//#define CANFIX_USE_GATEWAY 1
+//#define CANFIX_USE_SESSIONS 1
+
+/* Firmware downloads and sessions run on communication channels and the configuration
+   table answers configuration messages */
+#if defined(CANFIX_USE_FIRMWARE) || defined(CANFIX_USE_UPLOADER) || defined(CANFIX_USE_SESSIONS)
+#ifndef CANFIX_USE_CHANNELS
+#define CANFIX_USE_CHANNELS 1
+#endif
+#endif
+#if defined(CANFIX_USE_HISTORY) && ! defined(CANFIX_USE_CACHE)
+#define CANFIX_USE_CACHE 1
+#endif
+#if defined(CANFIX_USE_PACKED) && ! defined(CANFIX_USE_FD)
+#define CANFIX_USE_FD 1
+#endif
+#if defined(CANFIX_USE_STORE) && ! defined(CANFIX_USE_CONFIG_TABLE)
+#define CANFIX_USE_CONFIG_TABLE 1
+#endif
+#if defined(CANFIX_USE_CONFIG_TABLE) && ! defined(CANFIX_USE_CONFIG)
+#define CANFIX_USE_CONFIG 1
+#endif
+
+#ifdef CANFIX_USE_UPLOADER
+#ifndef CANFIX_UPLOAD_TARGETS
+#define CANFIX_UPLOAD_TARGETS 8    // Nodes that can be loaded at the same time
+#endif
+#ifndef CANFIX_UPLOAD_BLOCK
+#define CANFIX_UPLOAD_BLOCK   1024 // Bytes per block
+#endif
+#ifndef CANFIX_UPLOAD_WINDOW
+#define CANFIX_UPLOAD_WINDOW  16   // Frames in flight per node
+#endif
+#ifndef CANFIX_UPLOAD_TIMEOUT
+#define CANFIX_UPLOAD_TIMEOUT 250  // Time to wait for an acknowledgement
+#endif
+#ifndef CANFIX_UPLOAD_RETRIES
+#define CANFIX_UPLOAD_RETRIES 8    // Retries of one step before giving up
+#endif
+#endif
+
+#ifdef CANFIX_USE_DIRECTORY
+#ifndef CANFIX_DIRECTORY_SIZE
+#define CANFIX_DIRECTORY_SIZE 64   // Nodes that can be tracked
+#endif
+#ifndef CANFIX_DESC_LEN
+#define CANFIX_DESC_LEN       128  // Longest description that is kept
+#endif
+#ifndef CANFIX_NODE_TIMEOUT
+#define CANFIX_NODE_TIMEOUT   5000 // Node is lost after this much silence
+#endif
+#endif
+
+#ifdef CANFIX_USE_CFGCLIENT
+/* Answers don't carry the key so if a node misses a request while others are
+   in flight behind it the answers get matched to the wrong requests.  Only
+   raise the depth on networks where the nodes never drop frames. */
+#ifndef CANFIX_CFG_REQUESTS
+#define CANFIX_CFG_REQUESTS 64  // Requests that can be waiting, 255 at most
+#endif
+#ifndef CANFIX_CFG_DEPTH
+#define CANFIX_CFG_DEPTH    1   // Requests in flight to one node at a time
+#endif
+#ifndef CANFIX_CFG_TIMEOUT
+#define CANFIX_CFG_TIMEOUT  100 // Time to wait for an answer
+#endif
+#ifndef CANFIX_CFG_RETRIES
+#define CANFIX_CFG_RETRIES  3
+#endif
+#endif
+
+#ifdef CANFIX_USE_SESSIONS
+#ifndef CANFIX_SESSION_BUF
+#define CANFIX_SESSION_BUF     64   // Received bytes kept for each session
+#endif
+#ifndef CANFIX_SESSION_ANSWER
+#define CANFIX_SESSION_ANSWER  250  // Time to wait for a session to be accepted
+#endif
+#ifndef CANFIX_SESSION_TIMEOUT
+#define CANFIX_SESSION_TIMEOUT 5000 // Session is closed after this much silence
+#endif
+#endif
+
+#ifdef CANFIX_USE_ALARMS
+#ifndef CANFIX_ALARM_SIZE
+#define CANFIX_ALARM_SIZE    32   // Active alarms that can be tracked
+#endif
+#ifndef CANFIX_ALARM_WINDOW
+#define CANFIX_ALARM_WINDOW  500  // Shortest time between updates of one alarm
+#endif
+#ifndef CANFIX_ALARM_TIMEOUT
+#define CANFIX_ALARM_TIMEOUT 3000 // Alarm is cleared when it isn't repeated
+#endif
+#endif
+
+#ifdef CANFIX_USE_CACHE
+#ifndef CANFIX_CACHE_SIZE
+#define CANFIX_CACHE_SIZE   256 // Parameters that can be cached, 65535 at most
+#endif
+#ifndef CANFIX_HASH_SIZE
+#define CANFIX_HASH_SIZE    512 // Power of two larger than the cache
+#endif
+#ifndef CANFIX_WHEEL_SLOTS
+#define CANFIX_WHEEL_SLOTS  128 // Slots in the staleness timing wheel
+#endif
+#ifndef CANFIX_WHEEL_RES
+#define CANFIX_WHEEL_RES    10  // Milliseconds covered by each slot
+#endif
+/* The hash is probed until an empty slot, so it can never fill up */
+#if CANFIX_HASH_SIZE <= CANFIX_CACHE_SIZE
+#error "CANFIX_HASH_SIZE has to be larger than CANFIX_CACHE_SIZE"
+#endif
+#endif
+
+#ifdef CANFIX_USE_HISTORY
+#ifndef CANFIX_HISTORY_LEN
+#define CANFIX_HISTORY_LEN      1024 // Raw samples kept for each parameter
+#endif
+#ifndef CANFIX_HISTORY_TIER_LEN
+#define CANFIX_HISTORY_TIER_LEN 1800 // Samples in each of the 1s and 10s tiers
+#endif
+#endif
+
+#ifdef CANFIX_USE_GATEWAY
+#ifndef CANFIX_GATEWAY_BUSES
+#define CANFIX_GATEWAY_BUSES 4  // Networks joined by one gateway, 8 at most
+#endif
+#ifndef CANFIX_ECHO_LEN
+#define CANFIX_ECHO_LEN      16 // Frames remembered on each bus to catch echoes
+#endif
+#ifndef CANFIX_ECHO_TIME
+#define CANFIX_ECHO_TIME     50 // How long a forwarded frame is remembered
+#endif
+#endif
+
+#ifdef CANFIX_USE_STATS
+#ifndef CANFIX_STATS_BUCKETS
+#define CANFIX_STATS_BUCKETS 10   // Buckets in the sliding window
+#endif
+#ifndef CANFIX_STATS_BUCKET
+#define CANFIX_STATS_BUCKET  1000 // Milliseconds covered by each bucket
+#endif
+#endif
 
 // Node Specific Message Control Codes
 #define NSM_START    0x6E0
@@ -45,6 +286,7 @@
 #define NSM_CONFGET  10 // Configuration Query
 #define NSM_DESC     11 // Node description
 #define NSM_PSET     12 //12 - 19 are the parameter set codes
+#define NSM_PACKED   0xF0 // Packed parameters, a library extension for FD
 
 #define NODESTAT_STATUS    0
 #define NODESTAT_TEMP      1
@@ -56,6 +298,23 @@
 #define NODESTAT_CANRXOVR  7
 
 
+/* Firmware channel control codes and download status */
+#define FW_END_TRANSMISSION 0xFD
+#define FW_ABORT            0xFE
+
+#define FW_ACK    0x00 // Cumulative acknowledgement
+#define FW_RESEND 0x01 // Frames were lost, resend from the given offset
+
+#define FW_STATUS_COMPLETE 0
+#define FW_STATUS_ABORTED  1
+#define FW_STATUS_TIMEOUT  2
+#define FW_STATUS_ERROR    3
+
+/* Response jitter modes */
+#define CANFIX_JITTER_OFF    0
+#define CANFIX_JITTER_SLOT   1 // Delay set by the node number
+#define CANFIX_JITTER_RANDOM 2 // Random delay
+
 #define FCB_ANNUNC    0x01
 #define FCB_QUALITY   0x02
 #define FCB_FAIL      0x04
@@ -64,6 +323,7 @@
 #define CFG_ERR_READONLY 2
 #define CFG_ERR_OUTOFRNG 3
 #define CFG_ERR_WRNGTYPE 4
+#define CFG_ERR_TIMEOUT  0xFF // Never sent, the configuration client gave up
 
 /* Convenience typdefs for the CANFiX data types */
 typedef char     canfix_char;
@@ -77,6 +337,17 @@ typedef int32_t  canfix_dint;
 typedef uint32_t canfix_udint;
 typedef float    canfix_float;
 
+/* Data type codes used by the configuration table */
+#define CANFIX_TYPE_BYTE   1
+#define CANFIX_TYPE_WORD   2
+#define CANFIX_TYPE_SHORT  3
+#define CANFIX_TYPE_USHORT 4
+#define CANFIX_TYPE_INT    5
+#define CANFIX_TYPE_UINT   6
+#define CANFIX_TYPE_DINT   7
+#define CANFIX_TYPE_UDINT  8
+#define CANFIX_TYPE_FLOAT  9
+
 typedef struct _canfix_parameter {
     uint16_t type;
     uint8_t node;
@@ -88,74 +359,856 @@ typedef struct _canfix_parameter {
 } canfix_parameter;
 
 
-#ifdef CANFIX_USE_QUEUE
+#ifdef CANFIX_USE_FD
+#define CANFIX_DATA_LEN 64
+#else
+#define CANFIX_DATA_LEN 8
+#endif
+
+/* Frame flags given to the FD write callback */
+#define CANFIX_FD     0x01 // Send as an FD frame
+#define CANFIX_FD_BRS 0x02 // Switch to the data bitrate for the payload
+
 typedef struct {
 	uint16_t id;
 	uint8_t length;
-	uint8_t data[8];
+#ifdef CANFIX_USE_FD
+	uint8_t flags;
+#endif
+	uint8_t data[CANFIX_DATA_LEN];
 } canfix_frame;
+
+#ifdef CANFIX_USE_ID_CACHE
+/* One copy of the identification answer and the description frames */
+typedef struct {
+    uint8_t node;       // Node number the frames were built for
+    uint8_t count;      // Frames built, zero if the description didn't fit
+    const char *desc;   // Description they were built from
+    canfix_frame frames[CANFIX_ID_FRAMES];
+} canfix_id_cache;
+#endif
+
+#ifdef CANFIX_USE_QUEUE
+/* Kinds of events from canfix_poll() */
+#define CANFIX_EVENT_PARAMETER 1
+#define CANFIX_EVENT_ALARM     2
+#define CANFIX_EVENT_NSM       3 // Node specific message, request or answer
+#define CANFIX_EVENT_CHANNEL   4 // Two way communication channel
+
+/* One received frame as canfix_poll() decodes it.  What the fields hold
+ * depends on the type:
+ *
+ *            node        code          index        data
+ * PARAMETER  sender      type          index        the value
+ * ALARM      sender      alarm code    -            after the code
+ * NSM        sender      control code  data[1]      the whole frame
+ * CHANNEL    channel     1 if answer   -            the whole frame
+ *
+ * NSM and channel frames are kept whole so they can be given to
+ * canfix_exec() as they are. */
+typedef struct {
+    uint8_t type;
+    uint8_t node;
+    uint16_t id;        // CAN ID of the frame
+    uint16_t code;
+    uint8_t index;
+    uint8_t meta;       // Parameters only
+    uint8_t flags;      // Parameters only
+    uint8_t length;
+    uint8_t data[CANFIX_DATA_LEN];
+} canfix_event;
+
+/* What the queue does with a frame that arrives when it is full */
+#define CANFIX_QUEUE_OVERWRITE   0 // The oldest frame is lost
+#define CANFIX_QUEUE_DROP_NEWEST 1 // The new frame is lost
+
+/* Classes of queued frames.  Packed parameter frames count as parameters. */
+#define CANFIX_QUEUE_PARAMETER 0
+#define CANFIX_QUEUE_ALARM     1
+#define CANFIX_QUEUE_NSM       2
+#define CANFIX_QUEUE_CHANNEL   3
+
+typedef struct {
+    uint16_t high;          // Most frames that have been waiting at once
+    uint16_t priority_high; // The same for the priority ring
+    uint32_t overflows[4];  // Frames lost, by class
+} canfix_queue_stats;
 #endif
 
 
 #define CANFIX_QUEUE_OVERFLOW -1
 #define CANFIX_QUEUE_EMPTY -2
+#define CANFIX_PARAM_DISABLED -3
 
+// Range of the parameter identifiers
+#define CANFIX_PARAM_START 0x100
+#define CANFIX_PARAM_COUNT (NSM_START - CANFIX_PARAM_START)
+
+#ifdef CANFIX_USE_FIRMWARE
+/* State of a firmware download that is being received on a channel */
 typedef struct {
-    uint8_t node;
-    uint8_t device;
-    uint8_t revision;
-    uint32_t model;
-    char *description;
+    uint8_t state;
+    uint8_t channel;
+    uint8_t subsystem;
+    uint8_t window;    // Zero for the original one ack per frame transfer
+    uint8_t seq;       // Sequence number of the next frame we expect
+    uint8_t unacked;   // Frames received since the last acknowledgement
+    uint8_t resend;    // Set while we are waiting for a lost frame
+    uint32_t address;
+    uint32_t size;     // Size of the block from the start of block frame
+    uint32_t offset;   // Bytes received so far in this block
+    uint32_t last;     // Time that the last frame arrived
+    uint32_t acktime;  // Time that the last acknowledgement was sent
+} canfix_firmware;
+#endif
 
-#ifdef CANFIX_USE_QUEUE
-    canfix_frame queue[CANFIX_QUEUE_LEN];
-    int head;
-    int tail;
-    int count;
+#ifdef CANFIX_USE_CONFIG_TABLE
+#define CFG_READONLY 0x01
+#define CFG_NOSAVE   0x02 // Not kept in the store
+
+/* One entry in a node's configuration table.  The table has to be sorted by
+ * key.  The value is range checked against min and max unless they are
+ * equal.  If validate is set it is called with the key and a pointer to the
+ * new value before it is stored and can return one of the CFG_ERR_* codes to
+ * refuse it. */
+typedef struct {
+    uint16_t key;
+    uint8_t type;
+    uint8_t flags;
+    void *storage;
+    int32_t min;
+    int32_t max;
+    uint8_t (*validate)(uint16_t, void *);
+} canfix_config_key;
+#endif
+
+#ifdef CANFIX_USE_DEFERRED
+/* A broadcast request that we haven't answered yet */
+typedef struct {
+    uint8_t code;     // NSM_ID or NSM_REPORT, 0xFF if the entry is free
+    uint8_t dest;
+    uint16_t packet;  // Next description packet, 0xFFFF before the ID frame
+#ifdef CANFIX_USE_FD
+    uint8_t fd;       // The request was an FD frame
+#endif
+    uint8_t node;     // Node number and description the answer started with
+    const char *description;
+    uint32_t due;
+} canfix_deferred;
+#endif
+
+#ifdef CANFIX_USE_STORE
+/* The block device that the store is kept on.  Addresses are bytes from the
+ * start of the device, which is divided into at least two sectors that can
+ * be erased on their own.  Erased bytes must read as 0xFF and the store only
+ * ever clears bits of bytes that it has already written.  Each function
+ * returns zero on success. */
+typedef struct {
+    int (*read)(uint32_t, void *, uint16_t);
+    int (*write)(uint32_t, const void *, uint16_t);
+    int (*erase)(uint8_t);
+    uint32_t sector_size;
+    uint8_t sectors;
+} canfix_store_device;
+
+typedef struct _canfix_store canfix_store;
+#endif
+
+#ifdef CANFIX_USE_UPLOADER
+typedef struct _canfix_uploader canfix_uploader;
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+typedef struct _canfix_directory canfix_directory;
+#endif
+#ifdef CANFIX_USE_CFGCLIENT
+typedef struct _canfix_cfgclient canfix_cfgclient;
+#endif
+#ifdef CANFIX_USE_ALARMS
+typedef struct _canfix_alarms canfix_alarms;
+#endif
+#ifdef CANFIX_USE_CACHE
+typedef struct _canfix_cache canfix_cache;
+#endif
+#ifdef CANFIX_USE_HISTORY
+typedef struct _canfix_history canfix_history;
+#endif
+#ifdef CANFIX_USE_STATS
+typedef struct _canfix_stats canfix_stats;
+#endif
+#ifdef CANFIX_USE_GATEWAY
+typedef struct _canfix_gateway canfix_gateway;
+#endif
+#ifdef CANFIX_USE_SESSIONS
+typedef struct _canfix_sessions canfix_sessions;
 #endif
 
+/* The functions that the library calls.  Instead of setting them one at a
+ * time they can all be given at once as a const table, which can be kept
+ * in flash, with canfix_set_callbacks().  Entries that aren't used are
+ * NULL, except for the write callback which is always needed.  Every
+ * callback also comes in a form that is given the context set with
+ * canfix_set_context() as its first argument, so one function can serve
+ * several objects.  Those can only be given in a table and are called
+ * instead of the plain one when both are set. */
+typedef struct {
     int (*write_callback)(uint16_t, uint8_t, uint8_t *);
+#ifdef CANFIX_USE_FD
+    int (*fd_write_callback)(uint16_t, uint8_t, uint8_t *, uint8_t);
+#endif
+    void (*parameter_callback)(canfix_parameter);
+    void (*alarm_callback)(uint8_t, uint16_t, uint8_t*, uint8_t);
     void (*node_set_callback)(uint8_t);
     void (*bitrate_callback)(uint8_t);
     void (*report_callback)(void);
+#ifdef CANFIX_USE_CHANNELS
     uint8_t (*twoway_callback)(uint8_t, uint16_t);
+#endif
+#ifdef CANFIX_USE_CONFIG
     uint8_t (*config_callback)(uint16_t, uint8_t *, uint8_t);
     uint8_t (*query_callback)(uint16_t, uint8_t *, uint8_t *);
-    void (*parameter_callback)(canfix_parameter);
-    void (*alarm_callback)(uint8_t, uint16_t, uint8_t*, uint8_t);
+#endif
     uint8_t (*firmware_callback)(uint16_t, uint8_t);
+#ifdef CANFIX_USE_ID_CACHE
+    int (*batch_write_callback)(const canfix_frame *, uint16_t);
+#endif
+#ifdef CANFIX_USE_FIRMWARE
+    uint8_t (*firmware_write_callback)(uint8_t, uint32_t, uint8_t *, uint8_t);
+    void (*firmware_done_callback)(uint8_t);
+#endif
     // void (*_stream_callback)(uint8_t, uint8_t *, uint8_t);
+
+    /* The same callbacks with the context.  They come after the others so
+       that tables built for the plain ones stay the same. */
+    int (*write_ctx_callback)(void *, uint16_t, uint8_t, uint8_t *);
+#ifdef CANFIX_USE_FD
+    int (*fd_write_ctx_callback)(void *, uint16_t, uint8_t, uint8_t *, uint8_t);
+#endif
+    void (*parameter_ctx_callback)(void *, canfix_parameter);
+    void (*alarm_ctx_callback)(void *, uint8_t, uint16_t, uint8_t*, uint8_t);
+    void (*node_set_ctx_callback)(void *, uint8_t);
+    void (*bitrate_ctx_callback)(void *, uint8_t);
+    void (*report_ctx_callback)(void *);
+#ifdef CANFIX_USE_CHANNELS
+    uint8_t (*twoway_ctx_callback)(void *, uint8_t, uint16_t);
+#endif
+#ifdef CANFIX_USE_CONFIG
+    uint8_t (*config_ctx_callback)(void *, uint16_t, uint8_t *, uint8_t);
+    uint8_t (*query_ctx_callback)(void *, uint16_t, uint8_t *, uint8_t *);
+#endif
+    uint8_t (*firmware_ctx_callback)(void *, uint16_t, uint8_t);
+#ifdef CANFIX_USE_ID_CACHE
+    int (*batch_write_ctx_callback)(void *, const canfix_frame *, uint16_t);
+#endif
+#ifdef CANFIX_USE_FIRMWARE
+    uint8_t (*firmware_write_ctx_callback)(void *, uint8_t, uint32_t, uint8_t *, uint8_t);
+    void (*firmware_done_ctx_callback)(void *, uint8_t);
+#endif
+} canfix_callbacks;
+
+/* The fields that are used for every frame come first so they share a
+   cache line, the rest follow roughly by how often they are needed. */
+typedef struct {
+    uint8_t node;
+    uint8_t bitrate;    // NSM_BITRATE code last set from the network
+#ifdef CANFIX_USE_FD
+    uint8_t fd_flags;   // Flags for the FD frames we send
+    uint8_t rx_fd;      // The frame being handled arrived as an FD frame
+#endif
+#ifdef CANFIX_USE_GATEWAY
+    uint8_t gateway_bus;
+#endif
+    uint32_t now;
+    const canfix_callbacks *cb;
+#ifdef CANFIX_USE_GATEWAY
+    canfix_gateway *gateway;
+#endif
+#ifdef CANFIX_USE_STATS
+    canfix_stats *stats;
+#endif
+#ifdef CANFIX_USE_CACHE
+    canfix_cache *cache;
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+    canfix_directory *directory;
+#endif
+#ifdef CANFIX_USE_ALARMS
+    canfix_alarms *alarms;
+#endif
+#ifdef CANFIX_USE_CFGCLIENT
+    canfix_cfgclient *cfgclient;
+#endif
+#ifdef CANFIX_USE_UPLOADER
+    canfix_uploader *uploader;
+#endif
+#ifdef CANFIX_USE_SESSIONS
+    canfix_sessions *sessions;
+#endif
+#ifdef CANFIX_USE_PARAM_ENABLE
+    uint8_t disabled[(CANFIX_PARAM_COUNT + 7) / 8]; // A set bit means disabled
+#endif
+#ifdef CANFIX_USE_PACKED
+    uint8_t packing;    // Parameters are sent packed
+    uint8_t pack_delay;
+    uint8_t pack_len;   // Bytes in the frame being filled
+    uint32_t pack_time; // Time the first parameter went into it
+    uint8_t pack[64];
+#endif
+
+    uint8_t device;
+    uint8_t revision;
+    uint32_t model;
+    char *description;
+#ifdef CANFIX_USE_ID_CACHE
+#ifdef CANFIX_USE_ATOMIC
+    /* Two copies, so that one can be built while answers read the other */
+    canfix_id_cache id_cache[2];
+    uint8_t id_current;     // Copy that answers are sent from
+    uint8_t id_readers[2];  // Answers reading each copy
+#else
+    canfix_id_cache id_cache[1];
+#endif
+#endif
+#ifdef CANFIX_USE_FIRMWARE
+    canfix_firmware firmware;
+#endif
+#ifdef CANFIX_USE_CONFIG_TABLE
+    const canfix_config_key *config_table;
+    uint16_t config_count;
+#endif
+#ifdef CANFIX_USE_STORE
+    canfix_store *store;
+#endif
+#ifdef CANFIX_USE_DEFERRED
+    canfix_deferred deferred[CANFIX_DEFER_LEN];
+    uint8_t jitter;
+    uint16_t jitter_window;
+    uint32_t seed;
+#endif
+#ifndef CANFIX_CONST_CALLBACKS
+    canfix_callbacks callbacks; // What cb points to unless a table was given
+#endif
+
+#ifdef CANFIX_USE_QUEUE
+    canfix_frame queue[CANFIX_QUEUE_LEN];
+    int head;
+    int tail;
+    int count;
+#ifdef CANFIX_USE_PACKED
+    uint8_t poll_skip;  // Parameters of the packed frame at the tail already polled
+#endif
+#ifdef CANFIX_USE_QUEUE_CLASSES
+    canfix_frame pqueue[CANFIX_QUEUE_PRIORITY_LEN]; // Everything but parameters
+    uint16_t pmark[CANFIX_QUEUE_PRIORITY_LEN];  // Parameter frames pushed before each
+    int phead;
+    int ptail;
+    int pcount;
+    uint16_t pushed;    // Parameter frames pushed and taken off, to keep the
+    uint16_t removed;   // two rings in the order the frames arrived
+#endif
+    uint8_t queue_policy;
+    canfix_queue_stats queue_stats;
+#endif
+    void *context;      // First argument of the callbacks that take one
 } canfix_object;
 
+#ifdef CANFIX_USE_STORE
+struct _canfix_store {
+    canfix_object *h;
+    const canfix_store_device *dev;
+    uint8_t active;     // Sector that holds the journal
+    uint8_t target;     // Sector that we are compacting into
+    uint8_t state;
+    uint16_t copied;    // Table entries copied to the target so far
+    uint32_t seq;       // Sequence number of the active sector
+    uint32_t pos;       // Where the next record goes in the active sector
+    uint32_t tpos;      // Where the next record goes in the target sector
+};
+#endif
+
+#ifdef CANFIX_USE_UPLOADER
+/* One firmware upload to one node */
+typedef struct {
+    uint8_t state;
+    uint8_t node;
+    uint8_t channel;
+    uint8_t subsystem;
+    uint8_t window;     // Window the node accepted, zero for one frame at a time
+    uint8_t tries;      // Attempts at the current step
+    uint8_t status;     // FW_STATUS_* once the upload is finished
+#ifdef CANFIX_USE_FD
+    uint8_t fd;         // The node answered in FD so the data goes in FD frames
+#endif
+    uint16_t vcode;
+    const uint8_t *image;
+    uint32_t length;
+    uint32_t address;
+    uint32_t block;     // Offset of the current block within the image
+    uint32_t blocklen;
+    uint32_t sent;      // Bytes of this block that have been sent
+    uint32_t acked;     // Bytes of this block that the node has acknowledged
+    uint32_t last;      // Time of the last progress
+    uint32_t start;
+    uint32_t finish;
+    uint32_t frames;    // Total frames sent
+    uint32_t retries;   // Total resends and timeouts
+} canfix_upload;
+
+struct _canfix_uploader {
+    canfix_object *h;
+    canfix_upload target[CANFIX_UPLOAD_TARGETS];
+    uint8_t next;
+    void (*done_callback)(canfix_upload *);
+    void (*done_ctx_callback)(void *, canfix_upload *);
+    void *context;
+};
+#endif
+
+#ifdef CANFIX_USE_DIRECTORY
+/* Node directory flags */
+#define NODE_IDENTIFIED 0x01
+#define NODE_DESCRIBED  0x02
+#define NODE_LOST       0x04
+#define NODE_PACKED     0x08 // Agreed to send packed parameters
+
+/* Node directory events */
+#define NODE_EVENT_FOUND      0
+#define NODE_EVENT_IDENTIFIED 1
+#define NODE_EVENT_DESCRIBED  2
+#define NODE_EVENT_LOST       3
+
+/* What we know about one node on the network */
+typedef struct {
+    uint8_t node;
+    uint8_t flags;
+    uint8_t device;
+    uint8_t revision;
+    uint32_t model;
+    uint32_t last_seen;
+    uint16_t desc_end;  // Number of description packets, zero until the last one arrives
+    uint8_t desc_mask[(CANFIX_DESC_LEN / 4 + 7) / 8];
+    char description[CANFIX_DESC_LEN + 1];
+} canfix_node_info;
+
+struct _canfix_directory {
+    canfix_object *h;
+    uint8_t index[256];  // Slot number plus one for each node, zero if unknown
+    uint8_t count;
+    uint32_t checked;    // Time of the last check for lost nodes
+    canfix_node_info nodes[CANFIX_DIRECTORY_SIZE];
+    void (*node_callback)(canfix_node_info *, uint8_t);
+    void (*node_ctx_callback)(void *, canfix_node_info *, uint8_t);
+    void *context;
+};
+#endif
+
+#ifdef CANFIX_USE_ALARMS
+/* Alarm events */
+#define ALARM_RAISED  0
+#define ALARM_UPDATED 1
+#define ALARM_CLEARED 2
+
+/* One alarm that is being raised by a node */
+typedef struct {
+    uint8_t node;
+    uint8_t length;
+    uint16_t code;
+    uint8_t data[6];
+    uint8_t changed;    // Data changed but the update hasn't been sent yet
+    uint32_t first;     // Time the alarm was first seen
+    uint32_t last;      // Time of the latest repeat
+    uint32_t reported;  // Time of the last callback
+    uint32_t count;     // Number of frames including repeats
+} canfix_alarm;
+
+struct _canfix_alarms {
+    canfix_object *h;
+    uint8_t count;
+    uint16_t window;
+    uint16_t timeout;
+    uint32_t overflow;  // Alarms that didn't fit in the table
+    canfix_alarm alarms[CANFIX_ALARM_SIZE];
+    void (*callback)(canfix_alarm *, uint8_t);
+};
+#endif
+
+#ifdef CANFIX_USE_CACHE
+/* The latest value of one parameter from one node */
+typedef struct {
+    canfix_parameter par;
+    uint32_t updated;   // Time the value arrived
+    uint32_t deadline;  // Time the value goes stale if it is watched
+    uint16_t period;    // Expected period, zero if it isn't watched
+    uint16_t next;      // Links in the timing wheel
+    uint16_t prev;
+    uint8_t stale;
+#ifdef CANFIX_USE_HISTORY
+    canfix_history *history;
+#endif
+} canfix_cache_entry;
+
+struct _canfix_cache {
+    canfix_object *h;
+    uint16_t count;
+    uint8_t flags;      // Flags set in a value when it goes stale
+    uint32_t wheel;     // Last wheel slot that was checked, in slot times
+    uint16_t hash[CANFIX_HASH_SIZE];
+    uint16_t slots[CANFIX_WHEEL_SLOTS];
+    canfix_cache_entry entries[CANFIX_CACHE_SIZE];
+    void (*timeout_callback)(canfix_cache_entry *);
+};
+#endif
+
+#ifdef CANFIX_USE_HISTORY
+/* History tiers */
+#define HISTORY_RAW 0
+#define HISTORY_1S  1
+#define HISTORY_10S 2
+
+/* Samples of one tier of the history.  Each sample covers the tier's
+   period and holds the smallest, largest and sum of the raw values in it. */
+typedef struct {
+    uint16_t head;      // Where the next sample goes
+    uint16_t count;
+    uint32_t start;     // Start of the sample being built
+    float acc_min;
+    float acc_max;
+    float acc_sum;
+    uint32_t acc_count;
+    uint32_t time[CANFIX_HISTORY_TIER_LEN];
+    float min[CANFIX_HISTORY_TIER_LEN];
+    float max[CANFIX_HISTORY_TIER_LEN];
+    float sum[CANFIX_HISTORY_TIER_LEN];
+    uint32_t counts[CANFIX_HISTORY_TIER_LEN];
+} canfix_history_tier;
+
+struct _canfix_history {
+    uint8_t datatype;   // One of the CANFIX_TYPE_* codes
+    float scale;        // Multiplier applied to the raw value
+    uint16_t head;
+    uint16_t count;
+    uint32_t time[CANFIX_HISTORY_LEN];
+    float value[CANFIX_HISTORY_LEN];
+    canfix_history_tier tier[2];
+};
+
+typedef struct {
+    float min;
+    float max;
+    float avg;
+    uint32_t count;     // Raw values that went into it
+    uint32_t first;     // Time of the oldest sample used
+} canfix_history_summary;
+#endif
+
+#ifdef CANFIX_USE_STATS
+/* Traffic from one CAN ID or one node over the window */
+typedef struct {
+    uint16_t id;        // CAN ID or node number
+    uint32_t frames;
+    uint32_t bits;      // Bits on the wire including stuff bits
+} canfix_stats_entry;
+
+struct _canfix_stats {
+    canfix_object *h;
+    uint8_t bitrate;    // NSM_BITRATE code of the bus
+    uint8_t bucket;     // Bucket that is being filled
+    uint32_t begun;     // Time the counting started
+    uint32_t started;   // Time the current bucket started
+    uint32_t frames;    // Totals since the start
+    uint64_t bits;
+    uint32_t bus_bits;  // Bits in the window
+    uint32_t bucket_bits[CANFIX_STATS_BUCKETS];
+    /* Sums over the window, and each bucket's part of them */
+    uint32_t id_frames[2048];
+    uint32_t id_bits[2048];
+    uint32_t node_frames[256];
+    uint32_t node_bits[256];
+    uint16_t id_bucket_frames[CANFIX_STATS_BUCKETS][2048];
+    uint32_t id_bucket_bits[CANFIX_STATS_BUCKETS][2048];
+    uint16_t node_bucket_frames[CANFIX_STATS_BUCKETS][256];
+    uint32_t node_bucket_bits[CANFIX_STATS_BUCKETS][256];
+};
+#endif
+
+#ifdef CANFIX_USE_GATEWAY
+/* One rule of the routing table.  Frames with IDs from first to last that
+ * arrive on bus from are sent on bus to.  If node_from is set, frames from
+ * that node go out as if they came from node_to.  If interval is set, a CAN
+ * ID isn't forwarded more often than that many milliseconds. */
+typedef struct {
+    uint8_t from;
+    uint8_t to;
+    uint16_t first;
+    uint16_t last;
+    uint8_t node_from;
+    uint8_t node_to;
+    uint16_t interval;
+} canfix_route;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t time;
+} canfix_echo;
+
+struct _canfix_gateway {
+    uint8_t buses;
+    canfix_object *bus[CANFIX_GATEWAY_BUSES];
+    /* The routing table compiled down to lookups by CAN ID */
+    uint8_t dest[CANFIX_GATEWAY_BUSES][2048];      // Bit mask of buses to send to
+    uint16_t interval[CANFIX_GATEWAY_BUSES][2048];
+    uint32_t last[CANFIX_GATEWAY_BUSES][2048];     // Time each ID was last forwarded
+    uint8_t node_map[CANFIX_GATEWAY_BUSES][CANFIX_GATEWAY_BUSES][256];
+    uint8_t remap[CANFIX_GATEWAY_BUSES];           // Bit mask of links that remap nodes
+    canfix_echo echo[CANFIX_GATEWAY_BUSES][CANFIX_ECHO_LEN];
+    uint8_t echo_next[CANFIX_GATEWAY_BUSES];
+    uint32_t forwarded;
+    uint32_t limited;   // Frames held back by the rate limit
+    uint32_t echoes;    // Frames that were our own coming back
+};
+#endif
+
+#ifdef CANFIX_USE_CFGCLIENT
+/* Where the answer to a configuration request is put if the caller wants it */
+typedef struct {
+    uint8_t done;
+    uint8_t status;   // Zero or one of the CFG_ERR_* codes
+    uint8_t length;
+    uint8_t data[5];
+} canfix_cfg_result;
+
+/* One configuration query or set to another node */
+typedef struct {
+    uint8_t state;
+    uint8_t op;       // NSM_CONFGET or NSM_CONFSET
+    uint8_t node;
+    uint8_t status;
+    uint8_t length;
+    uint8_t data[5];
+    uint8_t tries;
+    uint8_t next;     // Next request to the same node, 0xFF at the end
+    uint16_t key;
+    uint32_t sent;
+    canfix_cfg_result *result;
+    void *context;
+} canfix_cfg_request;
+
+struct _canfix_cfgclient {
+    canfix_object *h;
+    canfix_cfg_request req[CANFIX_CFG_REQUESTS];
+    uint8_t head[256];  // Oldest request to each node
+    uint8_t tail[256];
+    uint8_t free;
+    uint16_t pending;
+    void (*callback)(canfix_cfg_request *);
+    void (*ctx_callback)(void *, canfix_cfg_request *);
+    void *context;
+};
+#endif
+
+#ifdef CANFIX_USE_SESSIONS
+/* Session states */
+#define SESSION_FREE    0
+#define SESSION_OPENING 1 // Waiting for the other node to accept
+#define SESSION_OPEN    2
+
+/* Session events */
+#define SESSION_EVENT_OPEN    0
+#define SESSION_EVENT_DATA    1
+#define SESSION_EVENT_CLOSED  2 // Went quiet for CANFIX_SESSION_TIMEOUT
+#define SESSION_EVENT_REFUSED 3 // The other node said no or didn't answer
+
+/* One two way connection to another node on one channel */
+typedef struct {
+    uint8_t state;
+    uint8_t node;       // The node at the other end
+    uint8_t channel;
+    uint8_t initiator;  // We opened it, so we send on the even channel ID
+    uint16_t type;
+    uint32_t last;      // Time of the last frame either way
+    uint16_t head;      // Received bytes waiting to be read
+    uint16_t count;
+    uint32_t overruns;  // Received bytes lost because the buffer was full
+    uint8_t rx[CANFIX_SESSION_BUF];
+} canfix_session;
+
+struct _canfix_sessions {
+    canfix_object *h;
+    uint16_t used;      // Channels that we have sessions on
+    uint16_t seen;      // Channels that others have used
+    uint32_t busy[16];  // Time others last used each channel
+    canfix_session session[16]; // By channel
+    void (*callback)(canfix_session *, uint8_t);
+};
+#endif
+
 
 
 void canfix_init(canfix_object *h, uint8_t node, uint8_t device, uint8_t revision, uint32_t model);
 void canfix_set_description(canfix_object *h, char *description);
+void canfix_set_node(canfix_object *h, uint8_t node);
+uint8_t canfix_get_node(canfix_object *h);
+uint8_t canfix_get_bitrate(canfix_object *h);
 
+void canfix_set_callbacks(canfix_object *h, const canfix_callbacks *cb);
+void canfix_set_context(canfix_object *h, void *context);
+void *canfix_get_context(canfix_object *h);
+#ifdef CANFIX_USE_FD
+void canfix_set_fd_brs(canfix_object *h, uint8_t brs);
+#endif
+
+#ifndef CANFIX_CONST_CALLBACKS
 void canfix_set_write_callback(canfix_object *h, int (*f)(uint16_t, uint8_t, uint8_t *));
+#ifdef CANFIX_USE_FD
+void canfix_set_fd_write_callback(canfix_object *h, int (*f)(uint16_t, uint8_t, uint8_t *, uint8_t));
+#endif
 
 void canfix_set_node_set_callback(canfix_object *h, void (*f)(uint8_t));
 void canfix_set_alarm_callback(canfix_object *h, void (*f)(uint8_t, uint16_t, uint8_t*, uint8_t));
 void canfix_set_parameter_callback(canfix_object *h, void (*f)(canfix_parameter));
 
 void canfix_set_report_callback(canfix_object *h, void (*f)(void));
+#ifdef CANFIX_USE_CHANNELS
 void canfix_set_twoway_callback(canfix_object *h, uint8_t (*f)(uint8_t, uint16_t));
+#endif
+#ifdef CANFIX_USE_CONFIG
 void canfix_set_config_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t *, uint8_t));
 void canfix_set_query_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t *, uint8_t *));
+#endif
 void canfix_set_firmware_callback(canfix_object *h, uint8_t (*f)(uint16_t, uint8_t));
+#ifdef CANFIX_USE_ID_CACHE
+void canfix_set_batch_write_callback(canfix_object *h, int (*f)(const canfix_frame *, uint16_t));
+#endif
+#ifdef CANFIX_USE_FIRMWARE
+void canfix_set_firmware_write_callback(canfix_object *h, uint8_t (*f)(uint8_t, uint32_t, uint8_t *, uint8_t));
+void canfix_set_firmware_done_callback(canfix_object *h, void (*f)(uint8_t));
+#endif
+#endif
 
 //void canfix_set_stream_callback(void (*f)(uint8_t, uint8_t *, uint8_t));
 
+#ifdef CANFIX_USE_CONFIG_TABLE
+int canfix_set_config_table(canfix_object *h, const canfix_config_key *table, uint16_t count);
+const canfix_config_key *canfix_config_lookup(canfix_object *h, uint16_t key);
+#endif
+#ifdef CANFIX_USE_PARAM_ENABLE
+int canfix_parameter_enabled(canfix_object *h, uint16_t type);
+int canfix_set_parameter_enable(canfix_object *h, uint16_t type, uint8_t enable);
+#endif
+#ifdef CANFIX_USE_STORE
+int canfix_store_init(canfix_store *s, canfix_object *h, const canfix_store_device *dev);
+int canfix_store_write(canfix_store *s, uint16_t key);
+#endif
+#ifdef CANFIX_USE_DEFERRED
+void canfix_set_response_jitter(canfix_object *h, uint8_t mode, uint16_t window);
+#endif
+
 void canfix_exec(canfix_object *h, uint16_t, uint8_t, uint8_t*);
+#ifdef CANFIX_USE_FD
+void canfix_exec_fd(canfix_object *h, uint16_t, uint8_t, uint8_t*);
+uint8_t canfix_fd_length(uint8_t length);
+#endif
+#ifdef CANFIX_USE_PACKED
+int canfix_request_packing(canfix_object *h, uint8_t node, uint8_t enable, uint8_t delay);
+int canfix_set_packing(canfix_object *h, uint8_t enable, uint8_t delay);
+void canfix_pack_flush(canfix_object *h);
+#endif
+void canfix_tick(canfix_object *h, uint32_t now);
 
 int canfix_send_parameter(canfix_object *h, canfix_parameter par);
 void canfix_send_identification(canfix_object *h, uint8_t dest);
 int canfix_send_node_status(canfix_object *h, uint16_t ptype, void *data, uint8_t len);
 
+#ifdef CANFIX_USE_UPLOADER
+void canfix_uploader_init(canfix_uploader *u, canfix_object *h);
+void canfix_uploader_set_done_callback(canfix_uploader *u, void (*f)(canfix_upload *));
+void canfix_uploader_set_done_ctx_callback(canfix_uploader *u, void (*f)(void *, canfix_upload *), void *context);
+canfix_upload *canfix_upload_start(canfix_uploader *u, uint8_t node, uint16_t vcode, uint8_t channel,
+                                   uint8_t subsystem, uint32_t address, const uint8_t *image, uint32_t length);
+void canfix_upload_abort(canfix_uploader *u, canfix_upload *t);
+int canfix_uploader_service(canfix_uploader *u);
+uint32_t canfix_upload_rate(canfix_uploader *u, canfix_upload *t);
+#endif
+
+#ifdef CANFIX_USE_DIRECTORY
+void canfix_directory_init(canfix_directory *d, canfix_object *h);
+void canfix_directory_set_callback(canfix_directory *d, void (*f)(canfix_node_info *, uint8_t));
+void canfix_directory_set_ctx_callback(canfix_directory *d, void (*f)(void *, canfix_node_info *, uint8_t),
+                                       void *context);
+int canfix_directory_discover(canfix_directory *d, uint8_t node);
+canfix_node_info *canfix_directory_lookup(canfix_directory *d, uint8_t node);
+#endif
+
+#ifdef CANFIX_USE_CFGCLIENT
+void canfix_cfgclient_init(canfix_cfgclient *c, canfix_object *h);
+void canfix_cfgclient_set_callback(canfix_cfgclient *c, void (*f)(canfix_cfg_request *));
+void canfix_cfgclient_set_ctx_callback(canfix_cfgclient *c, void (*f)(void *, canfix_cfg_request *), void *context);
+int canfix_config_get(canfix_cfgclient *c, uint8_t node, uint16_t key, canfix_cfg_result *result, void *context);
+int canfix_config_set(canfix_cfgclient *c, uint8_t node, uint16_t key, uint8_t *data, uint8_t length,
+                      canfix_cfg_result *result, void *context);
+void canfix_config_cancel(canfix_cfgclient *c, void *context);
+int canfix_cfgclient_service(canfix_cfgclient *c);
+uint16_t canfix_cfgclient_pending(canfix_cfgclient *c);
+#endif
+
+#ifdef CANFIX_USE_SESSIONS
+void canfix_sessions_init(canfix_sessions *s, canfix_object *h);
+void canfix_sessions_set_callback(canfix_sessions *s, void (*f)(canfix_session *, uint8_t));
+canfix_session *canfix_session_open(canfix_sessions *s, uint8_t node, uint16_t type);
+canfix_session *canfix_session_find(canfix_sessions *s, uint8_t node, uint8_t channel);
+int canfix_session_send(canfix_sessions *s, canfix_session *ss, uint8_t *data, uint8_t length);
+uint16_t canfix_session_read(canfix_sessions *s, canfix_session *ss, uint8_t *data, uint16_t max);
+void canfix_session_close(canfix_sessions *s, canfix_session *ss);
+#endif
+
+#ifdef CANFIX_USE_ALARMS
+void canfix_alarms_init(canfix_alarms *a, canfix_object *h);
+void canfix_alarms_set_callback(canfix_alarms *a, void (*f)(canfix_alarm *, uint8_t));
+void canfix_alarms_set_window(canfix_alarms *a, uint16_t window, uint16_t timeout);
+canfix_alarm *canfix_alarms_list(canfix_alarms *a, uint8_t *count);
+void canfix_alarms_clear(canfix_alarms *a, uint8_t node);
+#endif
+
+#ifdef CANFIX_USE_CACHE
+void canfix_cache_init(canfix_cache *c, canfix_object *h);
+void canfix_cache_set_timeout_callback(canfix_cache *c, void (*f)(canfix_cache_entry *));
+void canfix_cache_set_stale_flags(canfix_cache *c, uint8_t flags);
+canfix_cache_entry *canfix_cache_lookup(canfix_cache *c, uint16_t type, uint8_t node, uint8_t index);
+canfix_cache_entry *canfix_cache_watch(canfix_cache *c, uint16_t type, uint8_t node, uint8_t index, uint16_t period);
+#endif
+
+#ifdef CANFIX_USE_HISTORY
+canfix_cache_entry *canfix_history_subscribe(canfix_cache *c, canfix_history *hist, uint16_t type, uint8_t node,
+                                             uint8_t index, uint8_t datatype, float scale);
+int canfix_history_window(canfix_history *hist, uint32_t now, uint32_t span, canfix_history_summary *out);
+uint16_t canfix_history_read(canfix_history *hist, uint8_t tier, uint32_t since, uint32_t *times, float *values,
+                             uint16_t max);
+#endif
+
+#ifdef CANFIX_USE_GATEWAY
+void canfix_gateway_init(canfix_gateway *g);
+int canfix_gateway_attach(canfix_gateway *g, canfix_object *h);
+int canfix_gateway_compile(canfix_gateway *g, const canfix_route *routes, uint16_t count);
+#endif
+
+#ifdef CANFIX_USE_STATS
+void canfix_stats_init(canfix_stats *s, canfix_object *h, uint8_t bitrate);
+void canfix_stats_set_bitrate(canfix_stats *s, uint8_t bitrate);
+uint16_t canfix_stats_load(canfix_stats *s);
+uint8_t canfix_stats_top(canfix_stats *s, canfix_stats_entry *top, uint8_t count, uint8_t by_node);
+uint16_t canfix_frame_bits(uint16_t id, uint8_t length, uint8_t *data);
+#endif
+
 #ifdef CANFIX_USE_QUEUE
 int canfix_queue_push(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data);
 int canfix_queue_pop(canfix_object *h, uint16_t *id, uint8_t *length, uint8_t *data);
+int canfix_poll(canfix_object *h, canfix_event *events, int max);
+void canfix_queue_set_policy(canfix_object *h, uint8_t policy);
+void canfix_queue_get_stats(canfix_object *h, canfix_queue_stats *stats);
+void canfix_queue_clear_stats(canfix_object *h);
 #endif
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* __CANFIX_H */
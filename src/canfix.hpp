@@ -0,0 +1,334 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains a header only C++20 interface to the library
+ */
+
+#ifndef __CANFIX_HPP
+#define __CANFIX_HPP
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+#include "canfix.h"
+
+/* canfix::Node<Handlers> owns a canfix_object and binds the members of a
+ * handler object to it at compile time.  A handler is any class with a
+ *
+ *     int write(uint16_t id, std::span<const uint8_t> data);
+ *
+ * member and any of these:
+ *
+ *     void on_parameter(const canfix::Parameter &par);
+ *     void on_alarm(uint8_t node, uint16_t code, std::span<const uint8_t> data);
+ *     void on_node_set(uint8_t node);
+ *     void on_bitrate(uint8_t code);
+ *     void on_report();
+ *     uint8_t on_twoway(uint8_t channel, uint16_t type);
+ *     uint8_t on_config(uint16_t key, std::span<const uint8_t> data);
+ *     uint8_t on_query(uint16_t key, uint8_t *data, uint8_t *length);
+ *     uint8_t on_firmware(uint16_t vcode, uint8_t channel);
+ *     uint8_t on_firmware_write(uint8_t subsystem, uint32_t address, std::span<const uint8_t> data);
+ *     void on_firmware_done(uint8_t status);
+ *     int write_fd(uint16_t id, std::span<const uint8_t> data, uint8_t flags);
+ *
+ * Parameter and alarm frames are decoded in Node::exec() itself and the
+ * handler is called directly, so the compiler can inline the whole thing.
+ * Everything else, and every frame once a host component that watches
+ * received frames is attached, goes through canfix_exec() as usual and
+ * reaches the handler through a trampoline in a const callback table.
+ *
+ * The trampolines are the callbacks that take a context and the context of
+ * the canfix_object is the Node, so a callback reaches the right node from
+ * wherever it comes, a gateway forwarding a frame from another object
+ * included.  c() gives the canfix_object so the C functions and host
+ * components can be used with it directly, but its context has to be left
+ * alone. */
+
+namespace canfix {
+
+/* A parameter with typed access to its value.  Values are little endian as
+   they are on the wire. */
+class Parameter {
+public:
+    Parameter() : p_{} {}
+    explicit Parameter(const canfix_parameter &p) : p_(p) {}
+    Parameter(uint16_t type, uint8_t index) : p_{} {
+        p_.type = type;
+        p_.index = index;
+    }
+
+    uint16_t type() const { return p_.type; }
+    uint8_t node() const { return p_.node; }
+    uint8_t index() const { return p_.index; }
+    uint8_t meta() const { return p_.meta; }
+    uint8_t flags() const { return p_.flags; }
+    bool annunciate() const { return p_.flags & FCB_ANNUNC; }
+    bool quality() const { return p_.flags & FCB_QUALITY; }
+    bool failed() const { return p_.flags & FCB_FAIL; }
+    std::span<const uint8_t> data() const { return {p_.data, p_.length}; }
+
+    /* The value as one of the canfix_* types.  Bytes past the length of the
+       parameter read as zero. */
+    template<class T>
+    T as() const {
+        static_assert(std::is_arithmetic_v<T> && sizeof(T) <= 4, "not a CAN-FiX data type");
+        using U = std::conditional_t<sizeof(T) == 4, uint32_t, std::conditional_t<sizeof(T) == 2, uint16_t, uint8_t>>;
+        U u = 0;
+
+        for(unsigned n = 0; n < sizeof(T) && n < p_.length; n++) {
+            u |= U(p_.data[n]) << n * 8;
+        }
+        return std::bit_cast<T>(u);
+    }
+
+    /* Sets the value and the length to go with it */
+    template<class T>
+    Parameter &set(T value) {
+        static_assert(std::is_arithmetic_v<T> && sizeof(T) <= 4, "not a CAN-FiX data type");
+        using U = std::conditional_t<sizeof(T) == 4, uint32_t, std::conditional_t<sizeof(T) == 2, uint16_t, uint8_t>>;
+        U u = std::bit_cast<U>(value);
+
+        for(unsigned n = 0; n < sizeof(T); n++) {
+            p_.data[n] = u >> n * 8;
+        }
+        p_.length = sizeof(T);
+        return *this;
+    }
+
+    Parameter &set_meta(uint8_t meta) { p_.meta = meta; return *this; }
+    Parameter &set_flags(uint8_t flags) { p_.flags = flags; return *this; }
+
+    const canfix_parameter &c() const { return p_; }
+    canfix_parameter &c() { return p_; }
+
+private:
+    canfix_parameter p_;
+};
+
+template<class Handlers>
+class Node {
+public:
+    Node(uint8_t node, uint8_t device, uint8_t revision, uint32_t model, Handlers handlers = Handlers())
+        : handlers_(std::move(handlers)) {
+        canfix_init(&h_, node, device, revision, model);
+        canfix_set_callbacks(&h_, &callbacks_);
+        canfix_set_context(&h_, this);
+    }
+
+    ~Node() {
+#ifdef CANFIX_USE_PACKED
+        canfix_pack_flush(&h_);
+#endif
+    }
+
+    /* The C side and the host components keep pointers to the object */
+    Node(const Node &) = delete;
+    Node &operator=(const Node &) = delete;
+
+    canfix_object *c() { return &h_; }
+    Handlers &handlers() { return handlers_; }
+    uint8_t node() { return canfix_get_node(&h_); }
+
+    void exec(uint16_t id, std::span<const uint8_t> data) {
+        exec(id, data.size() > CANFIX_DATA_LEN ? CANFIX_DATA_LEN : data.size(), data.data());
+    }
+
+    void exec(uint16_t id, uint8_t length, const uint8_t *data) {
+        if(length <= 8 && _direct()) {
+            if(id == 0x00) {
+                return;
+            }
+            if(id < 256) {
+                if constexpr(_has_alarm) {
+                    if(length >= 2) {
+                        handlers_.on_alarm(id, data[0] | data[1] << 8, std::span<const uint8_t>(&data[2], length - 2));
+                    }
+                }
+                return;
+            }
+            if(id < NSM_START) {
+                if constexpr(_has_parameter) {
+                    canfix_parameter par;
+
+                    if(length < 3) return;
+                    par.type = id;
+                    par.node = data[0];
+                    par.index = data[1];
+                    par.meta = data[2] >> 4;
+                    par.flags = data[2] & 0x0F;
+                    par.length = length - 3 > 5 ? 5 : length - 3;
+                    std::memcpy(par.data, &data[3], par.length);
+                    handlers_.on_parameter(Parameter(par));
+                }
+                return;
+            }
+        }
+        canfix_exec(&h_, id, length, const_cast<uint8_t *>(data));
+    }
+
+#ifdef CANFIX_USE_FD
+    void exec_fd(uint16_t id, std::span<const uint8_t> data) {
+        canfix_exec_fd(&h_, id, data.size() > CANFIX_DATA_LEN ? CANFIX_DATA_LEN : data.size(),
+                       const_cast<uint8_t *>(data.data()));
+    }
+#endif
+
+    void tick(uint32_t now) {
+        canfix_tick(&h_, now);
+    }
+
+    int send_parameter(const Parameter &par) {
+        return canfix_send_parameter(&h_, par.c());
+    }
+
+    void send_identification(uint8_t dest) {
+        canfix_send_identification(&h_, dest);
+    }
+
+    int send_node_status(uint16_t type, std::span<const uint8_t> data) {
+        return canfix_send_node_status(&h_, type, const_cast<uint8_t *>(data.data()), data.size());
+    }
+
+    /* The string isn't copied so it has to outlive the node */
+    void set_description(const char *description) {
+        canfix_set_description(&h_, const_cast<char *>(description));
+    }
+
+private:
+    static constexpr bool _has_parameter = requires(Handlers &h, const Parameter &p) { h.on_parameter(p); };
+    static constexpr bool _has_alarm = requires(Handlers &h, std::span<const uint8_t> d) { h.on_alarm(0, 0, d); };
+
+    /* True if nothing else needs to see parameters and alarms */
+    bool _direct() const {
+#ifdef CANFIX_USE_STATS
+        if(h_.stats) return false;
+#endif
+#ifdef CANFIX_USE_GATEWAY
+        if(h_.gateway) return false;
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+        if(h_.directory) return false;
+#endif
+#ifdef CANFIX_USE_ALARMS
+        if(h_.alarms) return false;
+#endif
+#ifdef CANFIX_USE_CACHE
+        if(h_.cache) return false;
+#endif
+        return true;
+    }
+
+    static Node *_self(void *context) { return static_cast<Node *>(context); }
+
+    /* Trampolines from the C callbacks */
+    static int _write(void *ctx, uint16_t id, uint8_t length, uint8_t *data) {
+        return _self(ctx)->handlers_.write(id, std::span<const uint8_t>(data, length));
+    }
+#ifdef CANFIX_USE_FD
+    static int _write_fd(void *ctx, uint16_t id, uint8_t length, uint8_t *data, uint8_t flags) {
+        return _self(ctx)->handlers_.write_fd(id, std::span<const uint8_t>(data, length), flags);
+    }
+#endif
+    static void _parameter(void *ctx, canfix_parameter par) {
+        _self(ctx)->handlers_.on_parameter(Parameter(par));
+    }
+    static void _alarm(void *ctx, uint8_t node, uint16_t code, uint8_t *data, uint8_t length) {
+        _self(ctx)->handlers_.on_alarm(node, code, std::span<const uint8_t>(data, length));
+    }
+    static void _node_set(void *ctx, uint8_t node) {
+        _self(ctx)->handlers_.on_node_set(node);
+    }
+    static void _bitrate(void *ctx, uint8_t code) {
+        _self(ctx)->handlers_.on_bitrate(code);
+    }
+    static void _report(void *ctx) {
+        _self(ctx)->handlers_.on_report();
+    }
+#ifdef CANFIX_USE_CHANNELS
+    static uint8_t _twoway(void *ctx, uint8_t channel, uint16_t type) {
+        return _self(ctx)->handlers_.on_twoway(channel, type);
+    }
+#endif
+#ifdef CANFIX_USE_CONFIG
+    static uint8_t _config(void *ctx, uint16_t key, uint8_t *data, uint8_t length) {
+        return _self(ctx)->handlers_.on_config(key, std::span<const uint8_t>(data, length));
+    }
+    static uint8_t _query(void *ctx, uint16_t key, uint8_t *data, uint8_t *length) {
+        return _self(ctx)->handlers_.on_query(key, data, length);
+    }
+#endif
+    static uint8_t _firmware(void *ctx, uint16_t vcode, uint8_t channel) {
+        return _self(ctx)->handlers_.on_firmware(vcode, channel);
+    }
+#ifdef CANFIX_USE_FIRMWARE
+    static uint8_t _firmware_write(void *ctx, uint8_t subsystem, uint32_t address, uint8_t *data, uint8_t length) {
+        return _self(ctx)->handlers_.on_firmware_write(subsystem, address, std::span<const uint8_t>(data, length));
+    }
+    static void _firmware_done(void *ctx, uint8_t status) {
+        _self(ctx)->handlers_.on_firmware_done(status);
+    }
+#endif
+
+    /* Only the handlers that exist are given to the library so that it
+       answers the others the same way it does when a callback isn't set */
+    static canfix_callbacks _make_callbacks() {
+        canfix_callbacks cb{};
+
+        cb.write_ctx_callback = &_write;
+#ifdef CANFIX_USE_FD
+        if constexpr(requires(Handlers &h, std::span<const uint8_t> d) { h.write_fd(0, d, 0); }) {
+            cb.fd_write_ctx_callback = &_write_fd;
+        }
+#endif
+        if constexpr(_has_parameter) cb.parameter_ctx_callback = &_parameter;
+        if constexpr(_has_alarm) cb.alarm_ctx_callback = &_alarm;
+        if constexpr(requires(Handlers &h) { h.on_node_set(0); }) cb.node_set_ctx_callback = &_node_set;
+        if constexpr(requires(Handlers &h) { h.on_bitrate(0); }) cb.bitrate_ctx_callback = &_bitrate;
+        if constexpr(requires(Handlers &h) { h.on_report(); }) cb.report_ctx_callback = &_report;
+#ifdef CANFIX_USE_CHANNELS
+        if constexpr(requires(Handlers &h) { h.on_twoway(0, 0); }) cb.twoway_ctx_callback = &_twoway;
+#endif
+#ifdef CANFIX_USE_CONFIG
+        if constexpr(requires(Handlers &h, std::span<const uint8_t> d) { h.on_config(0, d); }) {
+            cb.config_ctx_callback = &_config;
+        }
+        if constexpr(requires(Handlers &h, uint8_t *d) { h.on_query(0, d, d); }) cb.query_ctx_callback = &_query;
+#endif
+        if constexpr(requires(Handlers &h) { h.on_firmware(0, 0); }) cb.firmware_ctx_callback = &_firmware;
+#ifdef CANFIX_USE_FIRMWARE
+        if constexpr(requires(Handlers &h, std::span<const uint8_t> d) { h.on_firmware_write(0, 0, d); }) {
+            cb.firmware_write_ctx_callback = &_firmware_write;
+        }
+        if constexpr(requires(Handlers &h) { h.on_firmware_done(0); }) cb.firmware_done_ctx_callback = &_firmware_done;
+#endif
+        return cb;
+    }
+
+    static inline const canfix_callbacks callbacks_ = _make_callbacks();
+
+    canfix_object h_;
+    Handlers handlers_;
+};
+
+} // namespace canfix
+
+#endif /* __CANFIX_HPP */
@@ -0,0 +1,618 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the C++20 coroutine interface to the host components
+ */
+
+#ifndef __CANFIX_ASYNC_HPP
+#define __CANFIX_ASYNC_HPP
+
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "canfix.h"
+
+/* canfix::Executor turns the request and answer exchanges of the host
+ * components into things a coroutine can co_await:
+ *
+ *     canfix::Task<> setup(canfix::Executor &ex) {
+ *         canfix_cfg_result r = co_await ex.config_get(12, 0x0101);
+ *         canfix_node_info *n = co_await ex.identify(12, 500);
+ *         uint8_t status = co_await ex.upload(12, vcode, 1, 0, 0, image);
+ *     }
+ *
+ * The executor runs on one thread.  Frames are handed to it with exec() and
+ * time with tick(), which call canfix_exec() and canfix_tick() and then
+ * resume every coroutine whose answer or timeout arrived.  Coroutines are
+ * never resumed from inside the library, so they are free to start new
+ * requests.  timeout() gives the time until the executor needs to be ticked
+ * again, which is what an epoll loop waits for.
+ *
+ * A waiting coroutine is just its frame and a small record in it, so
+ * thousands of them can be waiting at once.  Configuration requests that
+ * don't fit in the client's table and uploads that don't have a free slot
+ * wait their turn and are started as earlier ones finish.
+ *
+ * The configuration client, uploader and directory are used if they are
+ * attached to the canfix_object before the executor is made.  The executor
+ * sets their context callbacks to itself and passes each event on to the
+ * callback that was there before it, so several executors can run on
+ * different objects at once. */
+
+#ifndef CANFIX_ASYNC_TICK
+#define CANFIX_ASYNC_TICK 10 // Longest timeout() while the library has requests out
+#endif
+
+namespace canfix {
+
+template<class T = void> class Task;
+
+namespace _async {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+    bool detached = false;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    /* Goes back to whoever awaited the task, detached tasks clean up after
+       themselves */
+    template<class P>
+    struct Final {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            PromiseBase &p = h.promise();
+
+            if(p.continuation) return p.continuation;
+            if(p.detached) {
+                if(p.error) std::terminate();
+                h.destroy();
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template<class T>
+struct Promise : PromiseBase {
+    T value{};
+
+    Task<T> get_return_object();
+    Final<Promise> final_suspend() noexcept { return {}; }
+    void return_value(T v) { value = std::move(v); }
+    T result() {
+        if(error) std::rethrow_exception(error);
+        return std::move(value);
+    }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    Final<Promise> final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void result() {
+        if(error) std::rethrow_exception(error);
+    }
+};
+
+} // namespace _async
+
+/* A coroutine that starts when it is awaited or given to Executor::spawn() */
+template<class T>
+class Task {
+public:
+    using promise_type = _async::Promise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    Task(Task &&t) noexcept : h_(std::exchange(t.h_, {})) {}
+    Task &operator=(Task &&t) noexcept {
+        if(this != &t) {
+            if(h_) h_.destroy();
+            h_ = std::exchange(t.h_, {});
+        }
+        return *this;
+    }
+    ~Task() { if(h_) h_.destroy(); }
+
+    bool done() const { return !h_ || h_.done(); }
+
+    bool await_ready() const { return done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        h_.promise().continuation = caller;
+        return h_;
+    }
+    T await_resume() { return h_.promise().result(); }
+
+    /* Hands the coroutine over to run on its own */
+    std::coroutine_handle<> release() {
+        h_.promise().detached = true;
+        return std::exchange(h_, {});
+    }
+
+private:
+    std::coroutine_handle<promise_type> h_;
+};
+
+namespace _async {
+
+template<class T>
+Task<T> Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace _async
+
+class Executor {
+public:
+    explicit Executor(canfix_object *h) : h_(h), last_tick_(h->now) {
+#ifdef CANFIX_USE_CFGCLIENT
+        if(h->cfgclient) {
+            cfg_next_ = h->cfgclient->ctx_callback;
+            cfg_next_ctx_ = h->cfgclient->context;
+            canfix_cfgclient_set_ctx_callback(h->cfgclient, &_cfg_done, this);
+        }
+#endif
+#ifdef CANFIX_USE_UPLOADER
+        if(h->uploader) {
+            upload_next_ = h->uploader->done_ctx_callback;
+            upload_next_ctx_ = h->uploader->context;
+            canfix_uploader_set_done_ctx_callback(h->uploader, &_upload_done, this);
+        }
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+        if(h->directory) {
+            node_next_ = h->directory->node_ctx_callback;
+            node_next_ctx_ = h->directory->context;
+            canfix_directory_set_ctx_callback(h->directory, &_node_event, this);
+        }
+#endif
+    }
+
+    /* Coroutines that are still waiting when the executor goes away are
+       never resumed.  Their configuration requests are cancelled, since the
+       results would be written into their frames, and their uploads are
+       aborted, since the images may live there too. */
+    ~Executor() {
+#ifdef CANFIX_USE_CFGCLIENT
+        if(h_->cfgclient) {
+            for(Waiter *w = cfg_active_.head; w; w = w->next) canfix_config_cancel(h_->cfgclient, w);
+            canfix_cfgclient_set_ctx_callback(h_->cfgclient, cfg_next_, cfg_next_ctx_);
+        }
+#endif
+#ifdef CANFIX_USE_UPLOADER
+        if(h_->uploader) {
+            for(int n = 0; n < CANFIX_UPLOAD_TARGETS; n++) {
+                if(upload_[n]) {
+                    upload_[n] = nullptr;
+                    canfix_upload_abort(h_->uploader, &h_->uploader->target[n]);
+                }
+            }
+            canfix_uploader_set_done_ctx_callback(h_->uploader, upload_next_, upload_next_ctx_);
+        }
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+        if(h_->directory) canfix_directory_set_ctx_callback(h_->directory, node_next_, node_next_ctx_);
+#endif
+    }
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    canfix_object *c() { return h_; }
+
+    /* Starts a task that runs on its own until it is finished */
+    template<class T>
+    void spawn(Task<T> task) {
+        if(task.done()) return;
+        ready_.push_back(task.release());
+        run();
+    }
+
+    void exec(uint16_t id, uint8_t length, uint8_t *data) {
+        canfix_exec(h_, id, length, data);
+        run();
+    }
+
+#ifdef CANFIX_USE_FD
+    void exec_fd(uint16_t id, uint8_t length, uint8_t *data) {
+        canfix_exec_fd(h_, id, length, data);
+        run();
+    }
+#endif
+
+    void tick(uint32_t now) {
+        time_ += now - last_tick_;
+        last_tick_ = now;
+        canfix_tick(h_, now);
+        while(!timers_.empty() && timers_.begin()->first <= time_) {
+            Waiter *w = timers_.begin()->second;
+
+            w->expired = true;
+            _complete(w);
+        }
+        run();
+    }
+
+    /* Resumes everything that is ready.  exec(), tick() and spawn() do this
+       themselves. */
+    void run() {
+        if(running_) return;
+        running_ = true;
+        while(!ready_.empty() || _start_waiting()) {
+            std::vector<std::coroutine_handle<>> batch;
+
+            batch.swap(ready_);
+            for(auto h : batch) h.resume();
+        }
+        running_ = false;
+    }
+
+    /* Milliseconds until tick() has to be called, or -1 if nothing is
+       waiting on time */
+    int timeout() const {
+        int t = -1;
+
+        if(!timers_.empty()) {
+            uint64_t d = timers_.begin()->first - time_;
+            t = d > 0x7FFFFFFF ? 0x7FFFFFFF : int(d);
+        }
+#ifdef CANFIX_USE_CFGCLIENT
+        if(h_->cfgclient && canfix_cfgclient_pending(h_->cfgclient) && (t < 0 || t > CANFIX_ASYNC_TICK)) {
+            t = CANFIX_ASYNC_TICK;
+        }
+#endif
+#ifdef CANFIX_USE_UPLOADER
+        if(uploads_ && (t < 0 || t > CANFIX_ASYNC_TICK)) t = CANFIX_ASYNC_TICK;
+#endif
+        return t;
+    }
+
+private:
+    struct Waiter;
+
+    /* Waiters in the order they started waiting */
+    struct List {
+        Waiter *head = nullptr;
+        Waiter *tail = nullptr;
+    };
+
+    /* What a suspended coroutine is waiting for.  It lives in the awaiter,
+       which is kept in the coroutine frame while it waits. */
+    struct Waiter {
+        Executor *ex = nullptr;
+        std::coroutine_handle<> handle;
+        Waiter *next = nullptr;
+        Waiter *prev = nullptr;
+        List *list = nullptr;
+        std::multimap<uint64_t, Waiter *>::iterator timer;
+        bool timed = false;
+        bool expired = false;
+    };
+
+    void _link(Waiter *w, List *list) {
+        w->list = list;
+        w->next = nullptr;
+        w->prev = list->tail;
+        if(list->tail) list->tail->next = w; else list->head = w;
+        list->tail = w;
+    }
+
+    void _unlink(Waiter *w) {
+        if(!w->list) return;
+        if(w->prev) w->prev->next = w->next; else w->list->head = w->next;
+        if(w->next) w->next->prev = w->prev; else w->list->tail = w->prev;
+        w->list = nullptr;
+    }
+
+    void _arm(Waiter *w, uint32_t ms) {
+        w->timer = timers_.emplace(time_ + ms, w);
+        w->timed = true;
+    }
+
+    void _complete(Waiter *w) {
+        _unlink(w);
+        if(w->timed) {
+            timers_.erase(w->timer);
+            w->timed = false;
+        }
+        ready_.push_back(w->handle);
+    }
+
+    /* Starts the requests that were waiting for room.  Returns true if any
+       of them finished right away. */
+    bool _start_waiting() {
+        size_t before = ready_.size();
+
+#ifdef CANFIX_USE_CFGCLIENT
+        while(cfg_waiting_.head && _cfg_start(static_cast<ConfigOp *>(cfg_waiting_.head))) {}
+#endif
+#ifdef CANFIX_USE_UPLOADER
+        for(Waiter *w = upload_waiting_.head, *next; w; w = next) {
+            next = w->next;
+            _upload_start(static_cast<UploadOp *>(w));
+        }
+#endif
+        return ready_.size() != before;
+    }
+
+public:
+    /* Resumes after the given number of milliseconds */
+    struct Sleep : Waiter {
+        uint32_t ms;
+
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            this->handle = h;
+            this->ex->_arm(this, ms);
+        }
+        void await_resume() const {}
+    };
+
+    Sleep sleep(uint32_t ms) {
+        Sleep s;
+        s.ex = this;
+        s.ms = ms;
+        return s;
+    }
+
+#ifdef CANFIX_USE_CFGCLIENT
+    /* A configuration query or set.  The client keeps its own timeout and
+       retries so the result ends up with CFG_ERR_TIMEOUT if there is no
+       answer. */
+    struct ConfigOp : Waiter {
+        uint8_t op;
+        uint8_t node;
+        uint16_t key;
+        uint8_t length = 0;
+        uint8_t data[4];
+        canfix_cfg_result result{};
+
+        bool await_ready() const { return result.done; }
+        void await_suspend(std::coroutine_handle<> h) {
+            Executor *ex = this->ex;
+
+            this->handle = h;
+            if(ex->cfg_waiting_.head || !ex->_cfg_start(this)) ex->_link(this, &ex->cfg_waiting_);
+        }
+        canfix_cfg_result await_resume() const { return result; }
+    };
+
+    ConfigOp config_get(uint8_t node, uint16_t key) {
+        ConfigOp op;
+        op.ex = this;
+        op.op = NSM_CONFGET;
+        op.node = node;
+        op.key = key;
+        return op;
+    }
+
+    ConfigOp config_set(uint8_t node, uint16_t key, std::span<const uint8_t> data) {
+        ConfigOp op;
+        op.ex = this;
+        op.op = NSM_CONFSET;
+        op.node = node;
+        op.key = key;
+        if(data.size() > sizeof(op.data)) {
+            op.result.done = 1;
+            op.result.status = CFG_ERR_WRNGTYPE;
+        } else {
+            op.length = data.size();
+            std::memcpy(op.data, data.data(), data.size());
+        }
+        return op;
+    }
+#endif
+
+#ifdef CANFIX_USE_DIRECTORY
+    /* Asks one node to identify itself.  Resumes with its directory entry
+       when it answers or with nullptr when the time runs out. */
+    struct Identify : Waiter {
+        uint8_t node;
+        uint32_t ms;
+
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            Executor *ex = this->ex;
+
+            this->handle = h;
+            ex->_link(this, &ex->identify_[node]);
+            ex->_arm(this, ms);
+            canfix_directory_discover(ex->h_->directory, node);
+        }
+        canfix_node_info *await_resume() const {
+            return this->expired ? nullptr : canfix_directory_lookup(this->ex->h_->directory, node);
+        }
+    };
+
+    Identify identify(uint8_t node, uint32_t ms) {
+        Identify op;
+        op.ex = this;
+        op.node = node;
+        op.ms = ms;
+        return op;
+    }
+
+    /* Asks every node to identify itself and resumes when the time is up
+       with the number of nodes that are in the directory */
+    struct Discover : Sleep {
+        void await_suspend(std::coroutine_handle<> h) {
+            Sleep::await_suspend(h);
+            canfix_directory_discover(this->ex->h_->directory, 0);
+        }
+        uint8_t await_resume() const { return this->ex->h_->directory->count; }
+    };
+
+    Discover discover(uint32_t ms) {
+        Discover op;
+        op.ex = this;
+        op.ms = ms;
+        return op;
+    }
+#endif
+
+#ifdef CANFIX_USE_UPLOADER
+    /* Loads an image into a node and resumes with one of the FW_STATUS_*
+       codes.  The image has to stay around until then. */
+    struct UploadOp : Waiter {
+        uint8_t node;
+        uint16_t vcode;
+        uint8_t channel;
+        uint8_t subsystem;
+        uint32_t address;
+        std::span<const uint8_t> image;
+        uint8_t status = 0xFF;
+
+        bool await_ready() const { return status != 0xFF; }
+        void await_suspend(std::coroutine_handle<> h) {
+            this->handle = h;
+            this->ex->_link(this, &this->ex->upload_waiting_);
+            this->ex->_upload_start(this);
+        }
+        uint8_t await_resume() const { return status; }
+    };
+
+    UploadOp upload(uint8_t node, uint16_t vcode, uint8_t channel, uint8_t subsystem, uint32_t address,
+                    std::span<const uint8_t> image) {
+        UploadOp op;
+        op.ex = this;
+        op.node = node;
+        op.vcode = vcode;
+        op.channel = channel;
+        op.subsystem = subsystem;
+        op.address = address;
+        op.image = image;
+        if(channel > 15) op.status = FW_STATUS_ERROR;
+        return op;
+    }
+#endif
+
+private:
+#ifdef CANFIX_USE_CFGCLIENT
+    bool _cfg_start(ConfigOp *op) {
+        int ret;
+
+        if(op->op == NSM_CONFGET) {
+            ret = canfix_config_get(h_->cfgclient, op->node, op->key, &op->result, op);
+        } else {
+            ret = canfix_config_set(h_->cfgclient, op->node, op->key, op->data, op->length, &op->result, op);
+        }
+        if(ret) return false;
+        _unlink(op);
+        _link(op, &cfg_active_);
+        return true;
+    }
+
+    static void _cfg_done(void *ctx, canfix_cfg_request *r) {
+        Executor *ex = static_cast<Executor *>(ctx);
+
+        if(r->context) ex->_complete(static_cast<ConfigOp *>(r->context));
+        if(ex->cfg_next_) {
+            ex->cfg_next_(ex->cfg_next_ctx_, r);
+        } else if(ex->h_->cfgclient->callback) {
+            ex->h_->cfgclient->callback(r);
+        }
+    }
+#endif
+
+#ifdef CANFIX_USE_UPLOADER
+    void _upload_start(UploadOp *op) {
+        canfix_upload *t = canfix_upload_start(h_->uploader, op->node, op->vcode, op->channel, op->subsystem,
+                                               op->address, op->image.data(), op->image.size());
+
+        if(t == NULL) return;
+        _unlink(op);
+        uploads_++;
+        upload_[t - h_->uploader->target] = op;
+    }
+
+    static void _upload_done(void *ctx, canfix_upload *t) {
+        Executor *ex = static_cast<Executor *>(ctx);
+        Waiter *&w = ex->upload_[t - ex->h_->uploader->target];
+
+        if(w) {
+            static_cast<UploadOp *>(w)->status = t->status;
+            ex->_complete(w);
+            w = nullptr;
+            ex->uploads_--;
+        }
+        if(ex->upload_next_) {
+            ex->upload_next_(ex->upload_next_ctx_, t);
+        } else if(ex->h_->uploader->done_callback) {
+            ex->h_->uploader->done_callback(t);
+        }
+    }
+#endif
+
+#ifdef CANFIX_USE_DIRECTORY
+    static void _node_event(void *ctx, canfix_node_info *n, uint8_t event) {
+        Executor *ex = static_cast<Executor *>(ctx);
+
+        if(event == NODE_EVENT_IDENTIFIED) {
+            while(ex->identify_[n->node].head) ex->_complete(ex->identify_[n->node].head);
+        }
+        if(ex->node_next_) {
+            ex->node_next_(ex->node_next_ctx_, n, event);
+        } else if(ex->h_->directory->node_callback) {
+            ex->h_->directory->node_callback(n, event);
+        }
+    }
+#endif
+
+    canfix_object *h_;
+    uint64_t time_ = 0;   // Milliseconds since the executor was made, doesn't wrap
+    uint32_t last_tick_;
+    bool running_ = false;
+    std::vector<std::coroutine_handle<>> ready_;
+    std::multimap<uint64_t, Waiter *> timers_;
+#ifdef CANFIX_USE_CFGCLIENT
+    List cfg_waiting_;
+    List cfg_active_;   // Started and waiting for the client's answer
+    void (*cfg_next_)(void *, canfix_cfg_request *) = nullptr;
+    void *cfg_next_ctx_ = nullptr;
+#endif
+#ifdef CANFIX_USE_UPLOADER
+    List upload_waiting_;
+    Waiter *upload_[CANFIX_UPLOAD_TARGETS] = {};
+    int uploads_ = 0;
+    void (*upload_next_)(void *, canfix_upload *) = nullptr;
+    void *upload_next_ctx_ = nullptr;
+#endif
+#ifdef CANFIX_USE_DIRECTORY
+    List identify_[256];
+    void (*node_next_)(void *, canfix_node_info *, uint8_t) = nullptr;
+    void *node_next_ctx_ = nullptr;
+#endif
+};
+
+} // namespace canfix
+
+#endif /* __CANFIX_ASYNC_HPP */
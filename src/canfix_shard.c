@@ -0,0 +1,243 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the multi threaded receive engine.  It needs POSIX
+ *  threads and uses Linux futexes to put idle workers to sleep.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "canfix_shard.h"
+
+#define SHARD_SPIN 1000   // Empty polls before a worker sleeps
+
+/* Only parameters are spread over the workers.  Everything else changes or
+   reads the state of the node, or belongs to a conversation with another
+   node, so it all has to be handled by one object. */
+static uint8_t
+_shard_of(canfix_shards *e, uint16_t id) {
+    if(id < 0x100 || id >= NSM_START) return CANFIX_SHARD_CONTROL;
+    return ((uint32_t)id * 2654435761u >> 16) % e->shards;
+}
+
+static uint32_t
+_millis(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Handles whatever is waiting in one ring.  Returns the number of frames. */
+static uint32_t
+_drain(canfix_shard *s, canfix_ring *r) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t n = head - tail;
+    canfix_frame *f;
+
+    for(; tail != head; tail++) {
+        f = &r->frames[tail & (CANFIX_SHARD_RING - 1)];
+        canfix_exec(&s->h, f->id, f->length, f->data);
+        /* Give the slot back right away so a burst doesn't fill the ring */
+        atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    }
+    return n;
+}
+
+static void *
+_worker(void *arg) {
+    canfix_shard *s = arg;
+    canfix_shards *e = s->engine;
+    uint32_t n, idle = 0, now, last = 0;
+    struct timespec ts = {0, 10000000};
+    uint8_t p, node;
+
+    while(1) {
+        /* A node set message only reaches the control shard */
+        if(s->n != CANFIX_SHARD_CONTROL) {
+            node = atomic_load_explicit(&e->node, memory_order_acquire);
+            if(node != s->h.node) canfix_set_node(&s->h, node);
+        }
+        n = 0;
+        for(p = 0; p < e->producers; p++) {
+            n += _drain(s, &e->rings[p * e->shards + s->n]);
+        }
+        if(n) {
+            atomic_fetch_add_explicit(&s->frames, n, memory_order_relaxed);
+            idle = 0;
+        }
+        if(n && s->n == CANFIX_SHARD_CONTROL) {
+            atomic_store_explicit(&e->node, s->h.node, memory_order_release);
+        }
+        now = _millis();
+        if(now != last) {
+            canfix_tick(&s->h, now);
+            last = now;
+        }
+        if(n) continue;
+        if(! atomic_load_explicit(&e->running, memory_order_acquire)) break;
+        if(++idle < SHARD_SPIN) continue;
+        /* Go to sleep, but check the rings again after saying so in case a
+           frame came in between.  The timeout keeps canfix_tick() going. */
+        atomic_store_explicit(&s->sleeping, 1, memory_order_seq_cst);
+        for(p = 0; p < e->producers; p++) {
+            canfix_ring *r = &e->rings[p * e->shards + s->n];
+            if(atomic_load_explicit(&r->head, memory_order_seq_cst) != atomic_load_explicit(&r->tail, memory_order_relaxed)) break;
+        }
+        if(p == e->producers && atomic_load_explicit(&e->running, memory_order_seq_cst)) {
+            syscall(SYS_futex, &s->sleeping, FUTEX_WAIT_PRIVATE, 1, &ts, NULL, 0);
+        }
+        atomic_store_explicit(&s->sleeping, 0, memory_order_relaxed);
+        idle = 0;
+    }
+    return NULL;
+}
+
+static void
+_wake(canfix_shard *s) {
+    /* Pairs with the worker setting sleeping and then looking at the rings */
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&s->sleeping, memory_order_seq_cst)) {
+        atomic_store_explicit(&s->sleeping, 0, memory_order_relaxed);
+        syscall(SYS_futex, &s->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/* Sets up the engine.  Each worker gets a copy of h with all of its
+ * callbacks.  Host components are not thread safe so they should be attached
+ * to a worker's own object with canfix_shards_object() instead of to h.
+ * Everything but the cache and statistics belongs on the control shard.  A
+ * cache or statistics can be attached to every worker, and
+ * canfix_shards_shard_of() says which one has a parameter.  h is copied
+ * whole, so this file must be built with the feature macros that canfix.c
+ * and the application use.  Returns -1 if the sizes are out of range or the
+ * rings can't be allocated. */
+int
+canfix_shards_init(canfix_shards *e, const canfix_object *h, uint8_t shards, uint8_t producers) {
+    if(shards < 1 || shards > CANFIX_SHARDS_MAX || producers < 1 || producers > CANFIX_PRODUCERS_MAX) return -1;
+    memset(e, 0, sizeof(canfix_shards));
+    e->rings = aligned_alloc(64, sizeof(canfix_ring) * shards * producers);
+    if(e->rings == NULL) return -1;
+    memset(e->rings, 0, sizeof(canfix_ring) * shards * producers);
+    e->shards = shards;
+    e->producers = producers;
+    e->node = h->node;
+    for(uint8_t n = 0; n < shards; n++) {
+        e->shard[n].engine = e;
+        e->shard[n].n = n;
+        e->shard[n].h = *h;
+#ifndef CANFIX_CONST_CALLBACKS
+        if(h->cb == &h->callbacks) e->shard[n].h.cb = &e->shard[n].h.callbacks;
+#endif
+    }
+    return 0;
+}
+
+/* The object that a worker runs.  Only change it before the engine starts. */
+canfix_object *
+canfix_shards_object(canfix_shards *e, uint8_t shard) {
+    return shard < e->shards ? &e->shard[shard].h : NULL;
+}
+
+/* The worker that handles frames with the given CAN ID */
+uint8_t
+canfix_shards_shard_of(canfix_shards *e, uint16_t id) {
+    return _shard_of(e, id);
+}
+
+int
+canfix_shards_start(canfix_shards *e) {
+    atomic_store(&e->node, e->shard[CANFIX_SHARD_CONTROL].h.node);
+    atomic_store(&e->running, 1);
+    for(uint8_t n = 0; n < e->shards; n++) {
+        if(pthread_create(&e->shard[n].thread, NULL, _worker, &e->shard[n])) {
+            e->shards = n; /* Stop the ones that did start */
+            canfix_shards_stop(e);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Hands a received frame to the worker for its CAN ID.  Each producer
+ * number must only be used by one thread.  Returns CANFIX_QUEUE_OVERFLOW if
+ * the ring is full, in which case the frame is dropped so the frames that
+ * are already waiting stay in order. */
+int
+canfix_shards_push(canfix_shards *e, uint8_t producer, uint16_t id, uint8_t length, uint8_t *data) {
+    uint8_t n = _shard_of(e, id);
+    canfix_ring *r = &e->rings[producer * e->shards + n];
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t depth = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+    canfix_frame *f;
+
+    if(depth >= CANFIX_SHARD_RING) {
+        r->drops++;
+        _wake(&e->shard[n]);
+        return CANFIX_QUEUE_OVERFLOW;
+    }
+    if(depth + 1 > r->high) r->high = depth + 1;
+    f = &r->frames[head & (CANFIX_SHARD_RING - 1)];
+    f->id = id;
+    f->length = length > CANFIX_DATA_LEN ? CANFIX_DATA_LEN : length;
+    memcpy(f->data, data, f->length);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    _wake(&e->shard[n]);
+    return 0;
+}
+
+/* Lets the workers finish the frames that are waiting and waits for them
+   to exit. */
+void
+canfix_shards_stop(canfix_shards *e) {
+    atomic_store(&e->running, 0);
+    for(uint8_t n = 0; n < e->shards; n++) {
+        atomic_store(&e->shard[n].sleeping, 1);
+        _wake(&e->shard[n]);
+        pthread_join(e->shard[n].thread, NULL);
+    }
+}
+
+void
+canfix_shards_free(canfix_shards *e) {
+    free(e->rings);
+    e->rings = NULL;
+}
+
+/* Drops and the high water mark are kept by the producers, so read them
+   from a producer thread or after the engine has stopped for exact values. */
+void
+canfix_shards_stats(canfix_shards *e, uint8_t shard, canfix_shard_stats *stats) {
+    canfix_ring *r;
+
+    memset(stats, 0, sizeof(canfix_shard_stats));
+    if(shard >= e->shards) return;
+    stats->frames = atomic_load_explicit(&e->shard[shard].frames, memory_order_relaxed);
+    for(uint8_t p = 0; p < e->producers; p++) {
+        r = &e->rings[p * e->shards + shard];
+        stats->drops += r->drops;
+        stats->depth += atomic_load_explicit(&r->head, memory_order_relaxed) - atomic_load_explicit(&r->tail, memory_order_relaxed);
+        if(r->high > stats->high) stats->high = r->high;
+    }
+}
@@ -0,0 +1,97 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the multi threaded receive engine
+ */
+
+#ifndef __CANFIX_SHARD_H
+#define __CANFIX_SHARD_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "canfix.h"
+
+/* The shard engine spreads received frames over a pool of worker threads.
+ * Each worker has its own copy of a canfix_object and runs canfix_exec() and
+ * the callbacks for the CAN IDs that go to it, so frames with the same ID
+ * are always handled in order by the same thread.  Parameters are spread
+ * over all of the workers by CAN ID.  Alarms, node specific messages and
+ * the communication channels all go to the control shard, whose object
+ * owns the state of the node and is the one to attach the directory, the
+ * configuration client, the uploader, the alarm table and sessions to.  The
+ * other workers follow the control shard's node number.  Frames get to the
+ * workers through single producer, single consumer rings, one for each
+ * transport and worker, so nothing is locked on the way.  Callbacks are
+ * called from the worker threads and the write callback can be called from
+ * several of them at once.
+ *
+ * The workers copy the canfix_object, so canfix_shard.c has to be compiled
+ * with the same CANFIX_USE_* macros as the canfix.c it is linked with and as
+ * the application, or the copies won't have the layout canfix.c expects. */
+
+#define CANFIX_SHARD_CONTROL 0    // Worker for everything but parameters
+#define CANFIX_SHARDS_MAX    16   // Worker threads
+#define CANFIX_PRODUCERS_MAX 8    // Transports feeding the engine
+#define CANFIX_SHARD_RING    1024 // Frames in each ring, a power of two
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t head;  // Written by the transport
+    _Alignas(64) _Atomic uint32_t tail;  // Written by the worker
+    uint32_t high;                       // Deepest the ring has been
+    uint32_t drops;                      // Frames lost because it was full
+    canfix_frame frames[CANFIX_SHARD_RING];
+} canfix_ring;
+
+typedef struct {
+    uint64_t frames;    // Frames handled by the worker
+    uint32_t drops;     // Frames that didn't fit in its rings
+    uint32_t depth;     // Frames waiting now
+    uint32_t high;      // Most frames that have been waiting in one ring
+} canfix_shard_stats;
+
+typedef struct _canfix_shards canfix_shards;
+
+typedef struct {
+    canfix_shards *engine;
+    uint8_t n;
+    pthread_t thread;
+    canfix_object h;
+    _Alignas(64) _Atomic uint32_t sleeping;  // Futex word
+    _Atomic uint64_t frames;
+} canfix_shard;
+
+struct _canfix_shards {
+    uint8_t shards;
+    uint8_t producers;
+    _Atomic uint8_t running;
+    _Atomic uint8_t node;  // The control shard's node number
+    canfix_ring *rings;  // [producer * shards + shard]
+    canfix_shard shard[CANFIX_SHARDS_MAX];
+};
+
+int canfix_shards_init(canfix_shards *e, const canfix_object *h, uint8_t shards, uint8_t producers);
+canfix_object *canfix_shards_object(canfix_shards *e, uint8_t shard);
+uint8_t canfix_shards_shard_of(canfix_shards *e, uint16_t id);
+int canfix_shards_start(canfix_shards *e);
+int canfix_shards_push(canfix_shards *e, uint8_t producer, uint16_t id, uint8_t length, uint8_t *data);
+void canfix_shards_stop(canfix_shards *e);
+void canfix_shards_free(canfix_shards *e);
+void canfix_shards_stats(canfix_shards *e, uint8_t shard, canfix_shard_stats *stats);
+
+#endif /* __CANFIX_SHARD_H */
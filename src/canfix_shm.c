@@ -0,0 +1,285 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the shared memory publication of parameter values.
+ *  It needs Linux for the shared memory and futex calls.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "canfix_shm.h"
+
+/* Each slot holds one parameter from one node.  The key is written before
+ * the slot is put in the hash and never changes after that, so readers can
+ * look a value up without any locking.  seq is odd while the publisher is
+ * writing the value. */
+typedef struct {
+    _Atomic uint32_t seq;
+    uint32_t key;
+    uint32_t changes;
+    uint32_t updated;
+    canfix_parameter par;
+} canfix_shm_slot;
+
+struct _canfix_shm_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t hash_size;          // Power of two, twice the slots or more
+    _Atomic uint32_t count;      // Slots in use
+    _Atomic uint32_t changes;    // Bumped on every publish, the futex word
+    _Atomic uint32_t waiters;    // Readers sleeping on changes
+    uint32_t spare;
+    /* _Atomic uint32_t hash[hash_size] holding slot number plus one,
+       followed by canfix_shm_slot slot[slots] */
+};
+
+#define KEY(type, node, index) ((uint32_t)(type) << 16 | (uint32_t)(node) << 8 | (index))
+
+static _Atomic uint32_t *
+_hash(canfix_shm_segment *seg) {
+    return (_Atomic uint32_t *)(seg + 1);
+}
+
+static canfix_shm_slot *
+_slots(canfix_shm_segment *seg) {
+    return (canfix_shm_slot *)(_hash(seg) + seg->hash_size);
+}
+
+static uint32_t
+_bucket(canfix_shm_segment *seg, uint32_t key) {
+    return (key * 2654435761u) >> 8 & (seg->hash_size - 1);
+}
+
+/* Finds the slot for the key.  Returns NULL if it isn't there. */
+static canfix_shm_slot *
+_find(canfix_shm_segment *seg, uint32_t key, uint32_t *bucket) {
+    _Atomic uint32_t *hash = _hash(seg);
+    uint32_t b = _bucket(seg, key), n;
+
+    while((n = atomic_load_explicit(&hash[b], memory_order_acquire)) != 0) {
+        if(_slots(seg)[n - 1].key == key) return &_slots(seg)[n - 1];
+        b = (b + 1) & (seg->hash_size - 1);
+    }
+    if(bucket) *bucket = b;
+    return NULL;
+}
+
+static int
+_map(canfix_shm *s, int flags) {
+    s->seg = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED | flags, s->fd, 0);
+    if(s->seg == MAP_FAILED) {
+        s->seg = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Clears the handle and checks that the name fits in it */
+static int
+_init(canfix_shm *s, const char *name) {
+    memset(s, 0, sizeof(canfix_shm));
+    s->fd = -1;
+    if(strlen(name) >= sizeof(s->name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(s->name, name);
+    return 0;
+}
+
+/* Creates the segment for a publisher.  name is a POSIX shared memory name
+ * like "/canfix" of up to 63 characters.  An old segment with the same name
+ * is replaced.  Returns -1 with errno set on failure. */
+int
+canfix_shm_create(canfix_shm *s, const char *name, uint32_t slots) {
+    uint32_t hash_size = 1;
+
+    if(_init(s, name)) return -1;
+    while(hash_size < slots * 2) hash_size <<= 1;
+    s->size = sizeof(canfix_shm_segment) + hash_size * sizeof(uint32_t) + slots * sizeof(canfix_shm_slot);
+    shm_unlink(name);
+    s->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(s->fd < 0) return -1;
+    if(ftruncate(s->fd, s->size) < 0 || _map(s, MAP_POPULATE)) {
+        close(s->fd);
+        s->fd = -1;
+        shm_unlink(name);
+        return -1;
+    }
+    s->seg->slots = slots;
+    s->seg->hash_size = hash_size;
+    s->seg->version = CANFIX_SHM_VERSION;
+    /* Readers check the magic last */
+    atomic_store_explicit((_Atomic uint32_t *)&s->seg->magic, CANFIX_SHM_MAGIC, memory_order_release);
+    s->owner = 1;
+    return 0;
+}
+
+/* Maps an existing segment for a reader.  Returns -1 if it doesn't exist or
+   wasn't made by a matching version of the library. */
+int
+canfix_shm_open(canfix_shm *s, const char *name) {
+    struct stat st;
+
+    if(_init(s, name)) return -1;
+    s->fd = shm_open(name, O_RDWR, 0);
+    if(s->fd < 0) return -1;
+    if(fstat(s->fd, &st) < 0 || (size_t)st.st_size < sizeof(canfix_shm_segment)) {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    s->size = st.st_size;
+    if(_map(s, 0)) {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    if(atomic_load_explicit((_Atomic uint32_t *)&s->seg->magic, memory_order_acquire) != CANFIX_SHM_MAGIC ||
+       s->seg->version != CANFIX_SHM_VERSION ||
+       s->size < sizeof(canfix_shm_segment) + s->seg->hash_size * sizeof(uint32_t) + s->seg->slots * sizeof(canfix_shm_slot)) {
+        canfix_shm_close(s);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Unmaps the segment and removes it if this is the publisher.  The handle
+ * holds an open descriptor only while the segment is mapped, so it is safe
+ * to close a handle that failed to open or was only zeroed. */
+void
+canfix_shm_close(canfix_shm *s) {
+    if(s->seg) {
+        munmap(s->seg, s->size);
+        close(s->fd);
+        if(s->owner) shm_unlink(s->name);
+    }
+    s->seg = NULL;
+    s->fd = -1;
+    s->owner = 0;
+}
+
+/* Publishes a parameter, normally called from the parameter callback with
+ * the time given to canfix_tick().  Sleeping readers are woken.  Returns -1
+ * if there is no slot left for a new parameter. */
+int
+canfix_shm_publish(canfix_shm *s, const canfix_parameter *par, uint32_t now) {
+    canfix_shm_segment *seg = s->seg;
+    uint32_t key = KEY(par->type, par->node, par->index), bucket, n;
+    canfix_shm_slot *slot = _find(seg, key, &bucket);
+
+    if(slot == NULL) {
+        n = atomic_load_explicit(&seg->count, memory_order_relaxed);
+        if(n == seg->slots) return -1;
+        slot = &_slots(seg)[n];
+        slot->key = key;
+        atomic_store_explicit(&seg->count, n + 1, memory_order_release);
+        atomic_store_explicit(&_hash(seg)[bucket], n + 1, memory_order_release);
+    }
+    n = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->par = *par;
+    slot->changes++;
+    slot->updated = now;
+    atomic_store_explicit(&slot->seq, n + 2, memory_order_release);
+
+    atomic_fetch_add_explicit(&seg->changes, 1, memory_order_release);
+    if(atomic_load_explicit(&seg->waiters, memory_order_seq_cst)) {
+        syscall(SYS_futex, &seg->changes, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+/* Copies the slot out under its sequence lock */
+static void
+_read(canfix_shm_slot *slot, canfix_shm_value *value) {
+    uint32_t seq;
+
+    do {
+        while((seq = atomic_load_explicit(&slot->seq, memory_order_acquire)) & 0x01);
+        value->par = slot->par;
+        value->changes = slot->changes;
+        value->updated = slot->updated;
+        atomic_thread_fence(memory_order_acquire);
+    } while(atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq);
+}
+
+/* Reads the latest value of a parameter.  Returns -1 if it has never been
+   published. */
+int
+canfix_shm_read(canfix_shm *s, uint16_t type, uint8_t node, uint8_t index, canfix_shm_value *value) {
+    canfix_shm_slot *slot = _find(s->seg, KEY(type, node, index), NULL);
+
+    if(slot == NULL) return -1;
+    _read(slot, value);
+    return 0;
+}
+
+/* Reads a value by slot number, from zero up to canfix_shm_count(), so a
+   reader can take a snapshot of everything. */
+int
+canfix_shm_read_slot(canfix_shm *s, uint32_t slot, canfix_shm_value *value) {
+    if(slot >= canfix_shm_count(s)) return -1;
+    _read(&_slots(s->seg)[slot], value);
+    return 0;
+}
+
+uint32_t
+canfix_shm_count(canfix_shm *s) {
+    return atomic_load_explicit(&s->seg->count, memory_order_acquire);
+}
+
+/* The change counter goes up by one with every publish */
+uint32_t
+canfix_shm_changes(canfix_shm *s) {
+    return atomic_load_explicit(&s->seg->changes, memory_order_acquire);
+}
+
+/* Sleeps until the change counter is different from changes or timeout
+ * milliseconds pass.  A negative timeout waits forever.  Returns the change
+ * counter. */
+uint32_t
+canfix_shm_wait(canfix_shm *s, uint32_t changes, int timeout) {
+    canfix_shm_segment *seg = s->seg;
+    struct timespec ts, *tp = NULL;
+
+    if(timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        tp = &ts;
+    }
+    atomic_fetch_add_explicit(&seg->waiters, 1, memory_order_seq_cst);
+    if(atomic_load_explicit(&seg->changes, memory_order_seq_cst) == changes) {
+        syscall(SYS_futex, &seg->changes, FUTEX_WAIT, changes, tp, NULL, 0);
+    }
+    atomic_fetch_sub_explicit(&seg->waiters, 1, memory_order_seq_cst);
+    return canfix_shm_changes(s);
+}
@@ -0,0 +1,68 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the shared memory publication of parameter values
+ */
+
+#ifndef __CANFIX_SHM_H
+#define __CANFIX_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "canfix.h"
+
+/* One process decodes the bus and publishes the latest value of every
+ * parameter into a POSIX shared memory segment.  Any number of readers map
+ * the same segment and read values without locks or system calls.  Each
+ * value is protected by a sequence lock, so a reader that catches a value
+ * while it is being written just reads it again.  The segment also has a
+ * change counter that readers can sleep on with canfix_shm_wait(). */
+
+#define CANFIX_SHM_MAGIC   0x43465853
+#define CANFIX_SHM_VERSION 1
+
+/* A value as it is handed to a reader */
+typedef struct {
+    canfix_parameter par;
+    uint32_t changes;   // Number of times this value has been published
+    uint32_t updated;   // Time given to canfix_shm_publish()
+} canfix_shm_value;
+
+typedef struct _canfix_shm_segment canfix_shm_segment;
+
+typedef struct {
+    int fd;
+    size_t size;
+    uint8_t owner;      // Set for the publisher, which removes the segment
+    char name[64];
+    canfix_shm_segment *seg;
+} canfix_shm;
+
+int canfix_shm_create(canfix_shm *s, const char *name, uint32_t slots);
+int canfix_shm_open(canfix_shm *s, const char *name);
+void canfix_shm_close(canfix_shm *s);
+
+int canfix_shm_publish(canfix_shm *s, const canfix_parameter *par, uint32_t now);
+
+int canfix_shm_read(canfix_shm *s, uint16_t type, uint8_t node, uint8_t index, canfix_shm_value *value);
+int canfix_shm_read_slot(canfix_shm *s, uint32_t slot, canfix_shm_value *value);
+uint32_t canfix_shm_count(canfix_shm *s);
+uint32_t canfix_shm_changes(canfix_shm *s);
+uint32_t canfix_shm_wait(canfix_shm *s, uint32_t changes, int timeout);
+
+#endif /* __CANFIX_SHM_H */
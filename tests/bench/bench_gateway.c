@@ -0,0 +1,75 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file measures what it costs the gateway to forward a frame
+ */
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "canfix.h"
+
+#define FRAMES 4000000
+
+static canfix_object a, b;
+static canfix_gateway g;
+static uint32_t written;
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    written++;
+    return 0;
+}
+
+/* Parameters from 64 nodes with changing values, so no two frames in a row
+   are the same, forwarded from bus 0 to bus 1 with one node remapped */
+static double
+_run(uint8_t remap) {
+    canfix_route r = {0, 1, 0x100, 0x6DF, remap ? 0x20 : 0, 0x60, 0};
+    uint8_t data[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    uint64_t start;
+
+    canfix_gateway_compile(&g, &r, 1);
+    written = 0;
+    start = bench_nanos();
+    for(uint32_t n = 0; n < FRAMES; n++) {
+        if(n % 1000 == 0) {
+            canfix_tick(&a, n / 1000);
+            canfix_tick(&b, n / 1000);
+        }
+        data[0] = 0x10 + n % 64;
+        data[3] = n;
+        data[4] = n >> 8;
+        canfix_exec(&a, 0x100 + n % 0x5E0, 8, data);
+    }
+    return (double)(bench_nanos() - start) / FRAMES;
+}
+
+int
+main(void) {
+    canfix_init(&a, 0xF0, 0, 0, 0);
+    canfix_init(&b, 0xF0, 0, 0, 0);
+    canfix_set_write_callback(&a, _write);
+    canfix_set_write_callback(&b, _write);
+    canfix_gateway_init(&g);
+    canfix_gateway_attach(&g, &a);
+    canfix_gateway_attach(&g, &b);
+    printf("forward:          %.1f ns per frame\n", _run(0));
+    printf("forward remapped: %.1f ns per frame\n", _run(1));
+    printf("frames written:   %u\n", written);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file times answering a Node Identification request.  It is built
+ *  once with CANFIX_USE_ID_CACHE and once without so the two can be
+ *  compared.
+ */
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "canfix.h"
+
+#define REQUESTS 200000
+
+/* The description of the switch node, 87 characters or 23 frames */
+static char description[] = "MakerPlane DI12U2 Digital Input Module v0.1 SN 0000001 Firmware v1.2.3.4-May 2023 GPL";
+
+static uint32_t frames;
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    BENCH_KEEP(data);
+    frames++;
+    return 0;
+}
+
+int
+main(void) {
+    canfix_object h;
+    uint64_t start, end;
+
+    canfix_init(&h, 0x30, 1, 2, 3);
+    canfix_set_write_callback(&h, _write);
+    canfix_set_description(&h, description);
+    start = bench_nanos();
+    for(uint32_t n = 0; n < REQUESTS; n++) canfix_send_identification(&h, n & 0xFF);
+    end = bench_nanos();
+#ifdef CANFIX_USE_ID_CACHE
+    printf("cached: ");
+#else
+    printf("string: ");
+#endif
+    printf("%u frames a request, %.1f ns a request\n", frames / REQUESTS, (double)(end - start) / REQUESTS);
+    return 0;
+}
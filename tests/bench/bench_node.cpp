@@ -0,0 +1,76 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file compares handling parameter frames through canfix_exec() and a
+ *  C callback with canfix::Node::exec() and an inline handler
+ */
+
+#include <cstdio>
+
+#include "bench.h"
+#include "canfix.hpp"
+
+#define FRAMES 20000000
+
+static uint32_t sum;
+
+static int
+_write(uint16_t, uint8_t, uint8_t *) {
+    return 0;
+}
+
+static void
+_parameter(canfix_parameter par) {
+    sum += par.data[0] | par.data[1] << 8;
+}
+
+struct Handlers {
+    int write(uint16_t, std::span<const uint8_t>) { return 0; }
+    void on_parameter(const canfix::Parameter &par) { sum += par.as<uint16_t>(); }
+};
+
+/* Eight byte parameter frames with changing IDs and values */
+template<class F>
+static double
+_run(F exec) {
+    uint8_t data[8] = {0x20, 0, 0, 0, 0, 0, 0, 0};
+    uint64_t start = bench_nanos();
+
+    for(uint32_t n = 0; n < FRAMES; n++) {
+        data[3] = n;
+        data[4] = n >> 8;
+        exec(0x100 + n % 0x5E0, 8, data);
+    }
+    return (double)(bench_nanos() - start) / FRAMES;
+}
+
+int
+main(void) {
+    canfix_object h;
+    canfix::Node<Handlers> node(0x10, 1, 1, 0);
+    double c, cpp;
+
+    canfix_init(&h, 0x10, 1, 1, 0);
+    canfix_set_write_callback(&h, _write);
+    canfix_set_parameter_callback(&h, _parameter);
+    c = _run([&](uint16_t id, uint8_t length, uint8_t *data) { canfix_exec(&h, id, length, data); });
+    cpp = _run([&](uint16_t id, uint8_t length, uint8_t *data) { node.exec(id, length, data); });
+    BENCH_KEEP(sum);
+    printf("canfix_exec() and a C callback: %.1f ns per frame\n", c);
+    printf("Node::exec() and a handler:     %.1f ns per frame\n", cpp);
+    return 0;
+}
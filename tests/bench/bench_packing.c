@@ -0,0 +1,84 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file counts the frames and bus time that packing parameters saves
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "canfix.h"
+
+#define PARAMETERS 8000
+
+static uint32_t frames, bytes, bits;
+
+/* Roughly what a frame takes on the wire: the arbitration phase at the
+   nominal rate and the data phase of an FD frame at eight times that,
+   counted in nominal bit times and ignoring stuff bits */
+static int
+_count(uint16_t id, uint8_t length, uint8_t *data, uint8_t fd) {
+    frames++;
+    bytes += length;
+    if(fd) {
+        bits += 30 + (28 + length * 8 + (length > 16 ? 21 : 17)) / 8;
+    } else {
+        bits += 47 + length * 8;
+    }
+    return 0;
+}
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    return _count(id, length, data, 0);
+}
+
+static int
+_write_fd(uint16_t id, uint8_t length, uint8_t *data, uint8_t flags) {
+    return _count(id, length, data, 1);
+}
+
+/* Sends the parameters of a busy node, two bytes each, ten a millisecond */
+static void
+_run(const char *name, uint8_t packing) {
+    canfix_object h;
+    canfix_parameter par;
+
+    canfix_init(&h, 0x20, 0, 0, 0);
+    canfix_set_write_callback(&h, _write);
+    canfix_set_fd_write_callback(&h, _write_fd);
+    canfix_set_packing(&h, packing, 5);
+    memset(&par, 0, sizeof(par));
+    par.length = 2;
+    frames = bytes = bits = 0;
+    for(uint32_t n = 0; n < PARAMETERS; n++) {
+        if(n % 10 == 0) canfix_tick(&h, n / 10);
+        par.type = 0x100 + n % 200;
+        par.data[0] = n;
+        canfix_send_parameter(&h, par);
+    }
+    canfix_pack_flush(&h);
+    printf("%-8s %6u frames %7u bytes %8u bit times\n", name, frames, bytes, bits);
+}
+
+int
+main(void) {
+    printf("%u parameters\n", PARAMETERS);
+    _run("single", 0);
+    _run("packed", 1);
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the source code for the CANBus interface functions
+ */
+
+/* This is a file backed block device that behaves like NOR flash so that
+ * the configuration store can be used on Linux.  Erased bytes read as 0xFF
+ * and writing can only clear bits. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "flash.h"
+
+static int _fd = -1;
+static uint32_t _sector_size;
+static uint8_t _sectors;
+
+int
+flash_setup(const char *filename, uint32_t sector_size, uint8_t sectors) {
+    off_t size = (off_t)sector_size * sectors;
+
+    _fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if(_fd < 0) {
+        perror("Flash");
+        return 1;
+    }
+    _sector_size = sector_size;
+    _sectors = sectors;
+    if(lseek(_fd, 0, SEEK_END) < size) { /* New file so start it erased */
+        for(uint8_t n = 0; n < sectors; n++) {
+            if(flash_erase(n)) return 1;
+        }
+    }
+    return 0;
+}
+
+int
+flash_read(uint32_t address, void *data, uint16_t length) {
+    if(pread(_fd, data, length, address) != length) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+flash_write(uint32_t address, const void *data, uint16_t length) {
+    uint8_t buff[256];
+    uint16_t n, chunk;
+
+    while(length) {
+        chunk = length > sizeof(buff) ? sizeof(buff) : length;
+        if(flash_read(address, buff, chunk)) return -1;
+        for(n = 0; n < chunk; n++) {
+            buff[n] &= ((const uint8_t *)data)[n];
+        }
+        if(pwrite(_fd, buff, chunk, address) != chunk) return -1;
+        address += chunk;
+        data = (const uint8_t *)data + chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+int
+flash_erase(uint8_t sector) {
+    uint8_t *buff;
+    int result = 0;
+
+    if(sector >= _sectors) return -1;
+    buff = malloc(_sector_size);
+    if(buff == NULL) return -1;
+    memset(buff, 0xFF, _sector_size);
+    if(pwrite(_fd, buff, _sector_size, (off_t)sector * _sector_size) != _sector_size) {
+        result = -1;
+    }
+    free(buff);
+    return result;
+}
+
+void
+flash_close(void) {
+    if(close(_fd) < 0) {
+        perror("Close");
+    }
+}
@@ -0,0 +1,32 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the source code for the CANBus interface functions
+ */
+
+#ifndef __FLASH_H
+#define __FLASH_H
+
+#include <stdint.h>
+
+int flash_setup(const char *filename, uint32_t sector_size, uint8_t sectors);
+int flash_read(uint32_t address, void *data, uint16_t length);
+int flash_write(uint32_t address, const void *data, uint16_t length);
+int flash_erase(uint8_t sector);
+void flash_close(void);
+
+#endif /* !__FLASH_H */
@@ -0,0 +1,181 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains an in process CAN bus for the unit tests
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bus.h"
+
+canfix_object *bus_current;
+
+/* The write callbacks don't say who is writing so each object gets a write
+   function of its own that knows its slot */
+static struct {
+    bus_t *bus;
+    canfix_object *h;
+} _slots[BUS_SLOTS];
+
+static int
+_send(int slot, uint16_t id, uint8_t length, uint8_t *data, uint8_t fd) {
+    bus_t *bus = _slots[slot].bus;
+    int next = (bus->head + 1) % BUS_QUEUE;
+
+    if(next == bus->tail) {
+        printf("bus: queue overflow\n");
+        exit(2);
+    }
+    bus->queue[bus->head].from = _slots[slot].h;
+    bus->queue[bus->head].fd = fd;
+    bus->queue[bus->head].f.id = id;
+    bus->queue[bus->head].f.length = length;
+    memcpy(bus->queue[bus->head].f.data, data, length);
+    bus->head = next;
+    return 0;
+}
+
+#define _WRITE(n) \
+static int _write##n(uint16_t id, uint8_t length, uint8_t *data) { \
+    return _send(n, id, length, data, 0); \
+}
+_WRITE(0) _WRITE(1) _WRITE(2) _WRITE(3) _WRITE(4) _WRITE(5) _WRITE(6) _WRITE(7)
+_WRITE(8) _WRITE(9) _WRITE(10) _WRITE(11) _WRITE(12) _WRITE(13) _WRITE(14) _WRITE(15)
+
+static int (*const _writes[BUS_SLOTS])(uint16_t, uint8_t, uint8_t *) = {
+    _write0, _write1, _write2, _write3, _write4, _write5, _write6, _write7,
+    _write8, _write9, _write10, _write11, _write12, _write13, _write14, _write15
+};
+
+#ifdef CANFIX_CONST_CALLBACKS
+/* The objects keep no callbacks of their own, so each slot has a table */
+#define _TABLE(n) {.write_callback = _write##n}
+static const canfix_callbacks _tables[BUS_SLOTS] = {
+    _TABLE(0), _TABLE(1), _TABLE(2), _TABLE(3), _TABLE(4), _TABLE(5), _TABLE(6), _TABLE(7),
+    _TABLE(8), _TABLE(9), _TABLE(10), _TABLE(11), _TABLE(12), _TABLE(13), _TABLE(14), _TABLE(15)
+};
+#endif
+
+#ifdef CANFIX_USE_FD
+#define _WRITE_FD(n) \
+static int _write_fd##n(uint16_t id, uint8_t length, uint8_t *data, uint8_t flags) { \
+    (void)flags; \
+    return _send(n, id, length, data, 1); \
+}
+_WRITE_FD(0) _WRITE_FD(1) _WRITE_FD(2) _WRITE_FD(3) _WRITE_FD(4) _WRITE_FD(5) _WRITE_FD(6) _WRITE_FD(7)
+_WRITE_FD(8) _WRITE_FD(9) _WRITE_FD(10) _WRITE_FD(11) _WRITE_FD(12) _WRITE_FD(13) _WRITE_FD(14) _WRITE_FD(15)
+
+static int (*const _writes_fd[BUS_SLOTS])(uint16_t, uint8_t, uint8_t *, uint8_t) = {
+    _write_fd0, _write_fd1, _write_fd2, _write_fd3, _write_fd4, _write_fd5, _write_fd6, _write_fd7,
+    _write_fd8, _write_fd9, _write_fd10, _write_fd11, _write_fd12, _write_fd13, _write_fd14, _write_fd15
+};
+#endif
+
+/* Starts the bus empty.  Objects that were on it before are taken off. */
+void
+bus_init(bus_t *bus) {
+    for(int n = 0; n < BUS_SLOTS; n++) {
+        if(_slots[n].bus == bus) _slots[n].bus = NULL;
+    }
+    memset(bus, 0, sizeof(bus_t));
+}
+
+static int
+_attach(bus_t *bus, canfix_object *h) {
+    int slot;
+
+    for(slot = 0; slot < BUS_SLOTS && _slots[slot].bus; slot++);
+    if(bus->count == BUS_NODES || slot == BUS_SLOTS) {
+        printf("bus: too many objects\n");
+        exit(2);
+    }
+    bus->node[bus->count++] = h;
+    _slots[slot].bus = bus;
+    _slots[slot].h = h;
+#ifdef CANFIX_CONST_CALLBACKS
+    canfix_set_callbacks(h, &_tables[slot]);
+#else
+    canfix_set_write_callback(h, _writes[slot]);
+#endif
+    return slot;
+}
+
+void
+bus_attach(bus_t *bus, canfix_object *h) {
+    _attach(bus, h);
+}
+
+#ifdef CANFIX_USE_FD
+/* The object can send FD frames as well */
+void
+bus_attach_fd(bus_t *bus, canfix_object *h) {
+    canfix_set_fd_write_callback(h, _writes_fd[_attach(bus, h)]);
+}
+#endif
+
+/* Delivers frames until the queue is empty or limit frames have been
+   delivered.  Returns the number delivered. */
+int
+bus_run(bus_t *bus, int limit) {
+    int count = 0;
+
+    while(bus->tail != bus->head && count < limit) {
+        canfix_object *from = bus->queue[bus->tail].from;
+        canfix_frame f = bus->queue[bus->tail].f;
+        uint8_t fd = bus->queue[bus->tail].fd;
+
+        bus->tail = (bus->tail + 1) % BUS_QUEUE;
+        count++;
+        if(bus->drop && bus->drop(from, f.id, f.length, f.data)) {
+            bus->dropped++;
+            continue;
+        }
+        bus->frames++;
+        for(int n = 0; n < bus->count; n++) {
+            if(bus->node[n] == from) continue;
+            bus_current = bus->node[n];
+#ifdef CANFIX_USE_FD
+            if(fd) {
+                canfix_exec_fd(bus->node[n], f.id, f.length, f.data);
+                continue;
+            }
+#else
+            (void)fd;
+#endif
+            canfix_exec(bus->node[n], f.id, f.length, f.data);
+        }
+    }
+    bus_current = NULL;
+    return count;
+}
+
+/* Moves time along by ms a millisecond at a time, ticking every object and
+   delivering what they send */
+void
+bus_tick(bus_t *bus, uint32_t ms) {
+    while(ms--) {
+        bus->now++;
+        for(int n = 0; n < bus->count; n++) {
+            bus_current = bus->node[n];
+            canfix_tick(bus->node[n], bus->now);
+        }
+        bus_current = NULL;
+        bus_run(bus, BUS_QUEUE);
+    }
+}
@@ -0,0 +1,72 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains an in process CAN bus for the unit tests
+ */
+
+#ifndef __BUS_H
+#define __BUS_H
+
+#include <stdint.h>
+
+#include "canfix.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BUS_NODES 8     // Objects on one bus
+#define BUS_SLOTS 16    // Objects on all of the buses together
+#define BUS_QUEUE 4096  // Frames waiting to be delivered
+
+/* Frames written by an object on the bus are queued and bus_run() gives
+ * them to every other object on the same bus with canfix_exec(), in the
+ * order they were written.  The drop function, if it is set, sees each
+ * frame as it is delivered and can lose it by returning non zero. */
+typedef struct {
+    canfix_object *node[BUS_NODES];
+    int count;
+    int (*drop)(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data);
+    struct {
+        canfix_object *from;
+        uint8_t fd;
+        canfix_frame f;
+    } queue[BUS_QUEUE];
+    int head;
+    int tail;
+    uint32_t now;
+    uint32_t frames;    // Frames delivered
+    uint32_t dropped;
+} bus_t;
+
+/* The object that canfix_exec() or canfix_tick() is running for.  The
+   library's callbacks don't say which object they belong to. */
+extern canfix_object *bus_current;
+
+void bus_init(bus_t *bus);
+void bus_attach(bus_t *bus, canfix_object *h);
+#ifdef CANFIX_USE_FD
+void bus_attach_fd(bus_t *bus, canfix_object *h);
+#endif
+int bus_run(bus_t *bus, int limit);
+void bus_tick(bus_t *bus, uint32_t ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !__BUS_H */
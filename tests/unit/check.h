@@ -0,0 +1,39 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file contains the checks that the unit tests use
+ */
+
+#ifndef __CHECK_H
+#define __CHECK_H
+
+#include <stdio.h>
+
+/* A failed check is printed and counted and the test carries on so that
+   one run shows everything that is wrong.  main() returns CHECK_RESULT(). */
+static int _check_failures;
+
+#define CHECK(x) do { \
+    if(! (x)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+        _check_failures++; \
+    } \
+} while(0)
+
+#define CHECK_RESULT() (_check_failures ? (printf("%d checks failed\n", _check_failures), 1) : 0)
+
+#endif /* !__CHECK_H */
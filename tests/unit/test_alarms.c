@@ -0,0 +1,167 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the alarm table.  It is built with room for only four
+ *  alarms so that the table can be filled.
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+#define LOG 32
+
+static canfix_object h;
+static canfix_alarms a;
+static struct {
+    uint8_t node;
+    uint16_t code;
+    uint8_t data;
+    uint8_t event;
+} events[LOG];
+static int count;
+
+static void
+_event(canfix_alarm *e, uint8_t event) {
+    if(count < LOG) {
+        events[count].node = e->node;
+        events[count].code = e->code;
+        events[count].data = e->data[0];
+        events[count].event = event;
+    }
+    count++;
+}
+
+static void
+_setup(void) {
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_alarms_init(&a, &h);
+    canfix_alarms_set_callback(&a, _event);
+    count = 0;
+}
+
+static void
+_alarm(uint8_t node, uint16_t code, uint8_t value) {
+    uint8_t data[3] = {code, code >> 8, value};
+
+    canfix_exec(&h, node, 3, data);
+}
+
+/* A new alarm is raised once and repeats only count */
+static void
+test_raised(void) {
+    canfix_alarm *list;
+    uint8_t n;
+
+    _setup();
+    _alarm(0x20, 0x105, 1);
+    CHECK(count == 1);
+    CHECK(events[0].event == ALARM_RAISED && events[0].node == 0x20 && events[0].code == 0x105);
+    canfix_tick(&h, 100);
+    _alarm(0x20, 0x105, 1);
+    CHECK(count == 1);
+    list = canfix_alarms_list(&a, &n);
+    CHECK(n == 1 && list[0].count == 2 && list[0].first == 0 && list[0].last == 100);
+}
+
+/* Changes inside the window are held back until _alarm_tick() sends the
+   latest of them when the window is up */
+static void
+test_updated(void) {
+    _setup();
+    _alarm(0x20, 0x105, 1);
+    canfix_tick(&h, 200);
+    _alarm(0x20, 0x105, 2);
+    canfix_tick(&h, 300);
+    _alarm(0x20, 0x105, 3);
+    canfix_tick(&h, CANFIX_ALARM_WINDOW - 1);
+    CHECK(count == 1);
+    canfix_tick(&h, CANFIX_ALARM_WINDOW);
+    CHECK(count == 2 && events[1].event == ALARM_UPDATED && events[1].data == 3);
+    canfix_tick(&h, CANFIX_ALARM_WINDOW + 100);
+    CHECK(count == 2);
+
+    /* Once the window has passed a change goes out straight away */
+    canfix_tick(&h, 2 * CANFIX_ALARM_WINDOW);
+    _alarm(0x20, 0x105, 4);
+    CHECK(count == 3 && events[2].event == ALARM_UPDATED && events[2].data == 4);
+}
+
+/* Alarm code zero clears everything from that node */
+static void
+test_clear(void) {
+    canfix_alarm *list;
+    uint8_t data[2] = {0, 0};
+    uint8_t n;
+
+    _setup();
+    _alarm(0x20, 0x105, 1);
+    _alarm(0x21, 0x105, 1);
+    _alarm(0x20, 0x106, 1);
+    canfix_exec(&h, 0x20, 2, data);
+    CHECK(count == 5);
+    CHECK(events[3].event == ALARM_CLEARED && events[3].node == 0x20);
+    CHECK(events[4].event == ALARM_CLEARED && events[4].node == 0x20);
+    list = canfix_alarms_list(&a, &n);
+    CHECK(n == 1 && list[0].node == 0x21);
+}
+
+/* An alarm that isn't repeated for the timeout is cleared */
+static void
+test_timeout(void) {
+    uint8_t n;
+
+    _setup();
+    _alarm(0x20, 0x105, 1);
+    canfix_tick(&h, 2000);
+    _alarm(0x20, 0x105, 1);
+    canfix_tick(&h, 2000 + CANFIX_ALARM_TIMEOUT - 1);
+    CHECK(count == 1);
+    canfix_tick(&h, 2000 + CANFIX_ALARM_TIMEOUT);
+    CHECK(count == 2 && events[1].event == ALARM_CLEARED);
+    canfix_alarms_list(&a, &n);
+    CHECK(n == 0);
+}
+
+/* Alarms that don't fit are counted and left out */
+static void
+test_overflow(void) {
+    canfix_alarm *list;
+    uint8_t n;
+
+    _setup();
+    for(int i = 0; i < CANFIX_ALARM_SIZE; i++) _alarm(0x20, 0x101 + i, 1);
+    CHECK(a.overflow == 0);
+    _alarm(0x21, 0x101, 1);
+    CHECK(a.overflow == 1);
+    CHECK(count == CANFIX_ALARM_SIZE);
+    _alarm(0x20, 0x101, 1);
+    CHECK(a.overflow == 1);
+    list = canfix_alarms_list(&a, &n);
+    CHECK(n == CANFIX_ALARM_SIZE && list[0].count == 2);
+}
+
+int
+main(void) {
+    test_raised();
+    test_updated();
+    test_clear();
+    test_timeout();
+    test_overflow();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,244 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the coroutine executor in canfix_async.hpp.  It is built
+ *  with the address and undefined behaviour sanitizers.
+ */
+
+#include <string.h>
+
+#include "bus.h"
+#include "check.h"
+#include "canfix_async.hpp"
+
+#define KEYS    20
+#define SERVERS 4
+#define TASKS   3000
+#define IMAGE   3000
+
+static bus_t bus;
+static canfix_object host[2], server[SERVERS];
+static canfix_cfgclient client[2];
+static canfix_directory directory[2];
+static canfix_uploader uploader[2];
+static uint16_t words[SERVERS][KEYS];
+static canfix_config_key table[SERVERS][KEYS];
+static uint8_t image[IMAGE];
+static uint8_t flash[SERVERS][IMAGE];
+
+static uint8_t
+_firmware(uint16_t vcode, uint8_t channel) {
+    (void)channel;
+    return vcode == 0x1234 ? 0 : 1;
+}
+
+static uint8_t
+_firmware_write(uint8_t subsystem, uint32_t address, uint8_t *data, uint8_t length) {
+    (void)subsystem;
+    if(length == 0) return 0; /* End of a block */
+    if(address + length > IMAGE) return 1;
+    memcpy(&flash[bus_current - server][address], data, length);
+    return 0;
+}
+
+static void
+_setup(void) {
+    bus_init(&bus);
+    for(int n = 0; n < 2; n++) {
+        canfix_init(&host[n], 0x01 + n, 0, 0, 0);
+        bus_attach(&bus, &host[n]);
+        canfix_cfgclient_init(&client[n], &host[n]);
+        canfix_directory_init(&directory[n], &host[n]);
+        canfix_uploader_init(&uploader[n], &host[n]);
+    }
+    for(int s = 0; s < SERVERS; s++) {
+        canfix_init(&server[s], 0x20 + s, 0, 0, 0);
+        bus_attach(&bus, &server[s]);
+        for(int n = 0; n < KEYS; n++) {
+            words[s][n] = s * 1000 + n;
+            table[s][n].key = 0x0201 + n;
+            table[s][n].type = CANFIX_TYPE_UINT;
+            table[s][n].storage = &words[s][n];
+        }
+        CHECK(canfix_set_config_table(&server[s], table[s], KEYS) == 0);
+        canfix_set_firmware_callback(&server[s], _firmware);
+        canfix_set_firmware_write_callback(&server[s], _firmware_write);
+    }
+    memset(flash, 0, sizeof(flash));
+}
+
+/* Runs the bus and the executor together until done is set or the time is
+   up.  Returns the milliseconds that it took. */
+static int
+_run(canfix::Executor &ex, const bool *done, int limit) {
+    int ms;
+
+    for(ms = 0; ms < limit && ! *done; ms++) {
+        bus_tick(&bus, 1);
+        ex.tick(bus.now);
+    }
+    return ms;
+}
+
+static canfix::Task<>
+_get(canfix::Executor &ex, int i, int *good, int *done) {
+    int s = i % SERVERS, k = i % KEYS;
+    canfix_cfg_result r = co_await ex.config_get(0x20 + s, 0x0201 + k);
+
+    if(r.status == 0 && r.length == 2 && (r.data[0] | r.data[1] << 8) == s * 1000 + k) (*good)++;
+    (*done)++;
+}
+
+/* Far more requests than the client's table holds wait in the executor and
+   all of them come back with the right value */
+static void
+test_many(void) {
+    int good = 0, done = 0;
+
+    _setup();
+    canfix::Executor ex(&host[0]);
+    for(int i = 0; i < TASKS; i++) ex.spawn(_get(ex, i, &good, &done));
+    for(int ms = 0; ms < 60000 && done < TASKS; ms++) {
+        bus_tick(&bus, 1);
+        ex.run();
+    }
+    CHECK(done == TASKS);
+    CHECK(good == TASKS);
+    CHECK(canfix_cfgclient_pending(&client[0]) == 0);
+}
+
+/* Two executors on two objects each get their own answers back, whichever
+   one was made last */
+static void
+test_two(void) {
+    int good[2] = {}, done[2] = {};
+
+    _setup();
+    canfix::Executor a(&host[0]);
+    canfix::Executor b(&host[1]);
+    for(int i = 0; i < 100; i++) {
+        a.spawn(_get(a, i, &good[0], &done[0]));
+        b.spawn(_get(b, i + 1, &good[1], &done[1]));
+    }
+    for(int ms = 0; ms < 5000 && done[0] < 100; ms++) {
+        bus_tick(&bus, 1);
+        a.run();
+    }
+    CHECK(done[0] == 100 && good[0] == 100);
+    CHECK(done[1] == 0);
+    b.run();
+    for(int ms = 0; ms < 5000 && done[1] < 100; ms++) {
+        bus_tick(&bus, 1);
+        b.run();
+    }
+    CHECK(done[1] == 100 && good[1] == 100);
+}
+
+/* The answers to requests that were out when the executor went away are not
+   written into the awaiters, which have gone away with it */
+static void
+test_destroy(void) {
+    canfix::Executor *ex;
+    canfix::Executor::ConfigOp *op[8];
+
+    _setup();
+    ex = new canfix::Executor(&host[0]);
+    for(int n = 0; n < 8; n++) {
+        op[n] = new canfix::Executor::ConfigOp(ex->config_get(0x20 + n % SERVERS, 0x0201 + n));
+        op[n]->await_suspend(std::noop_coroutine());
+    }
+    CHECK(canfix_cfgclient_pending(&client[0]) == 8);
+    delete ex;
+    for(int n = 0; n < 8; n++) delete op[n];
+    CHECK(client[0].ctx_callback == NULL);
+    bus_tick(&bus, 1000);
+    CHECK(canfix_cfgclient_pending(&client[0]) == 0);
+}
+
+static canfix::Task<>
+_identify(canfix::Executor &ex, uint8_t node, uint32_t ms, canfix_node_info **info, bool *done) {
+    *info = co_await ex.identify(node, ms);
+    *done = true;
+}
+
+/* A node on the bus answers and the coroutine gets its directory entry */
+static void
+test_identify(void) {
+    canfix_node_info *info = nullptr;
+    bool done = false;
+
+    _setup();
+    canfix::Executor ex(&host[0]);
+    ex.spawn(_identify(ex, 0x21, 500, &info, &done));
+    CHECK(! done);
+    _run(ex, &done, 1000);
+    CHECK(done);
+    CHECK(info && info->node == 0x21 && (info->flags & NODE_IDENTIFIED));
+    CHECK(canfix_directory_lookup(&directory[0], 0x21) == info);
+}
+
+/* Nobody answers for a node that isn't there, so it times out with nullptr
+   and not before */
+static void
+test_identify_timeout(void) {
+    canfix_node_info *info = &directory[0].nodes[0];
+    bool done = false;
+    int ms;
+
+    _setup();
+    canfix::Executor ex(&host[0]);
+    ex.spawn(_identify(ex, 0x30, 200, &info, &done));
+    ms = _run(ex, &done, 1000);
+    CHECK(done && info == nullptr);
+    CHECK(ms >= 200 && ms <= 201);
+    CHECK(ex.timeout() == -1);
+}
+
+static canfix::Task<>
+_upload(canfix::Executor &ex, uint8_t node, uint8_t *status, bool *done) {
+    *status = co_await ex.upload(node, 0x1234, 1, 0, 0, std::span<const uint8_t>(image, IMAGE));
+    *done = true;
+}
+
+/* An image is loaded into a node on the bus and the coroutine gets the
+   status when the node has it all */
+static void
+test_upload(void) {
+    uint8_t status = 0xFF;
+    bool done = false;
+
+    _setup();
+    for(int n = 0; n < IMAGE; n++) image[n] = n * 7 + (n >> 8);
+    canfix::Executor ex(&host[0]);
+    ex.spawn(_upload(ex, 0x22, &status, &done));
+    CHECK(! done && ex.timeout() > 0);
+    _run(ex, &done, 60000);
+    CHECK(done && status == FW_STATUS_COMPLETE);
+    CHECK(memcmp(flash[2], image, IMAGE) == 0);
+    CHECK(ex.timeout() == -1);
+}
+
+int
+main(void) {
+    test_many();
+    test_two();
+    test_destroy();
+    test_identify();
+    test_identify_timeout();
+    test_upload();
+    return CHECK_RESULT();
+}
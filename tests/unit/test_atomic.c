@@ -0,0 +1,130 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests sending from several threads while the receive thread
+ *  changes the node number and the description.  It is built with the
+ *  thread sanitizer, which fails the test if it finds a data race.  It is
+ *  built a second time with CANFIX_USE_ID_CACHE, so the answers come from
+ *  the cache while it is being rebuilt.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+#define SENDERS 3
+#define SENDS   20000
+
+static canfix_object h;
+static char desc_a[] = "ALPHA NODE DESCRIPTION";
+static char desc_b[] = "BETA";
+static int finished;
+static int errors;
+static int answers;
+
+/* What the thread that is writing has sent of its current answer */
+static _Thread_local int ans_node = -1;
+static _Thread_local const char *ans_desc;
+
+static int
+_node_ok(int node) {
+    return node == 0x40 || node == 0x41;
+}
+
+/* Called from every thread at once.  Each answer has to come out with one
+   node number and one description from start to end. */
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    int bad = 0;
+
+    if(id >= 0x100 && id < NSM_START) {
+        bad = ! _node_ok(data[0]);
+    } else if(id >= NSM_START && data[0] == NSM_ID) {
+        ans_node = id - NSM_START;
+        ans_desc = NULL;
+        bad = ! _node_ok(ans_node);
+        __atomic_add_fetch(&answers, 1, __ATOMIC_RELAXED);
+    } else if(id >= NSM_START && data[0] == NSM_DESC) {
+        int packet = data[2] | data[3] << 8;
+
+        if(packet == 0) ans_desc = memcmp(&data[4], desc_a, 4) == 0 ? desc_a : desc_b;
+        bad = id - NSM_START != ans_node || ans_desc == NULL;
+        for(int i = 0; ! bad && i < 4; i++) {
+            int c = packet * 4 + i;
+            bad = data[4 + i] != (c < (int)strlen(ans_desc) ? ans_desc[c] : '\0');
+        }
+    }
+    if(bad) __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void *
+_sender(void *arg) {
+    canfix_parameter par;
+    int n;
+
+    memset(&par, 0, sizeof(par));
+    par.type = 0x180 + (int)(intptr_t)arg;
+    par.length = 2;
+    for(n = 0; n < SENDS; n++) {
+        par.data[0] = n;
+        canfix_send_parameter(&h, par);
+        if(n % 50 == 0) canfix_send_identification(&h, 0x01);
+    }
+    __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void
+test_senders(void) {
+    pthread_t t[SENDERS];
+    uint8_t data[4];
+    uint8_t node = 0x40;
+    int n;
+
+    canfix_init(&h, node, 1, 2, 3);
+    canfix_set_write_callback(&h, _write);
+    canfix_set_description(&h, desc_a);
+    for(n = 0; n < SENDERS; n++) pthread_create(&t[n], NULL, _sender, (void *)(intptr_t)n);
+
+    /* The receive thread keeps changing things until the senders are done */
+    for(n = 0; __atomic_load_n(&finished, __ATOMIC_ACQUIRE) < SENDERS; n++) {
+        data[0] = NSM_NODE_SET;
+        data[1] = node;
+        data[2] = node = node == 0x40 ? 0x41 : 0x40;
+        canfix_exec(&h, NSM_START + 0x01, 3, data);
+        canfix_set_description(&h, n % 3 == 0 ? NULL : n % 3 == 1 ? desc_b : desc_a);
+        data[0] = NSM_DISABLE + n % 2;
+        data[1] = node;
+        data[2] = 0x80;
+        data[3] = 0x01;
+        canfix_exec(&h, NSM_START + 0x01, 4, data);
+    }
+    for(int i = 0; i < SENDERS; i++) pthread_join(t[i], NULL);
+
+    CHECK(errors == 0);
+    CHECK(answers == SENDERS * SENDS / 50);
+    CHECK(canfix_get_node(&h) == node);
+}
+
+int
+main(void) {
+    test_senders();
+    return CHECK_RESULT();
+}
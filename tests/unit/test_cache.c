@@ -0,0 +1,179 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the staleness watchdog of the last value cache
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+#define LOG 16
+
+/* One turn of the timing wheel */
+#define TURN (CANFIX_WHEEL_SLOTS * CANFIX_WHEEL_RES)
+
+static canfix_object h;
+static canfix_cache c;
+static canfix_cache_entry *timeouts[LOG];
+static int count;
+
+static void
+_timeout(canfix_cache_entry *e) {
+    if(count < LOG) timeouts[count] = e;
+    count++;
+}
+
+static void
+_setup(void) {
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_cache_init(&c, &h);
+    canfix_cache_set_timeout_callback(&c, _timeout);
+    count = 0;
+}
+
+static void
+_value(uint16_t type, uint8_t node, uint8_t flags) {
+    uint8_t data[4] = {node, 0, flags, 0x42};
+
+    canfix_exec(&h, type, 4, data);
+}
+
+/* Steps time forward the way a main loop would */
+static void
+_run(uint32_t from, uint32_t to) {
+    for(uint32_t t = from; t <= to; t += CANFIX_WHEEL_RES) canfix_tick(&h, t);
+}
+
+/* A value goes stale once after its period and again only after a new
+   value has arrived and its period has passed */
+static void
+test_stale(void) {
+    canfix_cache_entry *e;
+
+    _setup();
+    e = canfix_cache_watch(&c, 0x180, 0x20, 0, 100);
+    _value(0x180, 0x20, 0);
+    _run(0, 90);
+    CHECK(count == 0 && ! e->stale);
+    _run(100, 1000);
+    CHECK(count == 1 && timeouts[0] == e && e->stale);
+
+    _value(0x180, 0x20, 0);
+    CHECK(! e->stale);
+    _run(1010, 1090);
+    CHECK(count == 1);
+    _run(1100, 2000);
+    CHECK(count == 2 && e->stale);
+}
+
+/* A value that never arrives times out too */
+static void
+test_never(void) {
+    canfix_cache_entry *e;
+
+    _setup();
+    e = canfix_cache_watch(&c, 0x181, 0x20, 0, 100);
+    _run(0, 100);
+    CHECK(count == 1 && timeouts[0] == e);
+}
+
+/* Periods longer than the wheel take more than one turn */
+static void
+test_long_period(void) {
+    canfix_cache_entry *e;
+
+    _setup();
+    e = canfix_cache_watch(&c, 0x180, 0x20, 0, 2 * TURN + 500);
+    _value(0x180, 0x20, 0);
+    _run(0, 2 * TURN + 490);
+    CHECK(count == 0 && ! e->stale);
+    _run(2 * TURN + 500, 3 * TURN);
+    CHECK(count == 1 && e->stale);
+}
+
+/* A long gap between ticks still finds everything that is due, once, and
+   leaves what isn't due yet */
+static void
+test_gap(void) {
+    canfix_cache_entry *a, *b, *later;
+
+    _setup();
+    a = canfix_cache_watch(&c, 0x180, 0x20, 0, 100);
+    b = canfix_cache_watch(&c, 0x181, 0x20, 0, TURN - 100);
+    later = canfix_cache_watch(&c, 0x182, 0x20, 0, 5 * TURN);
+    _value(0x180, 0x20, 0);
+    _value(0x181, 0x20, 0);
+    _value(0x182, 0x20, 0);
+    canfix_tick(&h, 4 * TURN + 5);
+    CHECK(count == 2);
+    CHECK(a->stale && b->stale && ! later->stale);
+    canfix_tick(&h, 5 * TURN - CANFIX_WHEEL_RES);
+    CHECK(count == 2);
+    canfix_tick(&h, 5 * TURN);
+    CHECK(count == 3 && later->stale);
+}
+
+/* The stale flags are ORed into the cached value until a new one comes */
+static void
+test_flags(void) {
+    canfix_cache_entry *e;
+
+    _setup();
+    canfix_cache_set_stale_flags(&c, FCB_QUALITY);
+    e = canfix_cache_watch(&c, 0x180, 0x20, 0, 100);
+    _value(0x180, 0x20, FCB_ANNUNC);
+    _run(0, 100);
+    CHECK(e->par.flags == (FCB_ANNUNC | FCB_QUALITY));
+    CHECK(e->par.data[0] == 0x42);
+    _value(0x180, 0x20, 0);
+    CHECK(e->par.flags == 0);
+}
+
+/* A period of zero takes the entry out of the wheel */
+static void
+test_unwatch(void) {
+    canfix_cache_entry *e, *other;
+
+    _setup();
+    e = canfix_cache_watch(&c, 0x180, 0x20, 0, 100);
+    other = canfix_cache_watch(&c, 0x181, 0x20, 0, 100);
+    _value(0x180, 0x20, 0);
+    _value(0x181, 0x20, 0);
+    CHECK(canfix_cache_watch(&c, 0x180, 0x20, 0, 0) == e);
+    CHECK(e->period == 0);
+    _run(0, 3 * TURN);
+    CHECK(count == 1 && timeouts[0] == other && ! e->stale);
+
+    /* Values still arrive and it can be watched again */
+    _value(0x180, 0x20, 0);
+    canfix_cache_watch(&c, 0x180, 0x20, 0, 100);
+    _run(3 * TURN, 3 * TURN + 200);
+    CHECK(count == 2 && timeouts[1] == e);
+}
+
+int
+main(void) {
+    test_stale();
+    test_never();
+    test_long_period();
+    test_gap();
+    test_flags();
+    test_unwatch();
+    return CHECK_RESULT();
+}
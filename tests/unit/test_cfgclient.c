@@ -0,0 +1,135 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the configuration client between two nodes that are
+ *  both asking each other for configuration at the same time
+ */
+
+#include <string.h>
+
+#include "bus.h"
+#include "check.h"
+
+#define KEYS 20
+
+static bus_t bus;
+static canfix_object a, b;
+static canfix_cfgclient ca, cb;
+
+static uint16_t a_words[KEYS], b_words[KEYS];
+static canfix_config_key a_table[KEYS], b_table[KEYS];
+
+static void
+_table(canfix_config_key *table, uint16_t *words, uint16_t base) {
+    for(int n = 0; n < KEYS; n++) {
+        words[n] = base + n;
+        table[n].key = 0x0201 + n;
+        table[n].type = CANFIX_TYPE_UINT;
+        table[n].storage = &words[n];
+    }
+}
+
+static void
+_setup(void) {
+    bus_init(&bus);
+    canfix_init(&a, 0x10, 0, 0, 0);
+    canfix_init(&b, 0x20, 0, 0, 0);
+    bus_attach(&bus, &a);
+    bus_attach(&bus, &b);
+    _table(a_table, a_words, 1000);
+    _table(b_table, b_words, 2000);
+    CHECK(canfix_set_config_table(&a, a_table, KEYS) == 0);
+    CHECK(canfix_set_config_table(&b, b_table, KEYS) == 0);
+    canfix_cfgclient_init(&ca, &a);
+    canfix_cfgclient_init(&cb, &b);
+}
+
+static uint16_t
+_word(canfix_cfg_result *r) {
+    return r->data[0] | r->data[1] << 8;
+}
+
+/* Each node reads every key of the other while the other does the same */
+static void
+test_get(void) {
+    canfix_cfg_result ra[KEYS], rb[KEYS];
+
+    _setup();
+    memset(ra, 0, sizeof(ra));
+    memset(rb, 0, sizeof(rb));
+    for(int n = 0; n < KEYS; n++) {
+        CHECK(canfix_config_get(&ca, 0x20, 0x0201 + n, &ra[n], NULL) == 0);
+        CHECK(canfix_config_get(&cb, 0x10, 0x0201 + n, &rb[n], NULL) == 0);
+    }
+    bus_tick(&bus, 1000);
+    for(int n = 0; n < KEYS; n++) {
+        CHECK(ra[n].done && ra[n].status == 0 && ra[n].length == 2 && _word(&ra[n]) == 2000 + n);
+        CHECK(rb[n].done && rb[n].status == 0 && rb[n].length == 2 && _word(&rb[n]) == 1000 + n);
+    }
+    CHECK(canfix_cfgclient_pending(&ca) == 0 && canfix_cfgclient_pending(&cb) == 0);
+}
+
+static void
+test_set(void) {
+    canfix_cfg_result ra[KEYS], rb[KEYS];
+    uint8_t data[2];
+
+    _setup();
+    memset(ra, 0, sizeof(ra));
+    memset(rb, 0, sizeof(rb));
+    for(int n = 0; n < KEYS; n++) {
+        data[0] = n;
+        data[1] = 0x30;
+        CHECK(canfix_config_set(&ca, 0x20, 0x0201 + n, data, 2, &ra[n], NULL) == 0);
+        data[1] = 0x40;
+        CHECK(canfix_config_set(&cb, 0x10, 0x0201 + n, data, 2, &rb[n], NULL) == 0);
+    }
+    bus_tick(&bus, 1000);
+    for(int n = 0; n < KEYS; n++) {
+        CHECK(ra[n].done && ra[n].status == 0);
+        CHECK(rb[n].done && rb[n].status == 0);
+        CHECK(b_words[n] == 0x3000 + n);
+        CHECK(a_words[n] == 0x4000 + n);
+    }
+}
+
+/* Errors come back as a three byte answer and sets and gets can cross */
+static void
+test_mixed(void) {
+    canfix_cfg_result r[4];
+    uint8_t data[4] = {1, 2, 3, 4};
+
+    _setup();
+    memset(r, 0, sizeof(r));
+    CHECK(canfix_config_get(&ca, 0x20, 0x0700, &r[0], NULL) == 0);
+    CHECK(canfix_config_set(&cb, 0x10, 0x0203, data, 2, &r[1], NULL) == 0);
+    CHECK(canfix_config_set(&ca, 0x20, 0x0203, data, 4, &r[2], NULL) == 0);
+    CHECK(canfix_config_get(&cb, 0x10, 0x0202, &r[3], NULL) == 0);
+    bus_tick(&bus, 1000);
+    CHECK(r[0].done && r[0].status == CFG_ERR_UNKNOWN && r[0].length == 0);
+    CHECK(r[1].done && r[1].status == 0 && a_words[2] == 0x0201);
+    CHECK(r[2].done && r[2].status == CFG_ERR_WRNGTYPE);
+    CHECK(r[3].done && r[3].status == 0 && _word(&r[3]) == 1001);
+}
+
+int
+main(void) {
+    test_get();
+    test_set();
+    test_mixed();
+    return CHECK_RESULT();
+}
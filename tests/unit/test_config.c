@@ -0,0 +1,190 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the answers that a node with a configuration table
+ *  gives to configuration set messages
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+static canfix_object h;
+static uint8_t answer[8];
+static uint8_t answer_length;
+static int answers;
+
+static uint16_t locked = 1234;
+static int8_t trim;
+static uint16_t even;
+static float percent;
+static uint16_t validated_key;
+static int validated;
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    if(id == NSM_START + 0x10 && length <= 8) {
+        memcpy(answer, data, length);
+        answer_length = length;
+        answers++;
+    }
+    return 0;
+}
+
+/* Only takes even numbers */
+static uint8_t
+_even(uint16_t key, void *value) {
+    uint16_t v;
+
+    memcpy(&v, value, 2);
+    validated_key = key;
+    validated++;
+    return v % 2 ? CFG_ERR_OUTOFRNG : 0;
+}
+
+static const canfix_config_key table[] = {
+    {0x0201, CANFIX_TYPE_UINT,  CFG_READONLY, &locked,  0,   0,   NULL},
+    {0x0202, CANFIX_TYPE_SHORT, 0,            &trim,    -10, 10,  NULL},
+    {0x0203, CANFIX_TYPE_UINT,  0,            &even,    0,   0,   _even},
+    {0x0204, CANFIX_TYPE_FLOAT, 0,            &percent, 0,   100, NULL},
+};
+
+static void
+_setup(void) {
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_set_write_callback(&h, _write);
+    CHECK(canfix_set_config_table(&h, table, sizeof(table) / sizeof(table[0])) == 0);
+    answers = 0;
+}
+
+/* Sends a configuration set message from node 0x30 and returns the status
+   byte of the answer, or -1 if there wasn't exactly one */
+static int
+_set(uint16_t key, const void *value, uint8_t length) {
+    uint8_t data[8] = {NSM_CONFSET, 0x10, key, key >> 8};
+    int before = answers;
+
+    memcpy(&data[4], value, length);
+    canfix_exec(&h, NSM_START + 0x30, 4 + length, data);
+    if(answers != before + 1) return -1;
+    CHECK(answer_length == 3 && answer[0] == NSM_CONFSET && answer[1] == 0x30);
+    return answer[2];
+}
+
+static void
+test_readonly(void) {
+    uint16_t v = 1;
+
+    _setup();
+    CHECK(_set(0x0201, &v, 2) == CFG_ERR_READONLY);
+    CHECK(locked == 1234);
+}
+
+static void
+test_range(void) {
+    int8_t v;
+    float f;
+
+    _setup();
+    v = 11;
+    CHECK(_set(0x0202, &v, 1) == CFG_ERR_OUTOFRNG);
+    v = -11;
+    CHECK(_set(0x0202, &v, 1) == CFG_ERR_OUTOFRNG);
+    CHECK(trim == 0);
+    v = -10;
+    CHECK(_set(0x0202, &v, 1) == 0);
+    CHECK(trim == -10);
+
+    f = 100.5f;
+    CHECK(_set(0x0204, &f, 4) == CFG_ERR_OUTOFRNG);
+    f = 99.5f;
+    CHECK(_set(0x0204, &f, 4) == 0);
+    CHECK(percent == 99.5f);
+}
+
+/* The length has to be that of the key's type */
+static void
+test_type(void) {
+    uint16_t v = 5;
+
+    _setup();
+    trim = 0;
+    CHECK(_set(0x0202, &v, 2) == CFG_ERR_WRNGTYPE);
+    CHECK(_set(0x0204, &v, 2) == CFG_ERR_WRNGTYPE);
+    CHECK(_set(0x0203, &v, 0) == CFG_ERR_WRNGTYPE);
+    CHECK(trim == 0);
+}
+
+/* The validator sees the key and value after the other checks and its
+   answer goes back as it is */
+static void
+test_validate(void) {
+    uint16_t v;
+
+    _setup();
+    validated = 0;
+    v = 3;
+    CHECK(_set(0x0203, &v, 2) == CFG_ERR_OUTOFRNG);
+    CHECK(validated == 1 && validated_key == 0x0203 && even == 0);
+    v = 4;
+    CHECK(_set(0x0203, &v, 2) == 0);
+    CHECK(validated == 2 && even == 4);
+    CHECK(_set(0x0203, &v, 1) == CFG_ERR_WRNGTYPE);
+    CHECK(validated == 2);
+}
+
+/* Keys not in the table go to the config callback, and there isn't one */
+static void
+test_unknown(void) {
+    uint16_t v = 1;
+
+    _setup();
+    CHECK(_set(0x0300, &v, 2) == CFG_ERR_UNKNOWN);
+}
+
+/* A table that isn't sorted, has a key twice or has a bad type is refused
+   and the old one is kept */
+static void
+test_table(void) {
+    canfix_config_key bad[3];
+
+    _setup();
+    memcpy(bad, table, sizeof(bad));
+    bad[1] = table[2];
+    bad[2] = table[1];
+    CHECK(canfix_set_config_table(&h, bad, 3) == -1);
+    bad[2] = table[2];
+    CHECK(canfix_set_config_table(&h, bad, 3) == -1);
+    memcpy(bad, table, sizeof(bad));
+    bad[2].type = 0;
+    CHECK(canfix_set_config_table(&h, bad, 3) == -1);
+    bad[2].type = 10;
+    CHECK(canfix_set_config_table(&h, bad, 3) == -1);
+    CHECK(canfix_config_lookup(&h, 0x0204) == &table[3]);
+}
+
+int
+main(void) {
+    test_readonly();
+    test_range();
+    test_type();
+    test_validate();
+    test_unknown();
+    test_table();
+    return CHECK_RESULT();
+}
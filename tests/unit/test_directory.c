@@ -0,0 +1,295 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the node directory.  It is built with room for only
+ *  four nodes so that the directory can be filled.
+ */
+
+#include <string.h>
+
+#include "bus.h"
+#include "check.h"
+
+#define LOG 32
+
+static canfix_object h;
+static canfix_directory d;
+static int written;
+static uint8_t answer[8];
+static struct {
+    uint8_t node;
+    uint8_t event;
+} events[LOG];
+static int count;
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    if(id == NSM_START + 0x10 && length == 8) memcpy(answer, data, 8);
+    written++;
+    return 0;
+}
+
+static void
+_event(canfix_node_info *n, uint8_t event) {
+    if(count < LOG) {
+        events[count].node = n->node;
+        events[count].event = event;
+    }
+    count++;
+}
+
+static void
+_setup(void) {
+    canfix_init(&h, 0x10, 0x01, 0x02, 0x030405);
+    canfix_set_write_callback(&h, _write);
+    canfix_directory_init(&d, &h);
+    canfix_directory_set_callback(&d, _event);
+    written = 0;
+    count = 0;
+}
+
+/* Any frame that tells us who sent it */
+static void
+_parameter(uint8_t node) {
+    uint8_t data[3] = {node, 0, 0};
+
+    canfix_exec(&h, 0x180, 3, data);
+}
+
+static void
+_describe(uint8_t node, uint16_t packet, const char *description, uint8_t chars) {
+    uint8_t data[64];
+    int length = strlen(description);
+
+    memset(data, 0, sizeof(data));
+    data[0] = NSM_DESC;
+    data[1] = 0x10;
+    data[2] = packet;
+    data[3] = packet >> 8;
+    for(int i = 0; i < chars && packet * 4 + i < length; i++) data[4 + i] = description[packet * 4 + i];
+    if(chars > 4) {
+        canfix_exec_fd(&h, NSM_START + node, canfix_fd_length(4 + chars), data);
+    } else {
+        canfix_exec(&h, NSM_START + node, 8, data);
+    }
+}
+
+/* An eight byte Node Identification frame is an answer.  The node is found,
+   then identified, and nothing is sent back. */
+static void
+test_identify(void) {
+    uint8_t data[8] = {NSM_ID, 0x10, 1, 0x11, 0x22, 0x55, 0x44, 0x33};
+    canfix_node_info *n;
+
+    _setup();
+    canfix_exec(&h, NSM_START + 0x30, 8, data);
+    n = canfix_directory_lookup(&d, 0x30);
+    CHECK(n != NULL);
+    CHECK(n && n->device == 0x11 && n->revision == 0x22 && n->model == 0x334455);
+    CHECK(n && n->flags == NODE_IDENTIFIED);
+    CHECK(count == 2);
+    CHECK(events[0].node == 0x30 && events[0].event == NODE_EVENT_FOUND);
+    CHECK(events[1].node == 0x30 && events[1].event == NODE_EVENT_IDENTIFIED);
+    CHECK(written == 0);
+
+    /* The answer is for us but a broadcast answer is still only an answer */
+    data[1] = 0;
+    canfix_exec(&h, NSM_START + 0x30, 8, data);
+    CHECK(written == 0);
+    CHECK(count == 3 && events[2].event == NODE_EVENT_IDENTIFIED);
+}
+
+/* A shorter one is a request, which we answer, and the node that asked is
+   seen but not identified */
+static void
+test_request(void) {
+    uint8_t data[2] = {NSM_ID, 0x10};
+    canfix_node_info *n;
+
+    _setup();
+    canfix_exec(&h, NSM_START + 0x30, 2, data);
+    CHECK(written == 1);
+    CHECK(answer[0] == NSM_ID && answer[1] == 0x30 && answer[3] == 0x01 && answer[4] == 0x02);
+    n = canfix_directory_lookup(&d, 0x30);
+    CHECK(n && n->flags == 0);
+    CHECK(count == 1 && events[0].event == NODE_EVENT_FOUND);
+
+    /* One for another node is neither */
+    data[1] = 0x11;
+    canfix_exec(&h, NSM_START + 0x30, 2, data);
+    CHECK(written == 1);
+}
+
+/* The packets are put in place by number, and the description is finished
+   when every packet up to the terminator is in */
+static void
+test_describe(void) {
+    const char *description = "HELLO WORLD";
+    canfix_node_info *n;
+
+    _setup();
+    _describe(0x30, 2, description, 4);
+    _describe(0x30, 0, description, 4);
+    n = canfix_directory_lookup(&d, 0x30);
+    CHECK(n && ! (n->flags & NODE_DESCRIBED));
+    CHECK(count == 1);
+    _describe(0x30, 1, description, 4);
+    CHECK(n && (n->flags & NODE_DESCRIBED) && strcmp(n->description, description) == 0);
+    CHECK(count == 2 && events[1].event == NODE_EVENT_DESCRIBED);
+
+    /* Repeats don't finish it again */
+    _describe(0x30, 1, description, 4);
+    CHECK(count == 2);
+}
+
+/* An FD frame carries fifteen packets at once, numbered by the first */
+static void
+test_describe_fd(void) {
+    const char *description = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz.,;:!?()";
+    canfix_node_info *n;
+
+    _setup();
+    _describe(0x31, 15, description, 12);
+    n = canfix_directory_lookup(&d, 0x31);
+    CHECK(n && ! (n->flags & NODE_DESCRIBED));
+    _describe(0x31, 0, description, 60);
+    CHECK(n && (n->flags & NODE_DESCRIBED) && strcmp(n->description, description) == 0);
+    CHECK(n && n->desc_end == strlen(description) / 4 + 1);
+}
+
+/* The description frames that the bus carried in the last exchange */
+static int desc_frames;
+static int desc_bad_length;
+
+static int
+_watch(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data) {
+    (void)from;
+    if(id >= NSM_START && id < CH_START && data[0] == NSM_DESC) {
+        desc_frames++;
+        if(length != canfix_fd_length(length) || length < 5) desc_bad_length++;
+    }
+    return 0;
+}
+
+/* A node asked for its identification in FD sends its description fifteen
+   packets to a frame.  The lengths around the 60 character boundary of
+   each frame all come through whole, with the terminator in the last
+   frame. */
+static void
+test_fd_boundary(void) {
+    static const int lengths[] = {0, 1, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 65, 119, 120, 121, 127};
+    char description[CANFIX_DESC_LEN];
+    canfix_object node;
+    canfix_node_info *n;
+    bus_t bus;
+
+    for(unsigned i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        int length = lengths[i];
+
+        _setup();
+        bus_init(&bus);
+        bus_attach_fd(&bus, &h);
+        canfix_init(&node, 0x40, 0, 0, 0);
+        bus_attach_fd(&bus, &node);
+        bus.drop = _watch;
+        for(int c = 0; c < length; c++) description[c] = 'A' + c % 26;
+        description[length] = '\0';
+        canfix_set_description(&node, description);
+        desc_frames = desc_bad_length = 0;
+
+        canfix_directory_discover(&d, 0x40);
+        bus_run(&bus, BUS_QUEUE);
+        n = canfix_directory_lookup(&d, 0x40);
+        CHECK(n && (n->flags & NODE_DESCRIBED));
+        CHECK(n && strcmp(n->description, description) == 0);
+        CHECK(desc_frames == length / 60 + 1);
+        CHECK(desc_bad_length == 0);
+    }
+}
+
+/* A node is lost after CANFIX_NODE_TIMEOUT of silence, once, and found
+   again when it is heard from */
+static void
+test_lost(void) {
+    canfix_node_info *n;
+    uint32_t t;
+
+    _setup();
+    _parameter(0x30);
+    n = canfix_directory_lookup(&d, 0x30);
+    for(t = 1000; t < CANFIX_NODE_TIMEOUT; t += 1000) canfix_tick(&h, t);
+    CHECK(n && ! (n->flags & NODE_LOST));
+    CHECK(count == 1);
+    canfix_tick(&h, CANFIX_NODE_TIMEOUT);
+    CHECK(n && (n->flags & NODE_LOST));
+    CHECK(count == 2 && events[1].event == NODE_EVENT_LOST);
+    canfix_tick(&h, CANFIX_NODE_TIMEOUT + 1000);
+    canfix_tick(&h, CANFIX_NODE_TIMEOUT + 2000);
+    CHECK(count == 2);
+
+    _parameter(0x30);
+    CHECK(n && ! (n->flags & NODE_LOST));
+    CHECK(count == 3 && events[2].event == NODE_EVENT_FOUND);
+}
+
+/* When the directory is full a new node takes the slot of the node that has
+   been lost the longest, and is left out if none are lost */
+static void
+test_full(void) {
+    canfix_node_info *first, *second;
+
+    _setup();
+    for(uint8_t node = 0x31; node <= 0x34; node++) _parameter(node);
+    _parameter(0x35);
+    CHECK(canfix_directory_lookup(&d, 0x35) == NULL);
+    first = canfix_directory_lookup(&d, 0x31);
+    second = canfix_directory_lookup(&d, 0x32);
+
+    /* 0x31 goes quiet first, then 0x32 */
+    canfix_tick(&h, 1000);
+    _parameter(0x32);
+    for(uint32_t t = 2000; t <= CANFIX_NODE_TIMEOUT + 1000; t += 1000) {
+        canfix_tick(&h, t);
+        _parameter(0x33);
+        _parameter(0x34);
+    }
+    CHECK(first->flags & NODE_LOST);
+    CHECK(second->flags & NODE_LOST);
+
+    _parameter(0x35);
+    CHECK(canfix_directory_lookup(&d, 0x31) == NULL);
+    CHECK(canfix_directory_lookup(&d, 0x35) == first);
+    CHECK(first->flags == 0 && first->node == 0x35);
+    _parameter(0x36);
+    CHECK(canfix_directory_lookup(&d, 0x32) == NULL);
+    CHECK(canfix_directory_lookup(&d, 0x36) == second);
+    _parameter(0x37);
+    CHECK(canfix_directory_lookup(&d, 0x37) == NULL);
+    CHECK(d.count == CANFIX_DIRECTORY_SIZE);
+}
+
+int
+main(void) {
+    test_identify();
+    test_request();
+    test_describe();
+    test_describe_fd();
+    test_fd_boundary();
+    test_lost();
+    test_full();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,119 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the Disable and Enable Parameter messages
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+static canfix_object h;
+static uint16_t last_id;
+static uint8_t last[8];
+static int written;
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    last_id = id;
+    memcpy(last, data, length);
+    written++;
+    return 0;
+}
+
+static void
+_setup(void) {
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_set_write_callback(&h, _write);
+    written = 0;
+}
+
+/* Sends a Disable or Enable message from node 0x30 for a type */
+static void
+_message(uint8_t code, uint8_t dest, uint16_t type) {
+    uint8_t data[4] = {code, dest, type, type >> 8};
+
+    canfix_exec(&h, NSM_START + 0x30, 4, data);
+}
+
+static int
+_send(uint16_t type) {
+    canfix_parameter par;
+
+    memset(&par, 0, sizeof(par));
+    par.type = type;
+    par.length = 2;
+    return canfix_send_parameter(&h, par);
+}
+
+/* A disabled type isn't sent until it is enabled again, and each message
+   is answered */
+static void
+test_disable(void) {
+    _setup();
+    CHECK(_send(0x180) == 0 && written == 1);
+
+    _message(NSM_DISABLE, 0x10, 0x180);
+    CHECK(written == 2 && last_id == NSM_START + 0x10);
+    CHECK(last[0] == NSM_DISABLE && last[1] == 0x30 && last[2] == 0x00);
+    CHECK(! canfix_parameter_enabled(&h, 0x180));
+    CHECK(_send(0x180) == CANFIX_PARAM_DISABLED && written == 2);
+    CHECK(_send(0x181) == 0 && written == 3);
+
+    _message(NSM_ENABLE, 0x10, 0x180);
+    CHECK(written == 4 && last[0] == NSM_ENABLE && last[2] == 0x00);
+    CHECK(_send(0x180) == 0 && written == 5 && last_id == 0x180);
+}
+
+/* A broadcast Disable is applied without an answer, and a broadcast Enable
+   is ignored */
+static void
+test_broadcast(void) {
+    _setup();
+    _message(NSM_DISABLE, 0x00, 0x200);
+    CHECK(written == 0);
+    CHECK(_send(0x200) == CANFIX_PARAM_DISABLED);
+
+    _message(NSM_ENABLE, 0x00, 0x200);
+    CHECK(written == 0);
+    CHECK(_send(0x200) == CANFIX_PARAM_DISABLED);
+
+    /* Messages for other nodes are left alone too */
+    _message(NSM_DISABLE, 0x11, 0x201);
+    CHECK(written == 0);
+    CHECK(_send(0x201) == 0);
+}
+
+/* Types that aren't parameters can't be disabled and the answer says so */
+static void
+test_not_parameter(void) {
+    _setup();
+    _message(NSM_DISABLE, 0x10, 0x050);
+    CHECK(written == 1 && last[0] == NSM_DISABLE && last[2] == 0x01);
+    _message(NSM_ENABLE, 0x10, 0x7F0);
+    CHECK(written == 2 && last[0] == NSM_ENABLE && last[2] == 0x01);
+    CHECK(canfix_parameter_enabled(&h, 0x050));
+}
+
+int
+main(void) {
+    test_disable();
+    test_broadcast();
+    test_not_parameter();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,159 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests gateways forwarding frames between two buses
+ */
+
+#include <string.h>
+
+#include "bus.h"
+#include "check.h"
+
+static bus_t bus_a, bus_b;
+static canfix_object n1, n2, g1a, g1b, g2a, g2b;
+static canfix_gateway g1, g2;
+
+/* The last frame seen on each bus with the ID being watched there */
+static uint16_t watch_a, watch_b;
+static int seen_a, seen_b;
+static uint8_t last_a[8], last_b[8];
+
+static int
+_watch_a(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data) {
+    if(id == watch_a) {
+        seen_a++;
+        memcpy(last_a, data, length);
+    }
+    return 0;
+}
+
+static int
+_watch_b(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data) {
+    if(id == watch_b) {
+        seen_b++;
+        memcpy(last_b, data, length);
+    }
+    return 0;
+}
+
+static void
+_setup(void) {
+    bus_init(&bus_a);
+    bus_init(&bus_b);
+    bus_a.drop = _watch_a;
+    bus_b.drop = _watch_b;
+    canfix_init(&n1, 0x20, 0, 0, 0);
+    canfix_init(&n2, 0x30, 0, 0, 0);
+    canfix_init(&g1a, 0xF0, 0, 0, 0);
+    canfix_init(&g1b, 0xF0, 0, 0, 0);
+    canfix_init(&g2a, 0xF1, 0, 0, 0);
+    canfix_init(&g2b, 0xF1, 0, 0, 0);
+    bus_attach(&bus_a, &n1);
+    bus_attach(&bus_a, &g1a);
+    bus_attach(&bus_a, &g2a);
+    bus_attach(&bus_b, &n2);
+    bus_attach(&bus_b, &g1b);
+    bus_attach(&bus_b, &g2b);
+    canfix_gateway_init(&g1);
+    canfix_gateway_init(&g2);
+    CHECK(canfix_gateway_attach(&g1, &g1a) == 0);
+    CHECK(canfix_gateway_attach(&g1, &g1b) == 1);
+    CHECK(canfix_gateway_attach(&g2, &g2a) == 0);
+    CHECK(canfix_gateway_attach(&g2, &g2b) == 1);
+    seen_a = seen_b = 0;
+}
+
+static void
+_run(uint32_t ms) {
+    while(ms--) {
+        bus_tick(&bus_a, 1);
+        bus_tick(&bus_b, 1);
+    }
+}
+
+/* Sends a frame from an object as if the library had */
+static void
+_send(canfix_object *h, uint16_t id, uint8_t length, uint8_t *data) {
+    h->cb->write_callback(id, length, data);
+}
+
+/* One gateway forwards A to B and the other B to A, so every frame would go
+   around forever if the gateways only caught their own echoes */
+static void
+test_loop(void) {
+    canfix_route r1 = {0, 1, 0, 0x7FF, 0, 0, 0};
+    canfix_route r2 = {1, 0, 0, 0x7FF, 0, 0, 0};
+    uint8_t data[5] = {0x20, 0, 0, 0x34, 0x12};
+
+    _setup();
+    CHECK(canfix_gateway_compile(&g1, &r1, 1) == 0);
+    CHECK(canfix_gateway_compile(&g2, &r2, 1) == 0);
+    watch_a = watch_b = 0x183;
+    _send(&n1, 0x183, 5, data);
+    _run(200);
+    /* Once from n1 and once more from the second gateway */
+    CHECK(seen_a == 2);
+    CHECK(seen_b == 1);
+    CHECK(g1.forwarded == 1 && g1.echoes == 1);
+    CHECK(g2.forwarded == 1);
+
+    /* The same frame again after the gateways have forgotten it */
+    _send(&n1, 0x183, 5, data);
+    _run(200);
+    CHECK(seen_a == 4 && seen_b == 2);
+
+    /* And from the other side */
+    data[0] = 0x30;
+    _send(&n2, 0x183, 5, data);
+    _run(200);
+    CHECK(seen_a == 5 && seen_b == 4);
+}
+
+/* A request for a remapped node has the node it is for changed as well as
+   the node it is from */
+static void
+test_remap(void) {
+    canfix_route r[2] = {
+        {0, 1, 0, 0x7FF, 0x20, 0x60, 0},
+        {1, 0, 0, 0x7FF, 0x60, 0x20, 0},
+    };
+    uint8_t data[2] = {NSM_ID, 0x60};
+
+    _setup();
+    CHECK(canfix_gateway_compile(&g1, r, 2) == 0);
+    watch_a = NSM_START + 0x30;
+    watch_b = NSM_START + 0x60;
+    _send(&n2, NSM_START + 0x30, 2, data);
+    _run(10);
+    CHECK(seen_a == 1 && last_a[1] == 0x20);
+    /* n1 answers as 0x20 and is seen on B as 0x60 */
+    CHECK(seen_b == 1 && last_b[0] == NSM_ID && last_b[1] == 0x30);
+
+    /* Broadcasts stay broadcasts */
+    seen_a = seen_b = 0;
+    data[1] = 0;
+    _send(&n2, NSM_START + 0x30, 2, data);
+    _run(10);
+    CHECK(seen_a == 1 && last_a[1] == 0);
+}
+
+int
+main(void) {
+    test_loop();
+    test_remap();
+    return CHECK_RESULT();
+}
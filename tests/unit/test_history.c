@@ -0,0 +1,106 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the summaries of a parameter's history.  It is built
+ *  with short tiers so that a few minutes of values fill them.
+ */
+
+#include <math.h>
+
+#include "check.h"
+#include "canfix.h"
+
+#define TYPE 0x183
+
+static canfix_object h;
+static canfix_cache cache;
+static canfix_history hist;
+
+static void
+_setup(void) {
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_cache_init(&cache, &h);
+    CHECK(canfix_history_subscribe(&cache, &hist, TYPE, 0x20, 0, CANFIX_TYPE_UINT, 1.0f) != NULL);
+}
+
+/* Gives the value to the object every 100ms from from up to and including to */
+static void
+_feed(uint32_t from, uint32_t to, uint16_t value) {
+    uint8_t data[5] = {0x20, 0, 0, value & 0xFF, value >> 8};
+
+    for(uint32_t t = from; t <= to; t += 100) {
+        canfix_tick(&h, t);
+        canfix_exec(&h, TYPE, 5, data);
+    }
+}
+
+static int
+_near(float a, float b) {
+    return fabsf(a - b) < 0.001f * fabsf(b);
+}
+
+/* A window short enough for the raw values */
+static void
+test_raw(void) {
+    canfix_history_summary s;
+
+    _setup();
+    _feed(0, 10000, 10);
+    _feed(10100, 10500, 1000);
+    CHECK(canfix_history_window(&hist, 10500, 2000, &s) == 0);
+    CHECK(s.min == 10 && s.max == 1000);
+    CHECK(s.count == 20);
+    CHECK(_near(s.avg, (15 * 10 + 5 * 1000) / 20.0f));
+}
+
+/* A window from the 10s tier has to take in the 1s sample that is still
+   being built as well as its own */
+static void
+test_tier_10s(void) {
+    canfix_history_summary s;
+
+    _setup();
+    _feed(0, 299900, 10);
+    _feed(300000, 300500, 1000);
+    CHECK(canfix_history_window(&hist, 300500, 100000, &s) == 0);
+    CHECK(s.min == 10);
+    CHECK(s.max == 1000);
+    /* 200s to 280s in the tier, 290s to 299.9s in its sample and six
+       values since 300s */
+    CHECK(s.count == 900 + 100 + 6);
+    CHECK(_near(s.avg, (1000 * 10 + 6 * 1000) / 1006.0f));
+    CHECK(s.first == 200000);
+}
+
+/* An empty window has no summary */
+static void
+test_empty(void) {
+    canfix_history_summary s;
+
+    _setup();
+    CHECK(canfix_history_window(&hist, 1000, 1000, &s) == -1);
+    CHECK(isinf(s.min) && s.min > 0);
+    CHECK(isinf(s.max) && s.max < 0);
+}
+
+int
+main(void) {
+    test_raw();
+    test_tier_10s();
+    test_empty();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,114 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the C++ interface in canfix.hpp
+ */
+
+#include <vector>
+
+#include "check.h"
+#include "canfix.hpp"
+
+/* Remembers what each node was called with */
+struct Handlers {
+    std::vector<uint16_t> written;
+    std::vector<uint16_t> parameters;
+    uint16_t value = 0;
+    uint8_t node_set = 0;
+
+    int write(uint16_t id, std::span<const uint8_t> data) {
+        written.push_back(id);
+        return 0;
+    }
+    void on_parameter(const canfix::Parameter &par) {
+        parameters.push_back(par.type());
+        value = par.as<uint16_t>();
+    }
+    void on_node_set(uint8_t node) {
+        node_set = node;
+    }
+};
+
+/* Only the write handler, which is all a node has to have */
+struct Minimal {
+    int write(uint16_t, std::span<const uint8_t>) { return 0; }
+};
+
+static void
+test_parameter(void) {
+    canfix::Node<Handlers> a(0x10, 1, 1, 0);
+    uint8_t frame[5] = {0x20, 0, 0, 0x34, 0x12};
+
+    a.exec(0x183, 5, frame);
+    CHECK(a.handlers().parameters.size() == 1 && a.handlers().parameters[0] == 0x183);
+    CHECK(a.handlers().value == 0x1234);
+
+    canfix::Parameter par(0x184, 0);
+    par.set<uint16_t>(0x5678);
+    CHECK(a.send_parameter(par) == 0);
+    CHECK(a.handlers().written.size() == 1 && a.handlers().written[0] == 0x184);
+    CHECK(par.as<uint16_t>() == 0x5678 && par.data().size() == 2);
+}
+
+/* Callbacks reach the node that they are for, whichever was made last and
+   whether or not they come from one of its own methods */
+static void
+test_context(void) {
+    canfix::Node<Handlers> a(0x10, 1, 1, 0);
+    canfix::Node<Handlers> b(0x11, 1, 1, 0);
+    canfix::Node<Minimal> m(0x12, 1, 1, 0);
+    uint8_t set[3] = {NSM_NODE_SET, 0x10, 0x30};
+
+    CHECK(canfix_get_context(a.c()) == &a);
+    a.exec(NSM_START + 0x40, 3, set);
+    CHECK(a.handlers().node_set == 0x30 && b.handlers().node_set == 0);
+    CHECK(a.node() == 0x30 && b.node() == 0x11);
+    CHECK(a.handlers().written.size() == 1 && b.handlers().written.empty());
+
+    /* Straight through the C interface, outside of any Node method */
+    canfix_send_identification(a.c(), 0x40);
+    CHECK(a.handlers().written.size() == 2 && b.handlers().written.empty());
+    canfix_send_identification(m.c(), 0x40);
+    CHECK(a.handlers().written.size() == 2 && b.handlers().written.empty());
+}
+
+/* A gateway sends the frames that one node receives out through the other */
+static void
+test_gateway(void) {
+    canfix::Node<Handlers> a(0xF0, 1, 1, 0);
+    canfix::Node<Handlers> b(0xF0, 1, 1, 0);
+    canfix_gateway g;
+    canfix_route r = {0, 1, 0x100, 0x6DF, 0, 0, 0};
+    uint8_t frame[5] = {0x20, 0, 0, 0x34, 0x12};
+
+    canfix_gateway_init(&g);
+    CHECK(canfix_gateway_attach(&g, a.c()) == 0);
+    CHECK(canfix_gateway_attach(&g, b.c()) == 1);
+    CHECK(canfix_gateway_compile(&g, &r, 1) == 0);
+    a.exec(0x183, 5, frame);
+    CHECK(a.handlers().parameters.size() == 1 && a.handlers().written.empty());
+    CHECK(b.handlers().written.size() == 1 && b.handlers().written[0] == 0x183);
+    CHECK(b.handlers().parameters.empty());
+}
+
+int
+main(void) {
+    test_parameter();
+    test_context();
+    test_gateway();
+    return CHECK_RESULT();
+}
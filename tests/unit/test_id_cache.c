@@ -0,0 +1,174 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file checks that the identification answers sent from the cache
+ *  are the frames the protocol asks for
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+#define LOG 128
+
+static canfix_object h;
+static canfix_frame sent[LOG];
+static int count;
+
+static char desc_short[] = "ABC";
+static char desc_four[] = "ABCD";
+static char desc_long[] = "Engine monitor, six cylinders, EGT and CHT on every cylinder, two fuel flow transducers";
+static char desc_huge[200];
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    if(count < LOG) {
+        sent[count].id = id;
+        sent[count].length = length;
+        memcpy(sent[count].data, data, length);
+    }
+    count++;
+    return 0;
+}
+
+static int
+_batch(const canfix_frame *frames, uint16_t n) {
+    for(uint16_t i = 0; i < n; i++) _write(frames[i].id, frames[i].length, (uint8_t *)frames[i].data);
+    return 0;
+}
+
+static const canfix_callbacks batch_table = {
+    .write_callback = _write,
+    .batch_write_callback = _batch,
+};
+
+static void
+_setup(uint8_t node) {
+    canfix_init(&h, node, 0x11, 0x22, 0x334455);
+    canfix_set_write_callback(&h, _write);
+    count = 0;
+}
+
+static void
+_request(uint8_t from, uint8_t to) {
+    uint8_t data[2] = {NSM_ID, to};
+
+    canfix_exec(&h, NSM_START + from, 2, data);
+}
+
+/* Checks the log against an answer built straight from the protocol */
+static int
+_answer_ok(int first, uint8_t node, uint8_t dest, const char *description) {
+    int length = description ? strlen(description) : 0;
+    int packets = description ? length / 4 + 1 : 0;
+    canfix_frame *f = &sent[first];
+    uint8_t id[8] = {NSM_ID, dest, 1, 0x11, 0x22, 0x55, 0x44, 0x33};
+
+    if(count - first != 1 + packets) return 0;
+    if(f->id != NSM_START + node || f->length != 8 || memcmp(f->data, id, 8)) return 0;
+    for(int p = 0; p < packets; p++) {
+        f = &sent[first + 1 + p];
+        if(f->id != NSM_START + node || f->length != 8) return 0;
+        if(f->data[0] != NSM_DESC || f->data[1] != dest || f->data[2] != p || f->data[3] != 0) return 0;
+        for(int i = 0; i < 4; i++) {
+            if(f->data[4 + i] != (p * 4 + i < length ? description[p * 4 + i] : 0)) return 0;
+        }
+    }
+    return 1;
+}
+
+/* Direct requests with descriptions of several lengths, including one too
+   long for the cache that is sent from the string */
+static void
+test_direct(void) {
+    char *descs[] = {NULL, desc_short, desc_four, desc_long, desc_huge};
+
+    memset(desc_huge, 'x', sizeof(desc_huge) - 1);
+    for(int n = 0; n < 5; n++) {
+        _setup(0x30);
+        canfix_set_description(&h, descs[n]);
+        _request(0x01, 0x30);
+        CHECK(_answer_ok(0, 0x30, 0x01, descs[n]));
+        count = 0;
+        _request(0x02, 0x30);
+        CHECK(_answer_ok(0, 0x30, 0x02, descs[n]));
+    }
+}
+
+/* The whole answer goes to the batch write callback with the right
+   destination, and the next answer isn't affected by the last */
+static void
+test_batch(void) {
+    _setup(0x30);
+    canfix_set_callbacks(&h, &batch_table);
+    canfix_set_description(&h, desc_long);
+    _request(0x05, 0);
+    CHECK(_answer_ok(0, 0x30, 0x05, desc_long));
+    count = 0;
+    _request(0x06, 0x30);
+    CHECK(_answer_ok(0, 0x30, 0x06, desc_long));
+}
+
+/* A Node Set message rebuilds the frames for the new node number */
+static void
+test_node_set(void) {
+    uint8_t data[3] = {NSM_NODE_SET, 0x30, 0x31};
+
+    _setup(0x30);
+    canfix_set_description(&h, desc_long);
+    canfix_exec(&h, NSM_START + 0x01, 3, data);
+    CHECK(canfix_get_node(&h) == 0x31);
+    count = 0;
+    _request(0x01, 0x31);
+    CHECK(_answer_ok(0, 0x31, 0x01, desc_long));
+    canfix_set_node(&h, 0x32);
+    count = 0;
+    _request(0x01, 0x32);
+    CHECK(_answer_ok(0, 0x32, 0x01, desc_long));
+}
+
+/* A deferred answer that is cut across ticks finishes with the description
+   it started with when a new one is set part way through */
+static void
+test_deferred(void) {
+    uint32_t now = 0;
+
+    _setup(0x30);
+    canfix_set_response_jitter(&h, CANFIX_JITTER_SLOT, 100);
+    canfix_set_description(&h, desc_long);
+    _request(0x01, 0);
+    while(count == 0) canfix_tick(&h, ++now);
+    CHECK(count < 23);
+    canfix_set_description(&h, desc_short);
+    for(int n = 0; n < 100; n++) canfix_tick(&h, ++now);
+    CHECK(_answer_ok(0, 0x30, 0x01, desc_long));
+
+    count = 0;
+    _request(0x02, 0);
+    for(int n = 0; n < 200; n++) canfix_tick(&h, ++now);
+    CHECK(_answer_ok(0, 0x30, 0x02, desc_short));
+}
+
+int
+main(void) {
+    test_direct();
+    test_batch();
+    test_node_set();
+    test_deferred();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,147 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the response jitter for broadcast requests
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+static canfix_object h;
+static int ids;
+static int descs;
+static int reports;
+
+static char description[] = "Forty characters of description text....";
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    (void)id;
+    (void)length;
+    if(data[0] == NSM_ID) ids++;
+    if(data[0] == NSM_DESC) descs++;
+    return 0;
+}
+
+static void
+_report(void) {
+    reports++;
+}
+
+static void
+_setup(uint8_t node, uint8_t mode, uint16_t window) {
+    canfix_init(&h, node, 0, 0, 0);
+    canfix_set_write_callback(&h, _write);
+    canfix_set_report_callback(&h, _report);
+    canfix_set_response_jitter(&h, mode, window);
+    ids = descs = reports = 0;
+}
+
+static void
+_request(uint8_t code, uint8_t dest) {
+    uint8_t data[2] = {code, dest};
+
+    canfix_exec(&h, NSM_START + 0x30, 2, data);
+}
+
+/* Ticks a millisecond at a time until the answer goes out.  Returns the
+   delay or -1 if it didn't within limit. */
+static int
+_delay(uint32_t start, int limit) {
+    for(int n = 0; n <= limit; n++) {
+        canfix_tick(&h, start + n);
+        if(ids) return n;
+    }
+    return -1;
+}
+
+/* Each node answers in its own slot of the window */
+static void
+test_slot(void) {
+    for(int node = 1; node < 128; node++) {
+        _setup(node, CANFIX_JITTER_SLOT, 100);
+        canfix_tick(&h, 1000);
+        _request(NSM_ID, 0);
+        CHECK(ids == 0);
+        CHECK(_delay(1000, 100) == node * CANFIX_DEFER_SLOT % 100);
+    }
+}
+
+/* Random delays stay inside the window and don't all land together */
+static void
+test_random(void) {
+    int delay, low = 1000, high = -1;
+    uint32_t t = 0;
+
+    _setup(0x25, CANFIX_JITTER_RANDOM, 50);
+    for(int n = 0; n < 200; n++) {
+        ids = 0;
+        _request(NSM_ID, 0);
+        delay = _delay(t, 50);
+        CHECK(delay >= 0 && delay < 50);
+        if(delay < low) low = delay;
+        if(delay > high) high = delay;
+        t += 100;
+        canfix_tick(&h, t);
+    }
+    CHECK(high - low > 25);
+}
+
+/* A repeat of a broadcast that is still waiting is dropped, and requests
+   sent to us directly aren't put off */
+static void
+test_duplicate(void) {
+    _setup(0x25, CANFIX_JITTER_SLOT, 200);
+    _request(NSM_ID, 0);
+    _request(NSM_ID, 0);
+    _request(NSM_REPORT, 0);
+    _request(NSM_REPORT, 0);
+    CHECK(ids == 0 && reports == 0);
+    _request(NSM_ID, 0x25);
+    CHECK(ids == 1);
+    for(uint32_t t = 0; t <= 400; t += 10) canfix_tick(&h, t);
+    CHECK(ids == 2 && reports == 1);
+}
+
+/* The description goes out CANFIX_DEFER_BURST frames per tick */
+static void
+test_burst(void) {
+    int frames = 1 + (int)strlen(description) / 4 + 1, sent = 0, ticks = 0;
+
+    _setup(0x25, CANFIX_JITTER_SLOT, 100);
+    canfix_set_description(&h, description);
+    _request(NSM_ID, 0);
+    for(uint32_t t = 0x25 * CANFIX_DEFER_SLOT % 100; sent < frames && ticks < 100; t++) {
+        canfix_tick(&h, t);
+        CHECK(ids + descs - sent == (frames - sent < CANFIX_DEFER_BURST ? frames - sent : CANFIX_DEFER_BURST));
+        sent = ids + descs;
+        ticks++;
+    }
+    CHECK(ids == 1 && descs == frames - 1);
+    CHECK(ticks == (frames + CANFIX_DEFER_BURST - 1) / CANFIX_DEFER_BURST);
+}
+
+int
+main(void) {
+    test_slot();
+    test_random();
+    test_duplicate();
+    test_burst();
+    return CHECK_RESULT();
+}
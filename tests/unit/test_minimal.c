@@ -0,0 +1,127 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the smallest build, CANFIX_MINIMAL with the callbacks
+ *  given only as a const table
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+static canfix_object h;
+static uint16_t last_id;
+static uint8_t last_length;
+static uint8_t last[8];
+static int written;
+static canfix_parameter received;
+static int parameters;
+static void *contexts[2];
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    last_id = id;
+    last_length = length;
+    memcpy(last, data, length);
+    written++;
+    return 0;
+}
+
+static void
+_parameter(canfix_parameter par) {
+    received = par;
+    parameters++;
+}
+
+static int
+_write_ctx(void *context, uint16_t id, uint8_t length, uint8_t *data) {
+    contexts[0] = context;
+    return _write(id, length, data);
+}
+
+static void
+_parameter_ctx(void *context, canfix_parameter par) {
+    contexts[1] = context;
+    _parameter(par);
+}
+
+static const canfix_callbacks table = {
+    .write_callback = _write,
+    .parameter_callback = _parameter,
+};
+
+static const canfix_callbacks ctx_table = {
+    .write_ctx_callback = _write_ctx,
+    .parameter_ctx_callback = _parameter_ctx,
+};
+
+static void
+_setup(const canfix_callbacks *cb) {
+    canfix_init(&h, 0x10, 0x11, 0x22, 0x334455);
+    canfix_set_callbacks(&h, cb);
+    written = parameters = 0;
+}
+
+/* A Node Identification request is answered through the table */
+static void
+_identify(void) {
+    uint8_t data[2] = {NSM_ID, 0x10};
+
+    canfix_exec(&h, NSM_START + 0x30, 2, data);
+    CHECK(written == 1 && last_id == NSM_START + 0x10 && last_length == 8);
+    CHECK(last[0] == NSM_ID && last[1] == 0x30 && last[2] == 1);
+    CHECK(last[3] == 0x11 && last[4] == 0x22 && last[5] == 0x55 && last[6] == 0x44 && last[7] == 0x33);
+}
+
+/* A parameter from another node is decoded and handed over */
+static void
+_receive(void) {
+    uint8_t data[5] = {0x30, 0x02, FCB_QUALITY, 0x34, 0x12};
+
+    canfix_exec(&h, 0x183, 5, data);
+    CHECK(parameters == 1);
+    CHECK(received.type == 0x183 && received.node == 0x30 && received.index == 0x02);
+    CHECK(received.flags == FCB_QUALITY && received.length == 2);
+    CHECK(received.data[0] == 0x34 && received.data[1] == 0x12);
+}
+
+static void
+test_table(void) {
+    _setup(&table);
+    _identify();
+    _receive();
+}
+
+/* The context forms are called with the object's context */
+static void
+test_ctx_table(void) {
+    int context;
+
+    _setup(&ctx_table);
+    canfix_set_context(&h, &context);
+    _identify();
+    _receive();
+    CHECK(contexts[0] == &context && contexts[1] == &context);
+}
+
+int
+main(void) {
+    test_table();
+    test_ctx_table();
+    return CHECK_RESULT();
+}
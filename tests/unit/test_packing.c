@@ -0,0 +1,90 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests asking nodes for packed parameters
+ */
+
+#include <string.h>
+
+#include "bus.h"
+#include "check.h"
+
+static bus_t bus;
+static canfix_object host, a, b;
+static int received[0x800];
+
+static void
+_parameter(canfix_parameter par) {
+    if(bus_current == &host && par.length == 2 && par.data[0] == (par.type & 0xFF)) {
+        received[par.type]++;
+    }
+}
+
+static void
+_setup(void) {
+    bus_init(&bus);
+    canfix_init(&host, 0x10, 0, 0, 0);
+    canfix_init(&a, 0x20, 0, 0, 0);
+    canfix_init(&b, 0x21, 0, 0, 0);
+    bus_attach_fd(&bus, &host);
+    bus_attach_fd(&bus, &a);
+    bus_attach_fd(&bus, &b);
+    canfix_set_parameter_callback(&host, _parameter);
+    memset(received, 0, sizeof(received));
+}
+
+static void
+_send(canfix_object *h, uint16_t type) {
+    canfix_parameter par;
+
+    memset(&par, 0, sizeof(par));
+    par.type = type;
+    par.length = 2;
+    par.data[0] = type & 0xFF;
+    canfix_send_parameter(h, par);
+}
+
+/* A request with a node of zero goes to every node and isn't mistaken for
+   an empty packed frame */
+static void
+test_broadcast(void) {
+    uint32_t frames;
+
+    _setup();
+    CHECK(canfix_request_packing(&host, 0, 1, 5) == 0);
+    bus_tick(&bus, 1);
+    CHECK(a.packing && b.packing);
+    frames = bus.frames;
+    for(uint16_t t = 0x100; t < 0x120; t++) {
+        _send(&a, t);
+        _send(&b, t + 0x100);
+    }
+    bus_tick(&bus, 10);
+    /* 32 parameters of two bytes from each node, ten to a frame */
+    CHECK(bus.frames - frames == 8);
+    for(uint16_t t = 0x100; t < 0x120; t++) CHECK(received[t] == 1 && received[t + 0x100] == 1);
+
+    CHECK(canfix_request_packing(&host, 0x20, 0, 0) == 0);
+    bus_tick(&bus, 1);
+    CHECK(! a.packing && b.packing);
+}
+
+int
+main(void) {
+    test_broadcast();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,115 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests taking frames off of the queue with canfix_poll()
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+#define PARAMS 6
+
+static canfix_object h;
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    return 0;
+}
+
+/* A packed frame from node 0x20 with PARAMS two byte parameters starting
+   at type 0x180 */
+static uint8_t
+_packed(uint8_t *data) {
+    uint8_t pos = 2;
+
+    data[0] = NSM_PACKED;
+    data[1] = 0;
+    for(int n = 0; n < PARAMS; n++) {
+        data[pos] = (0x180 + n) & 0xFF;
+        data[pos + 1] = (0x180 + n) >> 8 | 2 << 3;
+        data[pos + 2] = n;
+        data[pos + 3] = 0;
+        data[pos + 4] = 0x40 + n;
+        data[pos + 5] = 0;
+        pos += 6;
+    }
+    return pos;
+}
+
+/* A packed frame that doesn't fit is finished by the next call, and an
+   alarm too short to hold its code is skipped */
+static void
+test_split(void) {
+    canfix_event ev[4];
+    uint8_t data[64];
+    uint8_t alarm[4] = {0x34, 0x12, 7, 8};
+    uint8_t par[5] = {0x30, 0, 0, 0x11, 0x22};
+    uint8_t len;
+
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_set_write_callback(&h, _write);
+    len = _packed(data);
+    CHECK(canfix_queue_push(&h, NSM_START + 0x20, len, data) == 0);
+    CHECK(canfix_queue_push(&h, 0x20, 1, alarm) == 0);
+    CHECK(canfix_queue_push(&h, 0x20, 4, alarm) == 0);
+    CHECK(canfix_queue_push(&h, 0x190, 5, par) == 0);
+
+    CHECK(canfix_poll(&h, ev, 4) == 4);
+    for(int n = 0; n < 4; n++) {
+        CHECK(ev[n].type == CANFIX_EVENT_PARAMETER && ev[n].node == 0x20);
+        CHECK(ev[n].code == 0x180 + n && ev[n].index == n && ev[n].data[0] == 0x40 + n);
+    }
+
+    CHECK(canfix_poll(&h, ev, 4) == 4);
+    for(int n = 0; n < 2; n++) {
+        CHECK(ev[n].type == CANFIX_EVENT_PARAMETER && ev[n].code == 0x184 + n);
+        CHECK(ev[n].index == 4 + n && ev[n].data[0] == 0x44 + n);
+    }
+    CHECK(ev[2].type == CANFIX_EVENT_ALARM && ev[2].node == 0x20 && ev[2].code == 0x1234);
+    CHECK(ev[2].length == 2 && ev[2].data[0] == 7 && ev[2].data[1] == 8);
+    CHECK(ev[3].type == CANFIX_EVENT_PARAMETER && ev[3].code == 0x190 && ev[3].node == 0x30);
+    CHECK(ev[3].length == 2 && ev[3].data[0] == 0x11);
+
+    CHECK(canfix_poll(&h, ev, 4) == 0);
+}
+
+/* One event at a time walks through the packed frame in order */
+static void
+test_one_at_a_time(void) {
+    canfix_event ev;
+    uint8_t data[64];
+    uint8_t len;
+
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_set_write_callback(&h, _write);
+    len = _packed(data);
+    CHECK(canfix_queue_push(&h, NSM_START + 0x20, len, data) == 0);
+    for(int n = 0; n < PARAMS; n++) {
+        CHECK(canfix_poll(&h, &ev, 1) == 1);
+        CHECK(ev.code == 0x180 + n && ev.data[0] == 0x40 + n);
+    }
+    CHECK(canfix_poll(&h, &ev, 1) == 0);
+}
+
+int
+main(void) {
+    test_split();
+    test_one_at_a_time();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,136 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the receive queue with the frames split into a
+ *  parameter ring and a priority ring
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+#define FRAMES 200
+
+static canfix_object h;
+
+/* The frames of the burst, mostly parameters with alarms, node specific
+   messages and channel frames mixed in */
+static struct {
+    uint16_t id;
+    uint8_t class;
+    uint8_t kept;
+} burst[FRAMES];
+
+static void
+_make_burst(void) {
+    for(int n = 0; n < FRAMES; n++) {
+        if(n % 5 == 2) {
+            burst[n].id = NSM_START + 0x01;
+            burst[n].class = CANFIX_QUEUE_NSM;
+        } else if(n % 11 == 7) {
+            burst[n].id = 0x20;
+            burst[n].class = CANFIX_QUEUE_ALARM;
+        } else if(n % 13 == 4) {
+            burst[n].id = CH_START + 2;
+            burst[n].class = CANFIX_QUEUE_CHANNEL;
+        } else {
+            burst[n].id = 0x180 + n % 7;
+            burst[n].class = CANFIX_QUEUE_PARAMETER;
+        }
+    }
+}
+
+/* Works out which frames a ring of len keeps, the last ones that arrived
+   when the oldest are overwritten or the first ones when the newest are
+   dropped */
+static void
+_model(int priority, int len, uint8_t policy) {
+    int n, seen = 0, total = 0;
+
+    for(n = 0; n < FRAMES; n++) {
+        if((burst[n].class != CANFIX_QUEUE_PARAMETER) == priority) total++;
+    }
+    for(n = 0; n < FRAMES; n++) {
+        if((burst[n].class != CANFIX_QUEUE_PARAMETER) != priority) continue;
+        if(policy == CANFIX_QUEUE_OVERWRITE) {
+            burst[n].kept = seen >= total - len;
+        } else {
+            burst[n].kept = seen < len;
+        }
+        seen++;
+    }
+}
+
+/* Pushes the whole burst with nothing taken off and checks that what is
+   left comes off in the order it arrived and that the losses are counted
+   by class */
+static void
+_run(uint8_t policy) {
+    canfix_queue_stats stats;
+    uint32_t lost[4] = {0, 0, 0, 0};
+    uint8_t data[CANFIX_DATA_LEN];
+    uint8_t length;
+    uint16_t id;
+    int n, overflows = 0, next = 0;
+
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_queue_set_policy(&h, policy);
+    _make_burst();
+    _model(0, CANFIX_QUEUE_LEN, policy);
+    _model(1, CANFIX_QUEUE_PRIORITY_LEN, policy);
+    for(n = 0; n < FRAMES; n++) {
+        data[0] = 0x00;
+        data[1] = n;
+        data[2] = n >> 8;
+        if(canfix_queue_push(&h, burst[n].id, 3, data) == CANFIX_QUEUE_OVERFLOW) overflows++;
+        if(! burst[n].kept) lost[burst[n].class]++;
+    }
+
+    canfix_queue_get_stats(&h, &stats);
+    CHECK(stats.high == CANFIX_QUEUE_LEN);
+    CHECK(stats.priority_high == CANFIX_QUEUE_PRIORITY_LEN);
+    for(n = 0; n < 4; n++) CHECK(stats.overflows[n] == lost[n]);
+    CHECK(lost[CANFIX_QUEUE_PARAMETER] && lost[CANFIX_QUEUE_NSM] && lost[CANFIX_QUEUE_ALARM]);
+    CHECK(overflows == FRAMES - CANFIX_QUEUE_LEN - CANFIX_QUEUE_PRIORITY_LEN);
+
+    while(canfix_queue_pop(&h, &id, &length, data) == 0) {
+        while(next < FRAMES && ! burst[next].kept) next++;
+        CHECK(next < FRAMES && id == burst[next].id && length == 3);
+        CHECK((data[1] | data[2] << 8) == next);
+        next++;
+    }
+    while(next < FRAMES && ! burst[next].kept) next++;
+    CHECK(next == FRAMES);
+}
+
+static void
+test_overwrite(void) {
+    _run(CANFIX_QUEUE_OVERWRITE);
+}
+
+static void
+test_drop_newest(void) {
+    _run(CANFIX_QUEUE_DROP_NEWEST);
+}
+
+int
+main(void) {
+    test_overwrite();
+    test_drop_newest();
+    return CHECK_RESULT();
+}
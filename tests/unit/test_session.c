@@ -0,0 +1,170 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests two way sessions between two nodes
+ */
+
+#include <string.h>
+
+#include "bus.h"
+#include "check.h"
+
+#define TYPE_OK  0x1234
+#define TYPE_BAD 0x0BAD
+
+static bus_t bus;
+static canfix_object a, b;
+static canfix_sessions sa, sb;
+static int events[2][4];   // Events seen by a and b
+static int drop_answers;   // Answers from b to lose
+
+static void
+_event(canfix_session *ss, uint8_t event) {
+    events[bus_current == &b][event]++;
+}
+
+static uint8_t
+_twoway(uint8_t channel, uint16_t type) {
+    return type == TYPE_OK ? 0 : 1;
+}
+
+static int
+_drop(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data) {
+    if(from == &b && id == NSM_START + 0x20 && data[0] == NSM_TWOWAY && length == 3 && drop_answers) {
+        drop_answers--;
+        return 1;
+    }
+    return 0;
+}
+
+static void
+_setup(void) {
+    bus_init(&bus);
+    canfix_init(&a, 0x10, 0, 0, 0);
+    canfix_init(&b, 0x20, 0, 0, 0);
+    bus_attach(&bus, &a);
+    bus_attach(&bus, &b);
+    bus.drop = _drop;
+    canfix_set_twoway_callback(&b, _twoway);
+    canfix_sessions_init(&sa, &a);
+    canfix_sessions_init(&sb, &b);
+    canfix_sessions_set_callback(&sa, _event);
+    canfix_sessions_set_callback(&sb, _event);
+    memset(events, 0, sizeof(events));
+    drop_answers = 0;
+}
+
+/* The request is accepted and data goes both ways on the channel */
+static void
+test_open(void) {
+    canfix_session *s, *r;
+    uint8_t out[3] = {1, 2, 3}, in[8];
+
+    _setup();
+    s = canfix_session_open(&sa, 0x20, TYPE_OK);
+    CHECK(s != NULL && s->state == SESSION_OPENING && s->channel == 0);
+    bus_tick(&bus, 1);
+    CHECK(s->state == SESSION_OPEN);
+    CHECK(events[0][SESSION_EVENT_OPEN] == 1 && events[1][SESSION_EVENT_OPEN] == 1);
+    r = canfix_session_find(&sb, 0x10, 0);
+    CHECK(r != NULL && r->state == SESSION_OPEN && ! r->initiator && r->type == TYPE_OK);
+
+    CHECK(canfix_session_send(&sa, s, out, 3) == 0);
+    bus_tick(&bus, 1);
+    CHECK(canfix_session_read(&sb, r, in, sizeof(in)) == 3 && memcmp(in, out, 3) == 0);
+    out[0] = 9;
+    CHECK(canfix_session_send(&sb, r, out, 1) == 0);
+    bus_tick(&bus, 1);
+    CHECK(canfix_session_read(&sa, s, in, sizeof(in)) == 1 && in[0] == 9);
+    CHECK(canfix_session_read(&sb, r, in, sizeof(in)) == 0);
+    CHECK(events[0][SESSION_EVENT_DATA] == 1 && events[1][SESSION_EVENT_DATA] == 1);
+}
+
+/* A refused request frees the channel and leaves nothing open on b */
+static void
+test_refuse(void) {
+    canfix_session *s;
+
+    _setup();
+    s = canfix_session_open(&sa, 0x20, TYPE_BAD);
+    CHECK(s != NULL);
+    bus_tick(&bus, 1);
+    CHECK(s->state == SESSION_FREE);
+    CHECK(events[0][SESSION_EVENT_REFUSED] == 1 && events[1][SESSION_EVENT_OPEN] == 0);
+    CHECK(canfix_session_find(&sb, 0x10, 0) == NULL);
+    CHECK(sa.used == 0 && sb.used == 0);
+}
+
+/* When b's answer is lost a gives up and asks again.  b still has the
+   session from the first request and says yes without opening another. */
+static void
+test_lost_answer(void) {
+    canfix_session *s;
+
+    _setup();
+    drop_answers = 1;
+    s = canfix_session_open(&sa, 0x20, TYPE_OK);
+    bus_tick(&bus, 1);
+    CHECK(s->state == SESSION_OPENING);
+    CHECK(events[1][SESSION_EVENT_OPEN] == 1);
+    bus_tick(&bus, CANFIX_SESSION_ANSWER);
+    CHECK(s->state == SESSION_FREE && events[0][SESSION_EVENT_REFUSED] == 1);
+
+    s = canfix_session_open(&sa, 0x20, TYPE_OK);
+    CHECK(s != NULL && s->channel == 0);
+    bus_tick(&bus, 1);
+    CHECK(s->state == SESSION_OPEN && events[0][SESSION_EVENT_OPEN] == 1);
+    CHECK(events[1][SESSION_EVENT_OPEN] == 1);
+    CHECK(sb.used == 1);
+}
+
+/* Both ends close a session that has gone quiet, and traffic keeps it
+   open until then */
+static void
+test_idle(void) {
+    canfix_session *s;
+    uint8_t data = 0;
+
+    _setup();
+    s = canfix_session_open(&sa, 0x20, TYPE_OK);
+    bus_tick(&bus, 1);
+    CHECK(s->state == SESSION_OPEN);
+    bus_tick(&bus, CANFIX_SESSION_TIMEOUT / 2);
+    canfix_session_send(&sa, s, &data, 1);
+    bus_tick(&bus, CANFIX_SESSION_TIMEOUT - 10);
+    CHECK(s->state == SESSION_OPEN && canfix_session_find(&sb, 0x10, 0) != NULL);
+    CHECK(events[0][SESSION_EVENT_CLOSED] == 0 && events[1][SESSION_EVENT_CLOSED] == 0);
+    bus_tick(&bus, 20);
+    CHECK(s->state == SESSION_FREE && canfix_session_find(&sb, 0x10, 0) == NULL);
+    CHECK(events[0][SESSION_EVENT_CLOSED] == 1 && events[1][SESSION_EVENT_CLOSED] == 1);
+    CHECK(sa.used == 0 && sb.used == 0);
+
+    /* The channel can be used again right away */
+    s = canfix_session_open(&sa, 0x20, TYPE_OK);
+    CHECK(s != NULL && s->channel == 0);
+    bus_tick(&bus, 1);
+    CHECK(s->state == SESSION_OPEN);
+}
+
+int
+main(void) {
+    test_open();
+    test_refuse();
+    test_lost_answer();
+    test_idle();
+    return CHECK_RESULT();
+}
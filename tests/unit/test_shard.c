@@ -0,0 +1,195 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests which worker of the shard engine handles each frame
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "canfix_shard.h"
+
+#define SHARDS 4
+#define NODE   0x10
+#define PEER   0x40
+
+static canfix_shards e;
+
+static _Atomic uint8_t par_shard[NSM_START];   // Worker plus one
+static _Atomic uint8_t par_node[SHARDS];       // Node number each worker had
+static _Atomic int alarms, alarm_wrong;
+static _Atomic int node_sets, node_set_wrong;
+static _Atomic int writes, write_wrong;
+
+/* The worker that a callback is running on */
+static uint8_t
+_shard(void) {
+    for(uint8_t n = 0; n < SHARDS; n++) {
+        if(pthread_equal(pthread_self(), e.shard[n].thread)) return n;
+    }
+    return 0xFF;
+}
+
+static int
+_write(uint16_t id, uint8_t length, uint8_t *data) {
+    writes++;
+    if(_shard() != CANFIX_SHARD_CONTROL) write_wrong++;
+    return 0;
+}
+
+static void
+_parameter(canfix_parameter par) {
+    uint8_t n = _shard();
+
+    if(n >= SHARDS) return;
+    par_shard[par.type] = n + 1;
+    par_node[n] = canfix_get_node(canfix_shards_object(&e, n));
+}
+
+static void
+_alarm(uint8_t node, uint16_t type, uint8_t *data, uint8_t length) {
+    alarms++;
+    if(_shard() != CANFIX_SHARD_CONTROL) alarm_wrong++;
+}
+
+static void
+_node_set(uint8_t node) {
+    node_sets++;
+    if(_shard() != CANFIX_SHARD_CONTROL) node_set_wrong++;
+}
+
+static void
+_start(void) {
+    canfix_object h;
+
+    canfix_init(&h, NODE, 1, 1, 0);
+    canfix_set_write_callback(&h, _write);
+    canfix_set_parameter_callback(&h, _parameter);
+    canfix_set_alarm_callback(&h, _alarm);
+    canfix_set_node_set_callback(&h, _node_set);
+    CHECK(canfix_shards_init(&e, &h, SHARDS, 1) == 0);
+    CHECK(canfix_shards_start(&e) == 0);
+}
+
+static void
+_stop(void) {
+    canfix_shards_stop(&e);
+    canfix_shards_free(&e);
+}
+
+static uint64_t
+_frames(uint8_t shard) {
+    canfix_shard_stats st;
+
+    canfix_shards_stats(&e, shard, &st);
+    return st.frames;
+}
+
+/* Waits up to two seconds for the workers to have handled count frames */
+static int
+_settle(uint64_t count) {
+    for(int n = 0; n < 2000; n++) {
+        uint64_t total = 0;
+        for(uint8_t s = 0; s < SHARDS; s++) total += _frames(s);
+        if(total >= count) return 1;
+        usleep(1000);
+    }
+    return 0;
+}
+
+static void
+_push(uint16_t id, uint8_t length, uint8_t *data) {
+    while(canfix_shards_push(&e, 0, id, length, data)) usleep(100);
+}
+
+static void
+_parameters(void) {
+    uint8_t data[5] = {PEER, 0, 0, 0x34, 0x12};
+
+    for(uint16_t id = 0x100; id < NSM_START; id++) _push(id, 5, data);
+}
+
+/* Parameters are spread over the workers by ID, everything else goes to
+   the control shard */
+static void
+test_routing(void) {
+    uint8_t data[8] = {PEER, 0, 0x01, 0x02};
+    uint64_t before[SHARDS], count = NSM_START - 0x100 + 0xFF + 100;
+    int used[SHARDS] = {0}, wrong = 0;
+
+    _start();
+    _parameters();
+    for(uint16_t id = 1; id < 0x100; id++) _push(id, 4, data);
+    CHECK(_settle(NSM_START - 0x100 + 0xFF));
+    for(uint16_t id = 0x100; id < NSM_START; id++) {
+        if(par_shard[id] != canfix_shards_shard_of(&e, id) + 1) wrong++;
+        if(par_shard[id]) used[par_shard[id] - 1] = 1;
+    }
+    CHECK(wrong == 0);
+    for(uint8_t n = 0; n < SHARDS; n++) CHECK(used[n]);
+    CHECK(alarms == 0xFF && alarm_wrong == 0);
+
+    /* Channel frames and node specific messages for other nodes */
+    for(uint8_t n = 0; n < SHARDS; n++) before[n] = _frames(n);
+    for(int n = 0; n < 50; n++) {
+        _push(CH_START + 4, 8, data);
+        data[0] = NSM_ID;
+        data[1] = PEER + 1;
+        _push(NSM_START + PEER, 2, data);
+    }
+    CHECK(_settle(count));
+    CHECK(_frames(CANFIX_SHARD_CONTROL) == before[CANFIX_SHARD_CONTROL] + 100);
+    for(uint8_t n = 1; n < SHARDS; n++) CHECK(_frames(n) == before[n]);
+    CHECK(writes == 0);
+    _stop();
+}
+
+/* A node set message changes the node number of every worker */
+static void
+test_node_set(void) {
+    uint8_t data[3] = {NSM_NODE_SET, NODE, 0x22};
+    uint64_t count = 0;
+    int n, done = 0;
+
+    _start();
+    writes = write_wrong = node_sets = node_set_wrong = 0;
+    _push(NSM_START + PEER, 3, data);
+    CHECK(_settle(++count));
+    /* The other workers pick it up after a while */
+    for(n = 0; n < 200 && ! done; n++) {
+        memset((void *)par_node, 0, sizeof(par_node));
+        _parameters();
+        count += NSM_START - 0x100;
+        CHECK(_settle(count));
+        done = 1;
+        for(uint8_t s = 0; s < SHARDS; s++) if(par_node[s] != 0x22) done = 0;
+    }
+    CHECK(done);
+    CHECK(node_sets == 1 && node_set_wrong == 0);
+    /* The answer comes from the control shard */
+    CHECK(writes == 1 && write_wrong == 0);
+    _stop();
+    CHECK(canfix_get_node(canfix_shards_object(&e, CANFIX_SHARD_CONTROL)) == 0x22);
+}
+
+int
+main(void) {
+    test_routing();
+    test_node_set();
+    return CHECK_RESULT();
+}
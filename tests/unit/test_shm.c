@@ -0,0 +1,101 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the shared memory publication of parameter values
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "check.h"
+#include "canfix_shm.h"
+
+static char name[32];
+
+/* True if the descriptor is still open */
+static int
+_open(int fd) {
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+static void
+test_publish(void) {
+    canfix_shm pub, sub;
+    canfix_shm_value v;
+    canfix_parameter par;
+
+    CHECK(canfix_shm_create(&pub, name, 16) == 0);
+    CHECK(canfix_shm_open(&sub, name) == 0);
+    memset(&par, 0, sizeof(par));
+    par.type = 0x183;
+    par.node = 0x20;
+    par.length = 2;
+    par.data[0] = 0x34;
+    par.data[1] = 0x12;
+    CHECK(canfix_shm_read(&sub, 0x183, 0x20, 0, &v) == -1);
+    CHECK(canfix_shm_publish(&pub, &par, 100) == 0);
+    CHECK(canfix_shm_publish(&pub, &par, 200) == 0);
+    CHECK(canfix_shm_read(&sub, 0x183, 0x20, 0, &v) == 0);
+    CHECK(v.changes == 2 && v.updated == 200 && v.par.data[1] == 0x12);
+    CHECK(canfix_shm_count(&sub) == 1 && canfix_shm_changes(&sub) == 2);
+    canfix_shm_close(&sub);
+    canfix_shm_close(&pub);
+    CHECK(canfix_shm_open(&sub, name) == -1);
+}
+
+/* Failed opens and zeroed handles leave nothing to close, least of all
+   standard input */
+static void
+test_failures(void) {
+    canfix_shm s;
+    char longname[80];
+
+    memset(&s, 0, sizeof(s));
+    canfix_shm_close(&s);
+    CHECK(_open(0));
+
+    CHECK(canfix_shm_open(&s, name) == -1);
+    CHECK(s.fd == -1);
+    canfix_shm_close(&s);
+    CHECK(_open(0));
+
+    memset(longname, 'x', sizeof(longname));
+    longname[0] = '/';
+    longname[64] = '\0';
+    errno = 0;
+    CHECK(canfix_shm_create(&s, longname, 16) == -1 && errno == ENAMETOOLONG);
+    CHECK(s.fd == -1);
+    errno = 0;
+    CHECK(canfix_shm_open(&s, longname) == -1 && errno == ENAMETOOLONG);
+    longname[63] = '\0';
+    CHECK(canfix_shm_create(&s, longname, 16) == 0);
+    CHECK(strcmp(s.name, longname) == 0);
+    canfix_shm_close(&s);
+    canfix_shm_close(&s);
+    CHECK(_open(0));
+}
+
+int
+main(void) {
+    snprintf(name, sizeof(name), "/canfix_test_%d", (int)getpid());
+    test_publish();
+    test_failures();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,125 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the traffic counters
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "canfix.h"
+
+static canfix_object h;
+static canfix_stats s;
+
+static void
+_setup(void) {
+    canfix_init(&h, 0x10, 0, 0, 0);
+    canfix_stats_init(&s, &h, 1);
+}
+
+/* A parameter frame of three bytes from the node */
+static void
+_parameter(uint16_t id, uint8_t node) {
+    uint8_t data[3] = {node, 0, 0};
+
+    canfix_exec(&h, id, 3, data);
+}
+
+/* An empty frame with ID zero is 19 zero bits up to the end of the length,
+ * and the CRC of all zeros is zero, so 34 zero bits in all.  A stuff bit
+ * follows every fifth of them, after bits 5, 10, 15, 20, 25 and 30, and the
+ * delimiters, ACK, end of frame and interframe space add 13: 34 + 6 + 13. */
+static void
+test_frame_bits(void) {
+    uint8_t data[12];
+
+    CHECK(canfix_frame_bits(0x000, 0, data) == 53);
+    /* FD frames are estimated: 28 + 12 * 10 + 23 + 13 */
+    memset(data, 0x55, sizeof(data));
+    CHECK(canfix_frame_bits(0x100, 12, data) == 184);
+}
+
+/* Counts leave the sums once their bucket comes around again */
+static void
+test_rollover(void) {
+    canfix_stats_entry top[2];
+
+    _setup();
+    _parameter(0x180, 0x20);
+    _parameter(0x180, 0x20);
+    canfix_tick(&h, 5000);
+    _parameter(0x180, 0x20);
+    CHECK(canfix_stats_top(&s, top, 1, 0) == 1 && top[0].id == 0x180 && top[0].frames == 3);
+    CHECK(canfix_stats_top(&s, top, 1, 1) == 1 && top[0].id == 0x20 && top[0].frames == 3);
+
+    canfix_tick(&h, (CANFIX_STATS_BUCKETS - 1) * CANFIX_STATS_BUCKET);
+    CHECK(canfix_stats_top(&s, top, 1, 0) == 1 && top[0].frames == 3);
+    canfix_tick(&h, CANFIX_STATS_BUCKETS * CANFIX_STATS_BUCKET);
+    CHECK(canfix_stats_top(&s, top, 1, 0) == 1 && top[0].frames == 1);
+    CHECK(canfix_stats_top(&s, top, 1, 1) == 1 && top[0].frames == 1);
+    canfix_tick(&h, 5000 + CANFIX_STATS_BUCKETS * CANFIX_STATS_BUCKET);
+    CHECK(canfix_stats_top(&s, top, 2, 0) == 0);
+    CHECK(s.bus_bits == 0);
+    CHECK(s.frames == 3);
+}
+
+/* A thousand 53 bit frames in the first second at 125 kbps is 53000 of
+   125000 bits, 42.40% */
+static void
+test_load(void) {
+    _setup();
+    for(int n = 0; n < 1000; n++) canfix_exec(&h, 0x000, 0, NULL);
+    canfix_tick(&h, 1000);
+    CHECK(canfix_stats_load(&s) == 4240);
+    canfix_stats_set_bitrate(&s, 3);
+    CHECK(canfix_stats_load(&s) == 1060);
+    canfix_stats_set_bitrate(&s, 0);
+    CHECK(canfix_stats_load(&s) == 0);
+}
+
+/* The busiest come first, and asking for none fills in nothing */
+static void
+test_top(void) {
+    canfix_stats_entry top[4];
+
+    _setup();
+    _parameter(0x182, 0x21);
+    for(int n = 0; n < 3; n++) _parameter(0x181, 0x22);
+    for(int n = 0; n < 2; n++) _parameter(0x183, 0x23);
+
+    CHECK(canfix_stats_top(&s, top, 4, 0) == 3);
+    CHECK(top[0].id == 0x181 && top[1].id == 0x183 && top[2].id == 0x182);
+    CHECK(top[0].frames == 3 && top[1].frames == 2 && top[2].frames == 1);
+    CHECK(top[0].bits > top[1].bits && top[1].bits > top[2].bits);
+
+    CHECK(canfix_stats_top(&s, top, 2, 1) == 2);
+    CHECK(top[0].id == 0x22 && top[1].id == 0x23);
+
+    memset(top, 0xAA, sizeof(top));
+    CHECK(canfix_stats_top(&s, top, 0, 0) == 0);
+    CHECK(top[0].id == 0xAAAA);
+}
+
+int
+main(void) {
+    test_frame_bits();
+    test_rollover();
+    test_load();
+    test_top();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,186 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the configuration store on the flash simulator, with
+ *  the power cut at every byte of a run of writes that goes through
+ *  several compactions
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "canfix.h"
+#include "check.h"
+#include "flash.h"
+
+#define FLASH   "test_store.flash"
+#define SECTOR  256
+#define SECTORS 3
+#define KEYS    8
+#define WRITES  120
+
+#define IDLE 0 // STORE_IDLE, no compaction running
+
+static canfix_object h;
+static canfix_store store;
+static uint32_t values[KEYS];
+static canfix_config_key table[KEYS];
+
+/* Bytes that can still be written before the power goes, -1 for no limit.
+   The write that runs out is cut short, which is a torn write. */
+static long _budget = -1;
+
+static int
+_write(uint32_t address, const void *data, uint16_t length) {
+    if(_budget < 0) return flash_write(address, data, length);
+    if(length > _budget) {
+        if(_budget) flash_write(address, data, _budget);
+        _budget = 0;
+        return -1;
+    }
+    _budget -= length;
+    return flash_write(address, data, length);
+}
+
+static int
+_erase(uint8_t sector) {
+    if(_budget == 0) return -1;
+    return flash_erase(sector);
+}
+
+static const canfix_store_device _device = {
+    flash_read, _write, _erase, SECTOR, SECTORS
+};
+
+static void
+_blank(void) {
+    unlink(FLASH);
+    CHECK(flash_setup(FLASH, SECTOR, SECTORS) == 0);
+}
+
+/* Starts the node up on whatever is in the flash */
+static int
+_open(void) {
+    canfix_init(&h, 0x10, 0, 0, 0);
+    memset(values, 0, sizeof(values));
+    for(int n = 0; n < KEYS; n++) {
+        table[n].key = 0x0100 + n;
+        table[n].type = CANFIX_TYPE_UDINT;
+        table[n].storage = &values[n];
+    }
+    canfix_set_config_table(&h, table, KEYS);
+    return canfix_store_init(&store, &h, &_device);
+}
+
+/* Write n sets key n % KEYS to n + 1 and the clock ticks after each one so
+   that compactions run along with the writes */
+static int
+_writes(int from, int to) {
+    for(int n = from; n < to; n++) {
+        values[n % KEYS] = n + 1;
+        if(canfix_store_write(&store, 0x0100 + n % KEYS)) return n;
+        canfix_tick(&h, n);
+    }
+    return to;
+}
+
+/* True if the values are what the first count writes left */
+static int
+_after(int count) {
+    uint32_t want[KEYS] = {0};
+
+    for(int n = 0; n < count; n++) want[n % KEYS] = n + 1;
+    return memcmp(values, want, sizeof(want)) == 0;
+}
+
+static void
+test_replay(void) {
+    _blank();
+    CHECK(_open() == 0);
+    CHECK(_writes(0, WRITES) == WRITES);
+    CHECK(_open() == 0);
+    CHECK(_after(WRITES));
+    /* The journal carries on from where it was */
+    CHECK(_writes(WRITES, 2 * WRITES) == 2 * WRITES);
+    CHECK(_open() == 0);
+    CHECK(_after(2 * WRITES));
+    flash_close();
+}
+
+/* A value set while a compaction is copying goes to both sectors */
+static void
+test_compaction(void) {
+    int n;
+
+    _blank();
+    CHECK(_open() == 0);
+    for(n = 0; store.state == IDLE; n++) {
+        values[0] = n + 1;
+        CHECK(canfix_store_write(&store, 0x0100) == 0);
+    }
+    values[1] = 0xAAAA;
+    CHECK(canfix_store_write(&store, 0x0101) == 0);
+    while(store.state != IDLE) canfix_tick(&h, 0);
+    CHECK(store.active == 1 && store.seq == 2);
+    CHECK(_open() == 0);
+    CHECK(values[0] == (uint32_t)n && values[1] == 0xAAAA);
+    flash_close();
+}
+
+/* Cuts the power at every byte of the run.  Afterwards the values have to
+ * be what the writes that were finished left, or that and the one that was
+ * going on when the power went, and the store has to keep working. */
+static void
+test_power_cut(void) {
+    long total;
+    int done;
+
+    _blank();
+    _open();
+    _budget = 1L << 30;
+    _writes(0, WRITES);
+    total = (1L << 30) - _budget;
+    _budget = -1;
+    flash_close();
+
+    for(long cut = 0; cut < total; cut++) {
+        _blank();
+        _open();
+        _budget = cut;
+        done = _writes(0, WRITES);
+        _budget = -1;
+        CHECK(_open() == 0);
+        if(! (_after(done) || _after(done + 1))) {
+            printf("power cut at byte %ld after %d writes\n", cut, done);
+            CHECK(0);
+        }
+        if(! _after(done)) done++;
+        CHECK(_writes(done, done + 40) == done + 40);
+        CHECK(_open() == 0);
+        CHECK(_after(done + 40));
+        flash_close();
+    }
+}
+
+int
+main(void) {
+    test_replay();
+    test_compaction();
+    test_power_cut();
+    unlink(FLASH);
+    return CHECK_RESULT();
+}
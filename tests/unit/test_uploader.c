@@ -0,0 +1,278 @@
+/*  CANFix - An Open Source CANBus based Flight Information Protocol
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  This file tests the firmware uploader against the node side download.  It
+ *  is built a second time with CANFIX_USE_FD, where every object is on the
+ *  bus as an FD node and the blocks go in 64 byte frames.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bus.h"
+#include "check.h"
+
+#define NODES 3
+#define IMAGE 5000
+
+static bus_t bus;
+static canfix_object host;
+static canfix_uploader uploader;
+static canfix_object node[NODES];
+static uint8_t image[IMAGE];
+
+/* What each node has received */
+static struct {
+    uint8_t flash[IMAGE];
+    uint32_t written;
+    uint32_t commits;
+    uint32_t short_commits; // Blocks committed with less than the host sent
+    uint32_t block_start;
+    int status;
+} got[NODES];
+
+static int _done;
+
+static int
+_index(canfix_object *h) {
+    return h - node;
+}
+
+static uint8_t
+_firmware(uint16_t vcode, uint8_t channel) {
+    (void)channel;
+    return vcode == 0x1234 ? 0 : 1;
+}
+
+static uint8_t
+_firmware_write(uint8_t subsystem, uint32_t address, uint8_t *data, uint8_t length) {
+    int n = _index(bus_current);
+
+    (void)subsystem;
+    if(length == 0) {
+        got[n].commits++;
+        if(address - got[n].block_start < 1024 && address != IMAGE) got[n].short_commits++;
+        got[n].block_start = address;
+        return 0;
+    }
+    if(address + length > IMAGE) return 1;
+    memcpy(&got[n].flash[address], data, length);
+    got[n].written += length;
+    return 0;
+}
+
+static void
+_firmware_done(uint8_t status) {
+    got[_index(bus_current)].status = status;
+}
+
+static void
+_upload_done(canfix_upload *t) {
+    (void)t;
+    _done++;
+}
+
+static void
+_attach(canfix_object *h) {
+#ifdef CANFIX_USE_FD
+    bus_attach_fd(&bus, h);
+#else
+    bus_attach(&bus, h);
+#endif
+}
+
+static void
+_setup(void) {
+    bus_init(&bus);
+    memset(got, 0, sizeof(got));
+    canfix_init(&host, 0x01, 0, 0, 0);
+    _attach(&host);
+    canfix_uploader_init(&uploader, &host);
+    canfix_uploader_set_done_callback(&uploader, _upload_done);
+    for(int n = 0; n < NODES; n++) {
+        canfix_init(&node[n], 0x10 + n, 0, 0, 0);
+        _attach(&node[n]);
+        canfix_set_firmware_callback(&node[n], _firmware);
+        canfix_set_firmware_write_callback(&node[n], _firmware_write);
+        canfix_set_firmware_done_callback(&node[n], _firmware_done);
+        got[n].status = -1;
+    }
+    _done = 0;
+}
+
+/* Runs the uploads until they are all finished or a minute goes by */
+static void
+_run(int count) {
+    for(int ms = 0; ms < 60000 && _done < count; ms++) {
+        bus_tick(&bus, 1);
+    }
+}
+
+static void
+_check_node(int n) {
+    CHECK(got[n].status == FW_STATUS_COMPLETE);
+    CHECK(memcmp(got[n].flash, image, IMAGE) == 0);
+    CHECK(got[n].short_commits == 0);
+}
+
+/* Loses one in period of the frames that the filter matches, at random so
+   that a retry isn't lost the same way as the frame before it */
+static int _period;
+static int (*_match)(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data);
+
+static int
+_drop_some(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data) {
+    if(! _match(from, id, length, data)) return 0;
+    return rand() % _period == 0;
+}
+
+static int
+_any_channel(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data) {
+    (void)from; (void)length; (void)data;
+    return id >= CH_START;
+}
+
+static int
+_acks(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data) {
+    (void)from; (void)data;
+    return id >= CH_START && (id - CH_START) % 2 == 1 && length == 5;
+}
+
+static int
+_control(canfix_object *from, uint16_t id, uint8_t length, uint8_t *data) {
+    (void)from; (void)data;
+    /* Requests and their answers, start and end of block and end of transfer */
+    return (id >= NSM_START && id < CH_START && data[0] == NSM_FIRMWARE) ||
+           (id >= CH_START && (length == 0 || length == 1 || length == 7 || length == 8) &&
+            ! ((id - CH_START) % 2 == 0 && length == 8 && data[0] != 0));
+}
+
+static void
+test_one(void) {
+    canfix_upload *t;
+
+    _setup();
+    t = canfix_upload_start(&uploader, 0x10, 0x1234, 0, 0, 0, image, IMAGE);
+    CHECK(t != NULL);
+    _run(1);
+    CHECK(t->status == FW_STATUS_COMPLETE);
+    CHECK(t->retries == 0);
+    CHECK(got[0].commits == (IMAGE + 1023) / 1024);
+    _check_node(0);
+#ifdef CANFIX_USE_FD
+    /* The node answered the FD request in FD, so the data went in frames
+       of up to 63 bytes */
+    CHECK(t->fd);
+    CHECK(t->frames < IMAGE / 7);
+#endif
+}
+
+static void
+test_refused(void) {
+    canfix_upload *t;
+
+    _setup();
+    t = canfix_upload_start(&uploader, 0x10, 0x9999, 0, 0, 0, image, IMAGE);
+    _run(1);
+    CHECK(t->status == FW_STATUS_ERROR);
+    CHECK(got[0].written == 0);
+}
+
+static void
+test_parallel(int (*match)(canfix_object *, uint16_t, uint8_t, uint8_t *), int period) {
+    canfix_upload *t[NODES];
+    uint32_t retries = 0;
+
+    _setup();
+    if(match) {
+        _match = match;
+        _period = period;
+        bus.drop = _drop_some;
+    }
+    for(int n = 0; n < NODES; n++) {
+        t[n] = canfix_upload_start(&uploader, 0x10 + n, 0x1234, n, 0, 0, image, IMAGE);
+        CHECK(t[n] != NULL);
+    }
+    _run(NODES);
+    for(int n = 0; n < NODES; n++) {
+        CHECK(t[n]->status == FW_STATUS_COMPLETE);
+        _check_node(n);
+        retries += t[n]->retries;
+    }
+    if(match) CHECK(bus.dropped > 0 && retries > 0);
+}
+
+/* The node has to notice that the end of a block came before all of the
+   data did, even though the end of block frame has no sequence number */
+static void
+test_truncated(void) {
+    canfix_object *h = &node[0];
+    uint8_t data[8];
+    int before;
+
+    _setup();
+    /* Ask for the download by hand from the host's node number */
+    data[0] = NSM_FIRMWARE;
+    data[1] = 0x10;
+    data[2] = 0x34;
+    data[3] = 0x12;
+    data[4] = 0;
+    bus_current = h;
+    canfix_exec(h, NSM_START + 0x01, 5, data);
+    /* 64 bytes in four units and a window of eight */
+    data[0] = 0;
+    data[1] = 0;
+    data[2] = 4;
+    data[3] = data[4] = data[5] = data[6] = 0;
+    data[7] = 8;
+    canfix_exec(h, CH_START, 8, data);
+    for(int n = 0; n < 6; n++) { /* 42 of the 64 bytes */
+        data[0] = n + 1;
+        memset(&data[1], n, 7);
+        canfix_exec(h, CH_START, 8, data);
+    }
+    before = bus.head;
+    canfix_exec(h, CH_START, 0, data);
+    CHECK(got[0].commits == 0);
+    /* The answer is a resend from where the node got to */
+    CHECK(bus.head != before);
+    CHECK(bus.queue[before].f.id == CH_START + 1 && bus.queue[before].f.length == 5);
+    CHECK(bus.queue[before].f.data[0] == 42 && bus.queue[before].f.data[4] == FW_RESEND);
+    for(int n = 6; n < 10; n++) { /* The rest, 70 bytes is within the last unit */
+        data[0] = n + 1;
+        memset(&data[1], n, 7);
+        canfix_exec(h, CH_START, 8, data);
+    }
+    canfix_exec(h, CH_START, 0, data);
+    CHECK(got[0].commits == 1);
+    bus_current = NULL;
+}
+
+int
+main(void) {
+    srand(1);
+    for(int n = 0; n < IMAGE; n++) image[n] = rand();
+
+    test_one();
+    test_refused();
+    test_parallel(NULL, 0);
+    test_parallel(_any_channel, 20);   /* Data, acks and everything else */
+    test_parallel(_acks, 3);
+    test_parallel(_control, 5);        /* The handshakes around the data */
+    test_truncated();
+    return CHECK_RESULT();
+}